@@ -16,8 +16,8 @@
  * along with Valkyrie.  If not, see <http://www.gnu.org/licenses/>.
  */
 
-#ifndef __VK_SH_INSNS_DESC_H__
-#define __VK_SH_INSNS_DESC_H__
+/* May be included more than once, with different definitions of IDEF ()
+ * and idesctype; see sh4_run_threaded (). */
 
 /* SH-2 specific */
 static const idesctype insns_desc_sh2[] = {
@@ -262,5 +262,3 @@ static const idesctype insns_desc_sh4[] =
 	IDEF(0xF00F, 0xF00C, fmov),
 	IDEF(0xF00F, 0xF00E, fmac),
 };
-
-#endif /*__VK_SH_INSNS_DESC_H__ */
@@ -16,21 +16,28 @@
  * along with Valkyrie.  If not, see <http://www.gnu.org/licenses/>.
  */
 
-#ifndef __VK_SH_INSNS_INTERP_H__
-#define __VK_SH_INSNS_INTERP_H__
-
 #if !defined(I) || !defined(IDEF) || !(defined(IS_SH2) || defined(IS_SH4))
 #error "required macro not defined"
 #endif
 
+#ifndef __VK_SH_INSNS_INTERP_H__
+#define __VK_SH_INSNS_INTERP_H__
+
 typedef struct {
 	uint16_t mask;
 	uint16_t match;
 	itype handler;
+	const char *name;
 } idesctype;
 
 static itype insns[65536];
 
+#endif /* __VK_SH_INSNS_INTERP_H__ */
+
+/* The instruction bodies below may be expanded more than once with different
+ * definitions of I (): as separate handler functions, or as labels within a
+ * single threaded interpreter function. They must not return. */
+
 I (invalid)
 {
 	VK_CPU_ABORT (ctx, "invalid instruction %04X", inst);
@@ -814,119 +821,74 @@ I (bf)
 I (bts)
 {
 	VK_CPU_ASSERT (ctx, !ctx->in_slot);
-	if (T != 0) {
-		uint32_t pc;
-		pc = PC;
-		PC = PC + (_SIMM8 << 1) + 4;
-		delay_slot (ctx, pc + 2);
-		PC = PC - 2;
-	}
+	if (T != 0)
+		delay_branch (ctx, PC + (_SIMM8 << 1) + 4);
 }
 
 I (bfs)
 {
 	VK_CPU_ASSERT (ctx, !ctx->in_slot);
-	if (T == 0) {
-		uint32_t pc;
-		pc = PC;
-		PC = PC + (_SIMM8 << 1) + 4;
-		delay_slot (ctx, pc + 2);
-		PC = PC - 2;
-	}
+	if (T == 0)
+		delay_branch (ctx, PC + (_SIMM8 << 1) + 4);
 }
 
 I (bra)
 {
-	uint32_t pc;
-
 	VK_CPU_ASSERT (ctx, !ctx->in_slot);
 
-	pc = PC;
-	PC = PC + (_SIMM12 << 1) + 4;
-
-	delay_slot (ctx, pc + 2);
-	PC = PC - 2;
+	delay_branch (ctx, PC + (_SIMM12 << 1) + 4);
 }
 
 I (braf)
 {
-	uint32_t pc = PC;
-
 	VK_CPU_ASSERT (ctx, !ctx->in_slot);
 
-	PC = PC + RN + 4;
-
-	delay_slot (ctx, pc + 2);
-	PC = PC - 2;
+	delay_branch (ctx, PC + RN + 4);
 }
 
 I (bsr)
 {
-	uint32_t pc;
-
 	VK_CPU_ASSERT (ctx, !ctx->in_slot);
 
-	pc = PC;
 	PR = PC + 4;
-	PC = PC + (_SIMM12 << 1) + 4;
-
-	delay_slot (ctx, pc + 2);
-	PC = PC - 2;
+	delay_branch (ctx, PC + (_SIMM12 << 1) + 4);
 }
 
 I (bsrf)
 {
-	uint32_t pc;
+	uint32_t target;
 
 	VK_CPU_ASSERT (ctx, !ctx->in_slot);
 
-	pc = PC;
+	target = PC + (int32_t) RN + 4;
 	PR = PC + 4;
-	PC = PC + (int32_t) RN + 4;
-
-	delay_slot (ctx, pc + 2);
-	PC = PC - 2;
+	delay_branch (ctx, target);
 }
 
 I (jmp)
 {
-	uint32_t pc;
-
 	VK_CPU_ASSERT (ctx, !ctx->in_slot);
 	VK_CPU_ASSERT (ctx, !(RN & 1));
 
-	pc = PC;
-	PC = RN;
-
-	delay_slot (ctx, pc + 2);
-	PC = PC - 2;
+	delay_branch (ctx, RN);
 }
 
 I (jsr)
 {
-	uint32_t pc;
+	uint32_t target;
 
 	VK_CPU_ASSERT (ctx, !ctx->in_slot);
 
-	pc = PC;
-	PC = RN;
-	PR = pc + 4;
-
-	delay_slot (ctx, pc + 2);
-	PC = PC - 2;
+	target = RN;
+	PR = PC + 4;
+	delay_branch (ctx, target);
 }
 
 I (rts)
 {
-	uint32_t pc;
-
 	VK_CPU_ASSERT (ctx, !ctx->in_slot);
 
-	pc = PC;
-	PC = PR;// + 4;
-
-	delay_slot (ctx, pc + 2);
-	PC = PC - 2;
+	delay_branch (ctx, PR);
 }
 
 /****************************************************************************
@@ -1020,25 +982,22 @@ I (nop)
 
 I (rte)
 {
-	uint32_t pc;
+	uint32_t target;
 
 	VK_CPU_ASSERT (ctx, !ctx->in_slot);
 
 #ifdef IS_SH2
-	pc = PC;
-	PC = R32 (ctx, SP);
+	target = R32 (ctx, SP);
 	SP += 4;
 	set_sr (ctx, R32 (ctx, SP));
 	SP += 4;
 #endif
 #ifdef IS_SH4
-	pc = PC;
-	PC = SPC;
+	target = SPC;
 	set_sr (ctx, SSR.full);
 #endif
 
-	delay_slot (ctx, pc + 2);
-	PC = PC - 2;
+	delay_branch (ctx, target);
 }
 
 I (sleep)
@@ -1172,7 +1131,8 @@ I (ocbwb)
 
 I (pref)
 {
-	//sync_store_queues (ctx);
+	if ((RN >> 26) == (0xE0000000 >> 26))
+		sh4_sq_flush (ctx, RN);
 }
 
 /*****************************************************************************
@@ -1578,21 +1538,29 @@ I (fmac)
 	FRN.f += FRM.f * FR(0).f;
 }
 
-static const float fsca_alpha = (2.0f * (float) M_PI) / 65536.0f;
+/* FSCA, FSRRA, FIPR and FTRV are only defined for single precision; the
+ * table and SSE paths are taken only then, and PR=1 keeps the plain
+ * single-precision code. */
 
 I (fsca)
 {
-	float angle = (FPUL.u & 0xFFFF) * fsca_alpha;
 	unsigned n = _RN & ~1;
-	FR(n+0).f = sinf (angle);
-	FR(n+1).f = cosf (angle);
+	unsigned a = FPUL.u & 0xFFFF;
+
+	if (!FPSCR.bit.pr) {
+		FR(n+0).f = fsca_table[a];
+		FR(n+1).f = fsca_table[a + 0x4000];
+	} else {
+		float angle = a * ((2.0f * (float) M_PI) / 65536.0f);
+		FR(n+0).f = sinf (angle);
+		FR(n+1).f = cosf (angle);
+	}
 }
 
 I (fsrra)
 {
-	if (FRN.f < 0)
-		return;
-	FRN.f = 1.0f / sqrtf (FRN.f);
+	if (FRN.f >= 0)
+		FRN.f = 1.0f / sqrtf (FRN.f);
 }
 
 I (fsqrt)
@@ -1613,44 +1581,75 @@ I (fipr)
 
 	CHECK_FP
 
-	/* XXX FPSCR.bit.pr */
+#ifdef __SSE__
+	if (!FPSCR.bit.pr) {
+		__m128 p, s;
 
-	FR(n+3).f = FR(n+0).f * FR(m+0).f +
-	            FR(n+1).f * FR(m+1).f +
-	            FR(n+2).f * FR(m+2).f +
-	            FR(n+3).f * FR(m+3).f;
+		p = _mm_mul_ps (_mm_load_ps (&FR(n).f), _mm_load_ps (&FR(m).f));
+
+		/* Sum left to right, as the scalar code does */
+		s = _mm_add_ss (p, _mm_shuffle_ps (p, p, 1));
+		s = _mm_add_ss (s, _mm_movehl_ps (p, p));
+		s = _mm_add_ss (s, _mm_shuffle_ps (p, p, 3));
+
+		_mm_store_ss (&FR(n+3).f, s);
+	} else
+#endif
+	{
+		FR(n+3).f = FR(n+0).f * FR(m+0).f +
+		            FR(n+1).f * FR(m+1).f +
+		            FR(n+2).f * FR(m+2).f +
+		            FR(n+3).f * FR(m+3).f;
+	}
 }
 
 I (ftrv)
 {
 	unsigned n = _RN & ~3;
-	float res[4];
 
 	CHECK_FP
 
-	/* XXX FPSCR.bit.pr */
-
-	res[0] = XF(0).f  * FR(n+0).f +
-	         XF(4).f  * FR(n+1).f +
-	         XF(8).f  * FR(n+2).f +
-	         XF(12).f * FR(n+3).f;
-	res[1] = XF(1).f  * FR(n+0).f +
-	         XF(5).f  * FR(n+1).f +
-	         XF(9).f  * FR(n+2).f +
-	         XF(13).f * FR(n+3).f;
-	res[2] = XF(2).f  * FR(n+0).f +
-	         XF(6).f  * FR(n+1).f +
-	         XF(10).f * FR(n+2).f +
-	         XF(14).f * FR(n+3).f;
-	res[3] = XF(3).f  * FR(n+0).f +
-	         XF(7).f  * FR(n+1).f +
-	         XF(11).f * FR(n+2).f +
-	         XF(15).f * FR(n+3).f;
-
-	FR(n+0).f = res[0];
-	FR(n+1).f = res[1];
-	FR(n+2).f = res[2];
-	FR(n+3).f = res[3];
+#ifdef __SSE__
+	if (!FPSCR.bit.pr) {
+		__m128 res;
+
+		/* XMTRX is column-major: XF(4*i..4*i+3) is column i */
+		res = _mm_mul_ps (_mm_load_ps (&XF(0).f), _mm_set1_ps (FR(n+0).f));
+		res = _mm_add_ps (res, _mm_mul_ps (_mm_load_ps (&XF(4).f),
+		                                   _mm_set1_ps (FR(n+1).f)));
+		res = _mm_add_ps (res, _mm_mul_ps (_mm_load_ps (&XF(8).f),
+		                                   _mm_set1_ps (FR(n+2).f)));
+		res = _mm_add_ps (res, _mm_mul_ps (_mm_load_ps (&XF(12).f),
+		                                   _mm_set1_ps (FR(n+3).f)));
+
+		_mm_store_ps (&FR(n).f, res);
+	} else
+#endif
+	{
+		float res[4];
+
+		res[0] = XF(0).f  * FR(n+0).f +
+		         XF(4).f  * FR(n+1).f +
+		         XF(8).f  * FR(n+2).f +
+		         XF(12).f * FR(n+3).f;
+		res[1] = XF(1).f  * FR(n+0).f +
+		         XF(5).f  * FR(n+1).f +
+		         XF(9).f  * FR(n+2).f +
+		         XF(13).f * FR(n+3).f;
+		res[2] = XF(2).f  * FR(n+0).f +
+		         XF(6).f  * FR(n+1).f +
+		         XF(10).f * FR(n+2).f +
+		         XF(14).f * FR(n+3).f;
+		res[3] = XF(3).f  * FR(n+0).f +
+		         XF(7).f  * FR(n+1).f +
+		         XF(11).f * FR(n+2).f +
+		         XF(15).f * FR(n+3).f;
+
+		FR(n+0).f = res[0];
+		FR(n+1).f = res[1];
+		FR(n+2).f = res[2];
+		FR(n+3).f = res[3];
+	}
 }
 
 I (fcmpeq)
@@ -1676,5 +1675,3 @@ I (fcmpgt)
 }
 
 #endif /* IS_SH4 */
-
-#endif /* __VK_SH_INSNS_INTERP_H__ */
@@ -38,10 +38,15 @@
 #include "vk/core.h"
 #include "vk/cpu.h"
 #include "vk/state.h"
+#include "vk/trace.h"
 
 #include "sh4.h"
 #include "sh4-ireg.h"
 
+#ifdef __SSE__
+#include <xmmintrin.h>
+#endif
+
 /* Helper Macros */
 
 #define _RN	((inst >> 8) & 15)
@@ -63,13 +68,13 @@
 #define DBR	ctx->regs.dbr
 #define SGR	ctx->regs.sgr
 
-#define R(n_)	ctx->regs.r[n_]
+#define R(n_)	ctx->bank.r[(n_) >> 3][(n_) & 7]
 #define R0	R(0)
 #define RN	R(_RN)
 #define RM	R(_RM)
 #define SP	R(15)
 
-#define RBANK(n_) ctx->regs.rbank[n_]
+#define RBANK(n_) ctx->bank.rbank[n_]
 
 #define T	SR.bit.t
 #define S	SR.bit.s
@@ -79,11 +84,11 @@
 #define FPSCR	ctx->regs.fpscr
 #define FPUL	ctx->regs.fpul
 
-#define FR(n_)	ctx->regs.f.f[n_]
-#define DR(n_)	ctx->regs.f.d[(n_)/2]
+#define FR(n_)	ctx->bank.fr->f[n_]
+#define DR(n_)	ctx->bank.fr->d[(n_)/2]
 
-#define XF(n_)	ctx->regs.x.f[n_]
-#define XD(n_)	ctx->regs.x.d[(n_)/2]
+#define XF(n_)	ctx->bank.xf->f[n_]
+#define XD(n_)	ctx->bank.xf->d[(n_)/2]
 
 #define FRN	FR(_RN)
 #define FRM	FR(_RM)
@@ -128,35 +133,32 @@ static int	sh4_set_irq_state (vk_cpu_t *cpu, unsigned num, vk_irq_state_t state)
 
 /* Generic Helpers */
 
-static void
-swap_r_banks (sh4_t *ctx)
+static unsigned
+get_r_bank_num (sh4_sr_t sr)
 {
-	unsigned i;
-	for (i = 0; i < 8; i++) {
-		uint32_t tmp = R(i);
-		R(i) = RBANK(i);
-		RBANK(i) = tmp;
-	}
+	/* In user mode, bank 0 is always selected; in privileged mode, bank
+	 * SR.bit.rb is selected; it follows that bank 1 is only selected if
+	 * both MD and RB are set. */
+	return sr.bit.md & sr.bit.rb;
 }
 
 static void
-swap_f_banks (sh4_t *ctx)
+update_r_banks (sh4_t *ctx)
 {
-	unsigned i;
-	for (i = 0; i < 16; i++) {
-		uint32_t tmp = FR(i).u;
-		FR(i).u = XF(i).u;
-		XF(i).u = tmp;
-	}
+	unsigned num = get_r_bank_num (SR);
+
+	ctx->bank.r[0] = ctx->regs.rbank[num];
+	ctx->bank.r[1] = ctx->regs.rhi;
+	ctx->bank.rbank = ctx->regs.rbank[num ^ 1];
 }
 
-static unsigned
-get_r_bank_num (sh4_sr_t sr)
+static void
+update_f_banks (sh4_t *ctx)
 {
-	/* In user mode, bank 0 is always selected; in privileged mode, bank
-	 * SR.bit.rb is selected; it follows that bank 1 is only selected if
-	 * both MD and RB are set. */
-	return sr.bit.md & sr.bit.rb;
+	unsigned num = FPSCR.bit.fr;
+
+	ctx->bank.fr = &ctx->regs.fbank[num];
+	ctx->bank.xf = &ctx->regs.fbank[num ^ 1];
 }
 
 static void
@@ -166,9 +168,9 @@ set_sr (sh4_t *ctx, uint32_t data)
 
 	SR.full = data & 0x700083F3;
 
-	/* Swap R banks if required */
+	/* Switch R banks if required */
 	if (get_r_bank_num (old) != get_r_bank_num (SR))
-		swap_r_banks (ctx);
+		update_r_banks (ctx);
 
 	/* If any IRQ-related bits changed, re-validate pending IRQs */
 	if ((old.bit.i != SR.bit.i) ||
@@ -188,9 +190,9 @@ set_fpscr (sh4_t *ctx, uint32_t val)
 	sh4_fpscr_t old = FPSCR;
 
 	FPSCR.full = val & 0x003FFFFF;
-	/* Swap FR banks if required */
+	/* Switch FR banks if required */
 	if (old.bit.fr != FPSCR.bit.fr)
-		swap_f_banks (ctx);
+		update_f_banks (ctx);
 
 	/* SZ and PR can't be both set */
 	if (FPSCR.bit.sz && FPSCR.bit.pr)
@@ -801,30 +803,71 @@ sh4_ireg_put (sh4_t *ctx, unsigned size, uint32_t addr, uint64_t val)
 	return 0;
 }
 
-/* Store Queues */
+/* Store Queues
+ *
+ * Writes to 0xE0000000-0xE3FFFFFF land in one of two 32-byte buffers,
+ * selected by bit 5 of the address; reads return their contents. PREF on
+ * an SQ address writes the whole buffer out as a single burst to the area
+ * selected by QACR0/1. */
 
 static uint32_t
 get_sq_addr (sh4_t *ctx, uint32_t addr)
 {
 	uint32_t sq_num = (addr >> 5) & 1;
 	uint32_t sq_base = (sq_num == 0) ?
-	                   vk_buffer_get (ctx->iregs, 4, SHRINK (CCN_QACR0)) :
-	                   vk_buffer_get (ctx->iregs, 4, SHRINK (CCN_QACR1));
+	                   vk_buffer_get32_le (ctx->iregs, SHRINK (CCN_QACR0)) :
+	                   vk_buffer_get32_le (ctx->iregs, SHRINK (CCN_QACR1));
 	return ((sq_base & 0x1C) << 24) | (addr & 0x03FFFFE0);
 }
 
 static int
 sh4_sq_get (sh4_t *ctx, unsigned size, uint32_t addr, void *val)
 {
-	uint32_t sq_addr = get_sq_addr (ctx, addr);
-	return sh4_get (ctx, size, sq_addr | (addr & 0x1F), val);
+	uint8_t *sq = (uint8_t *) ctx->sq[(addr >> 5) & 1];
+	uint32_t offs = addr & 0x1F;
+
+	switch (size) {
+	case 4:
+		set_ptr (val, size, *(uint32_t *) &sq[offs]);
+		break;
+	case 8:
+		set_ptr (val, size, *(uint64_t *) &sq[offs]);
+		break;
+	default:
+		return -1;
+	}
+	return 0;
 }
 
 static int
 sh4_sq_put (sh4_t *ctx, unsigned size, uint32_t addr, uint64_t val)
 {
-	uint32_t sq_addr = get_sq_addr (ctx, addr) | (addr & 0x1F);
-	return sh4_put (ctx, size, sq_addr | (addr & 0x1F), val);
+	uint8_t *sq = (uint8_t *) ctx->sq[(addr >> 5) & 1];
+	uint32_t offs = addr & 0x1F;
+
+	switch (size) {
+	case 4:
+		*(uint32_t *) &sq[offs] = (uint32_t) val;
+		break;
+	case 8:
+		*(uint64_t *) &sq[offs] = val;
+		break;
+	default:
+		return -1;
+	}
+	return 0;
+}
+
+static void
+sh4_sq_flush (sh4_t *ctx, uint32_t addr)
+{
+	uint32_t sq_addr = get_sq_addr (ctx, addr);
+	int ret;
+
+	ret = vk_mmap_put_block (ctx->base.mmap, sq_addr,
+	                         ctx->sq[(addr >> 5) & 1], 32);
+	if (ret)
+		VK_CPU_ERROR (ctx, "unhandled SQ burst @%08X", sq_addr);
 }
 
 /* Bus Access */
@@ -1010,6 +1053,9 @@ sh4_set_irq_state (vk_cpu_t *cpu, unsigned num, vk_irq_state_t state)
 
 	ctx->intc.irqs[num].state = state;
 
+	if (state == VK_IRQ_STATE_RAISED)
+		vk_trace_event (VK_TRACE_IRQ_RAISE, num, ctx->intc.irqs[num].code);
+
 	/* Handle NMI */
 	if (num == SH4_IESOURCE_NMI) {
 		if (state == VK_IRQ_STATE_RAISED) {
@@ -1052,6 +1098,8 @@ sh4_process_irqs (vk_cpu_t *cpu)
 
 		PC = VBR + ctx->intc.irqs[index].offset;
 
+		vk_trace_event (VK_TRACE_IRQ_TAKE, index, PC);
+
 		VK_CPU_LOG (ctx, "IRQ taken: SR.i=%X PRI=%X VBR=%08X offs=%X code=%X; jumping at %08X",
 		            SR.bit.i, ctx->intc.irqs[index].priority,
 		            VBR, ctx->intc.irqs[index].offset,
@@ -1076,7 +1124,49 @@ sh4_process_irqs (vk_cpu_t *cpu)
 
 /* Instructions */
 
-static void delay_slot (sh4_t *ctx, uint32_t pc);
+/* FSCA takes a 16-bit fraction of a turn: sin () of each of the 64K angles,
+ * plus one more quarter turn so that cos () is a lookup at +0x4000. */
+static float fsca_table[0x10000 + 0x4000];
+
+static void
+setup_fsca_table (void)
+{
+	unsigned i;
+
+	for (i = 0; i < NUMELEM (fsca_table); i++)
+		fsca_table[i] = (float) sin (i * (2.0 * M_PI / 65536.0));
+}
+
+/* Delayed branches don't execute their slot themselves: they record where
+ * the slot instruction lives and jump straight away. The run loop then
+ * fetches the slot from slot_pc with PC already pointing at the branch
+ * target, and doesn't advance PC past it; see sh4_advance (). */
+
+static inline void
+delay_branch (sh4_t *ctx, uint32_t target)
+{
+	ctx->slot_pc = PC + 2;
+	ctx->slot_pending = true;
+	PC = target;
+}
+
+static inline void
+sh4_advance (sh4_t *ctx)
+{
+	if (ctx->slot_pending) {
+		ctx->slot_pending = false;
+		ctx->in_slot = true;
+	} else if (ctx->in_slot)
+		ctx->in_slot = false;
+	else
+		PC += 2;
+}
+
+static inline bool
+sh4_in_delay (sh4_t *ctx)
+{
+	return ctx->slot_pending || ctx->in_slot;
+}
 
 typedef void (* itype) (sh4_t *ctx, uint16_t inst);
 
@@ -1088,6 +1178,7 @@ typedef void (* itype) (sh4_t *ctx, uint16_t inst);
 		mask_, \
 		match_, \
 		sh4_interp_##name_, \
+		#name_, \
 	}
 
 #define IS_SH4
@@ -1099,6 +1190,13 @@ typedef void (* itype) (sh4_t *ctx, uint16_t inst);
 #undef IDEF
 #undef IS_SH4
 
+/* Each instruction descriptor is also an instruction class, numbered from 1;
+ * class 0 is the invalid instruction. Used for statistics only. */
+static uint8_t insn_class[65536];
+static uint8_t fused_kind[65536];
+static const idesctype *insn_class_desc[256];
+static unsigned num_insn_classes;
+
 #define CHECK_COLLISION \
 	do { \
 		if (insns[inst] != sh4_interp_invalid) { \
@@ -1107,34 +1205,44 @@ typedef void (* itype) (sh4_t *ctx, uint16_t inst);
 		} \
 	} while (0);
 
+#define SET_HANDLER \
+	do { \
+		insns[inst] = desc[i].handler; \
+		insn_class[inst] = cls; \
+	} while (0)
+
 static void
 setup_insns_handlers_from_table (const idesctype *desc,
                                  unsigned size)
 {
-	unsigned i, j;
+	unsigned i, j, cls;
 	uint16_t inst;
 
 	for (i = 0; i < size; i++) {
+		cls = ++num_insn_classes;
+		VK_ASSERT (cls < NUMELEM (insn_class_desc));
+		insn_class_desc[cls] = &desc[i];
+
 		switch (desc[i].mask) {
 		case 0xF000:
 			for (j = 0; j < 4096; j++) {
 				inst = desc[i].match | j;
 				CHECK_COLLISION;
-				insns[inst] = desc[i].handler;
+				SET_HANDLER;
 			}
 			break;
 		case 0xF00F:
 			for (j = 0; j < 256; j++) {
 				inst = desc[i].match | (j << 4);
 				CHECK_COLLISION;
-				insns[inst] = desc[i].handler;
+				SET_HANDLER;
 			}
 			break;
 		case 0xFF00:
 			for (j = 0; j < 256; j++) {
 				inst = desc[i].match | j;
 				CHECK_COLLISION;
-				insns[inst] = desc[i].handler;
+				SET_HANDLER;
 			}
 			break;
 		case 0xF08F:
@@ -1143,34 +1251,34 @@ setup_insns_handlers_from_table (const idesctype *desc,
 				       ((j & 7) << 4) |
 				       ((j >> 3) << 8);
 				CHECK_COLLISION;
-				insns[inst] = desc[i].handler;
+				SET_HANDLER;
 			}
 			break;
 		case 0xF0FF:
 			for (j = 0; j < 16; j++) {
 				inst = desc[i].match | (j << 8);
 				CHECK_COLLISION;
-				insns[inst] = desc[i].handler;
+				SET_HANDLER;
 			}
 			break;
 		case 0xF1FF:
 			for (j = 0; j < 8; j++) {
 				inst = desc[i].match | (j << 9);
 				CHECK_COLLISION;
-				insns[inst] = desc[i].handler;
+				SET_HANDLER;
 			}
 			break;
 		case 0xF3FF:
 			for (j = 0; j < 4; j++) {
 				inst = desc[i].match | (j << 10);
 				CHECK_COLLISION;
-				insns[inst] = desc[i].handler;
+				SET_HANDLER;
 			}
 			break;
 		case 0xFFFF:
 			inst = desc[i].match;
 			CHECK_COLLISION;
-			insns[inst] = desc[i].handler;
+			SET_HANDLER;
 			break;
 		default:
 			VK_ABORT ("unhandled mask %04X", desc[i].mask);
@@ -1179,19 +1287,408 @@ setup_insns_handlers_from_table (const idesctype *desc,
 }
 
 #undef CHECK_COLLISION
+#undef SET_HANDLER
 
 static void
 setup_insns_handlers (void)
 {
 	unsigned i;
 
-	for (i = 0; i < 65536; i++)
+	for (i = 0; i < 65536; i++) {
 		insns[i] = sh4_interp_invalid;
+		insn_class[i] = 0;
+		fused_kind[i] = 0;
+	}
+	num_insn_classes = 0;
 
 	setup_insns_handlers_from_table (insns_desc_sh2, NUMELEM (insns_desc_sh2));
 	setup_insns_handlers_from_table (insns_desc_sh4, NUMELEM (insns_desc_sh4));
 }
 
+/* Superinstructions
+ *
+ * Instructions that are usually followed by a specific one, such as a
+ * compare followed by a conditional branch, dt closing a loop, or a
+ * PC-relative load of a call target, get a fused handler. It peeks at the
+ * next opcode and, if that completes the pair, executes it straight away,
+ * skipping one trip through the run loop. Interrupts are not accepted
+ * between the two halves of a pair. */
+
+static bool
+fetch_fused (sh4_t *ctx, uint16_t *next)
+{
+	uint32_t pc = PC + 2;
+
+	if (ctx->in_slot)
+		return false;
+
+	sh4_fetch (ctx, pc, next);
+	*next = vk_cpu_patch ((vk_cpu_t *) ctx, pc & 0x1FFFFFFF, *next);
+	return true;
+}
+
+#define FUSED_STEP(name_, next_) \
+	do { \
+		PC += 2; \
+		ctx->base.remaining --; \
+		sh4_interp_##name_ (ctx, next_); \
+	} while (0)
+
+#define FUSE_BRANCH(first_) \
+	static void \
+	sh4_interp_##first_##_fused (sh4_t *ctx, uint16_t inst) \
+	{ \
+		uint16_t next; \
+	\
+		sh4_interp_##first_ (ctx, inst); \
+		if (!fetch_fused (ctx, &next)) \
+			return; \
+		switch (next >> 8) { \
+		case 0x89: \
+			FUSED_STEP (bt, next); \
+			break; \
+		case 0x8B: \
+			FUSED_STEP (bf, next); \
+			break; \
+		case 0x8D: \
+			FUSED_STEP (bts, next); \
+			break; \
+		case 0x8F: \
+			FUSED_STEP (bfs, next); \
+			break; \
+		} \
+	}
+
+FUSE_BRANCH (dt)
+FUSE_BRANCH (cmpeq)
+FUSE_BRANCH (cmpim)
+FUSE_BRANCH (cmphs)
+FUSE_BRANCH (cmphi)
+FUSE_BRANCH (cmpge)
+FUSE_BRANCH (cmpgt)
+FUSE_BRANCH (cmppz)
+FUSE_BRANCH (cmppl)
+FUSE_BRANCH (tst)
+FUSE_BRANCH (tsti)
+
+static void
+sh4_interp_movli_fused (sh4_t *ctx, uint16_t inst)
+{
+	uint16_t next;
+
+	sh4_interp_movli (ctx, inst);
+	if (!fetch_fused (ctx, &next))
+		return;
+	if ((next & 0xF0FF) == 0x400B)
+		FUSED_STEP (jsr, next);
+	else if ((next & 0xF0FF) == 0x402B)
+		FUSED_STEP (jmp, next);
+}
+
+#undef FUSE_BRANCH
+#undef FUSED_STEP
+
+/* What completes a pair; sh4_run_threaded () has no fused handlers, and
+ * looks up the kind of the first opcode in fused_kind instead. */
+enum {
+	FUSE_NONE,
+	FUSE_COND_BRANCH,	/* bt, bf, bt/s, bf/s */
+	FUSE_CALL,		/* jsr, jmp */
+};
+
+static const struct {
+	itype handler;
+	itype fused;
+	uint8_t kind;
+} fused_handlers[] = {
+	{ sh4_interp_dt, sh4_interp_dt_fused, FUSE_COND_BRANCH },
+	{ sh4_interp_cmpeq, sh4_interp_cmpeq_fused, FUSE_COND_BRANCH },
+	{ sh4_interp_cmpim, sh4_interp_cmpim_fused, FUSE_COND_BRANCH },
+	{ sh4_interp_cmphs, sh4_interp_cmphs_fused, FUSE_COND_BRANCH },
+	{ sh4_interp_cmphi, sh4_interp_cmphi_fused, FUSE_COND_BRANCH },
+	{ sh4_interp_cmpge, sh4_interp_cmpge_fused, FUSE_COND_BRANCH },
+	{ sh4_interp_cmpgt, sh4_interp_cmpgt_fused, FUSE_COND_BRANCH },
+	{ sh4_interp_cmppz, sh4_interp_cmppz_fused, FUSE_COND_BRANCH },
+	{ sh4_interp_cmppl, sh4_interp_cmppl_fused, FUSE_COND_BRANCH },
+	{ sh4_interp_tst, sh4_interp_tst_fused, FUSE_COND_BRANCH },
+	{ sh4_interp_tsti, sh4_interp_tsti_fused, FUSE_COND_BRANCH },
+	{ sh4_interp_movli, sh4_interp_movli_fused, FUSE_CALL },
+};
+
+static void
+setup_fused_handlers (void)
+{
+	unsigned i, j;
+
+	for (i = 0; i < 65536; i++)
+		for (j = 0; j < NUMELEM (fused_handlers); j++)
+			if (insns[i] == fused_handlers[j].handler) {
+				insns[i] = fused_handlers[j].fused;
+				fused_kind[i] = fused_handlers[j].kind;
+				break;
+			}
+}
+
+static inline bool
+is_fused_pair (uint16_t first, uint16_t next)
+{
+	switch (fused_kind[first]) {
+	case FUSE_COND_BRANCH:
+		return (next >> 8) == 0x89 || (next >> 8) == 0x8B ||
+		       (next >> 8) == 0x8D || (next >> 8) == 0x8F;
+	case FUSE_CALL:
+		return (next & 0xF0FF) == 0x400B || (next & 0xF0FF) == 0x402B;
+	}
+	return false;
+}
+
+/* Sampling Profiler */
+
+static bool
+is_store_insn (uint16_t inst)
+{
+	switch (inst >> 12) {
+	case 0x0:
+		/* mov.x Rm,@(R0,Rn); movca.l R0,@Rn */
+		return (inst & 0xF) == 4 || (inst & 0xF) == 5 ||
+		       (inst & 0xF) == 6 || (inst & 0xFF) == 0xC3;
+	case 0x1:
+		/* mov.l Rm,@(disp,Rn) */
+		return true;
+	case 0x2:
+		/* mov.x Rm,@Rn; mov.x Rm,@-Rn */
+		return (inst & 0xF) <= 6 && (inst & 0xF) != 3;
+	case 0x4:
+		/* sts.l/stc.l xx,@-Rn; tas.b @Rn */
+		return (inst & 0xE) == 2 || (inst & 0xFF) == 0x1B;
+	case 0x8:
+		/* mov.x R0,@(disp,Rn) */
+		return ((inst >> 8) & 0xF) <= 1;
+	case 0xC:
+		/* mov.x R0,@(disp,GBR); and/or/xor.b #imm,@(R0,GBR) */
+		return ((inst >> 8) & 0xF) <= 2 || ((inst >> 8) & 0xF) >= 0xD;
+	case 0xF:
+		/* fmov FRm,@(R0,Rn); fmov FRm,@Rn; fmov FRm,@-Rn */
+		return (inst & 0xF) == 7 || (inst & 0xF) == 0xA || (inst & 0xF) == 0xB;
+	}
+	return false;
+}
+
+/* A sample is attributed to an idle loop if a backward branch closes a
+ * loop of at most MAX_IDLE_LOOP_INSNS instructions around its PC, and the
+ * loop body writes nothing to memory; this is what polling a flag or a
+ * register looks like. */
+
+#define MAX_IDLE_LOOP_INSNS 8
+
+static bool
+is_idle_loop (sh4_t *ctx, uint32_t pc)
+{
+	uint32_t addr = pc, target, end;
+	unsigned i;
+
+	/* Find the branch closing the loop. */
+	for (i = 0; i < MAX_IDLE_LOOP_INSNS; i++, addr += 2) {
+		uint16_t inst;
+		int32_t disp;
+
+		sh4_fetch (ctx, addr, &inst);
+		switch (inst >> 8) {
+		case 0x89: /* bt */
+		case 0x8B: /* bf */
+			disp = (int8_t) (inst & 0xFF);
+			end = addr;
+			break;
+		case 0x8D: /* bt/s */
+		case 0x8F: /* bf/s */
+			disp = (int8_t) (inst & 0xFF);
+			end = addr + 2;
+			break;
+		default:
+			if ((inst >> 12) == 0xA) { /* bra */
+				disp = signext_n_32 (inst & 0xFFF, 11);
+				end = addr + 2;
+				break;
+			}
+			/* Any other control transfer leaves the loop */
+			if ((inst & 0xF0FF) == 0x402B || inst == 0x000B ||
+			    (inst & 0xF0FF) == 0x0023 || (inst >> 12) == 0xB)
+				return false;
+			continue;
+		}
+
+		/* The branch must go back at or before the sampled PC, and
+		 * the loop, delay slot included, must be short. */
+		target = addr + 4 + disp * 2;
+		if (target > pc ||
+		    end - target > (MAX_IDLE_LOOP_INSNS - 1) * 2)
+			return false;
+
+		/* Check the whole loop body, not only what follows PC. */
+		for (addr = target; addr <= end; addr += 2) {
+			sh4_fetch (ctx, addr, &inst);
+			if (is_store_insn (inst))
+				return false;
+		}
+		return true;
+	}
+	return false;
+}
+
+static void
+sh4_profile_sample (sh4_t *ctx)
+{
+	vk_profile_entry_t *entry;
+	bool is_new;
+
+	entry = vk_profile_sample (ctx->profile, PC, &is_new);
+	if (is_new)
+		entry->idle = is_idle_loop (ctx, PC);
+}
+
+/* Instruction Statistics
+ *
+ * Counts how often each instruction class, pair and triple of consecutive
+ * classes is executed; this is what picks the superinstructions above.
+ * Triples are kept in a fixed-size hash table; those that don't fit are
+ * only counted as dropped. */
+
+#define OPSTATS_HASH_BITS	18
+#define OPSTATS_HASH_SIZE	(1 << OPSTATS_HASH_BITS)
+#define OPSTATS_NUM_TOP		64
+
+struct sh4_opstats_t {
+	uint64_t num_insns;
+	uint64_t num_dropped;
+	uint8_t prev[2];
+	uint64_t singles[256];
+	uint64_t pairs[256 * 256];
+	unsigned num_triples;
+	struct {
+		uint32_t key;
+		uint32_t count;
+	} triples[OPSTATS_HASH_SIZE];
+};
+
+typedef struct {
+	uint32_t key;
+	uint64_t count;
+} opstats_entry_t;
+
+static void
+sh4_opstats_record (sh4_opstats_t *stats, uint16_t inst)
+{
+	unsigned cls = insn_class[inst];
+	uint32_t key, h;
+
+	stats->singles[cls]++;
+	if (stats->num_insns >= 1)
+		stats->pairs[(stats->prev[0] << 8) | cls]++;
+	if (stats->num_insns >= 2) {
+		key = (1 << 24) | (stats->prev[1] << 16) | (stats->prev[0] << 8) | cls;
+		h = (key * 2654435761u) >> (32 - OPSTATS_HASH_BITS);
+		while (stats->triples[h].key && stats->triples[h].key != key)
+			h = (h + 1) % OPSTATS_HASH_SIZE;
+		if (stats->triples[h].key)
+			stats->triples[h].count++;
+		else if (stats->num_triples < OPSTATS_HASH_SIZE / 2) {
+			stats->triples[h].key = key;
+			stats->triples[h].count = 1;
+			stats->num_triples++;
+		} else
+			stats->num_dropped++;
+	}
+
+	stats->prev[1] = stats->prev[0];
+	stats->prev[0] = cls;
+	stats->num_insns++;
+}
+
+static const char *
+get_insn_class_name (unsigned cls)
+{
+	return insn_class_desc[cls] ? insn_class_desc[cls]->name : "invalid";
+}
+
+static int
+compare_opstats_entries (const void *a_, const void *b_)
+{
+	const opstats_entry_t *a = (const opstats_entry_t *) a_;
+	const opstats_entry_t *b = (const opstats_entry_t *) b_;
+
+	return (a->count < b->count) ? 1 : (a->count > b->count) ? -1 : 0;
+}
+
+static void
+print_opstats_entries (FILE *fp, const char *title, opstats_entry_t *entries,
+                       unsigned num, unsigned len, uint64_t total)
+{
+	unsigned i, j;
+
+	qsort (entries, num, sizeof (opstats_entry_t), compare_opstats_entries);
+
+	fprintf (fp, "\n# %s\n", title);
+	for (i = 0; i < num && i < OPSTATS_NUM_TOP; i++) {
+		fprintf (fp, "%12llu %6.2f%% ",
+		         (unsigned long long) entries[i].count,
+		         100.0 * entries[i].count / total);
+		for (j = 0; j < len; j++)
+			fprintf (fp, " %s", get_insn_class_name (
+			         (entries[i].key >> (8 * (len - j - 1))) & 0xFF));
+		fprintf (fp, "\n");
+	}
+}
+
+static int
+sh4_opstats_report (sh4_opstats_t *stats, const char *path)
+{
+	opstats_entry_t *entries;
+	unsigned i, num;
+	FILE *fp;
+
+	if (!stats->num_insns)
+		return 0;
+
+	entries = (opstats_entry_t *) calloc (256 * 256, sizeof (opstats_entry_t));
+	if (!entries)
+		return -1;
+
+	fp = fopen (path, "w");
+	if (!fp) {
+		free (entries);
+		return -1;
+	}
+
+	fprintf (fp, "# %llu instructions, %llu triples dropped\n",
+	         (unsigned long long) stats->num_insns,
+	         (unsigned long long) stats->num_dropped);
+
+	for (i = 0, num = 0; i < 256; i++)
+		if (stats->singles[i])
+			entries[num++] = (opstats_entry_t) { i, stats->singles[i] };
+	print_opstats_entries (fp, "instructions", entries, num, 1,
+	                       stats->num_insns);
+
+	for (i = 0, num = 0; i < 256 * 256; i++)
+		if (stats->pairs[i])
+			entries[num++] = (opstats_entry_t) { i, stats->pairs[i] };
+	print_opstats_entries (fp, "pairs", entries, num, 2,
+	                       stats->num_insns - 1);
+
+	for (i = 0, num = 0; i < OPSTATS_HASH_SIZE && num < 256 * 256; i++)
+		if (stats->triples[i].key)
+			entries[num++] = (opstats_entry_t) {
+				stats->triples[i].key & 0xFFFFFF,
+				stats->triples[i].count
+			};
+	print_opstats_entries (fp, "triples", entries, num, 3,
+	                       stats->num_insns - 2);
+
+	fclose (fp);
+	free (entries);
+	return 0;
+}
+
 /* Execution */
 
 static void
@@ -1203,38 +1700,161 @@ sh4_step (sh4_t *ctx, uint32_t pc)
 
 	inst = vk_cpu_patch ((vk_cpu_t *) ctx, pc & 0x1FFFFFFF, inst);
 
+	if (ctx->opstats)
+		sh4_opstats_record (ctx->opstats, inst);
+
 	insns[inst] (ctx, inst);
 
 	ctx->base.remaining --;
 }
 
-static void
-delay_slot (sh4_t *ctx, uint32_t pc)
-{
-	ctx->in_slot = true;
-	sh4_step (ctx, pc);
-	ctx->in_slot = false;
-}
-
 static int
 sh4_run (vk_cpu_t *cpu, int cycles)
 {
 	sh4_t *ctx = (sh4_t *) cpu;
 
 	cpu->remaining = cycles;
-	while (cpu->remaining > 0) {
-		if (cpu->state != VK_CPU_STATE_RUN)
+	while (cpu->remaining > 0 || sh4_in_delay (ctx)) {
+		if (sh4_in_delay (ctx)) {
+			/* No state changes or interrupts between a branch and
+			 * its slot */
+			sh4_step (ctx, ctx->slot_pc);
+			sh4_advance (ctx);
+			continue;
+		}
+		if (cpu->state != VK_CPU_STATE_RUN) {
+			cpu->num_insns += cycles - cpu->remaining;
+			if (ctx->profile)
+				ctx->profile->num_sleep_cycles += cpu->remaining;
 			return 0;
+		}
 		sh4_process_irqs (cpu);
+		if (ctx->profile && --ctx->profile->countdown == 0)
+			sh4_profile_sample (ctx);
 		sh4_step (ctx, PC);
-		PC += 2;
+		sh4_advance (ctx);
 	}
+	cpu->num_insns += cycles - cpu->remaining;
 	/* XXX BSC, SCI */
 	sh4_tmu_run (ctx, cycles);
 	//sh4_dmac_run (ctx, cycles);
 	return -cpu->remaining;
 }
 
+/* Threaded build of the interpreter: the same instruction bodies, expanded
+ * as labels within this function and dispatched with computed gotos instead
+ * of indirect calls. The profiling and statistics hooks match sh4_run ();
+ * so do the superinstructions, which here jump from the first half of a
+ * pair straight to the second. Select sh4_run () with SH4_THREADED=0. */
+
+typedef struct {
+	uint16_t mask;
+	uint16_t match;
+	const void *label;
+	const char *name;
+} sh4_label_desc_t;
+
+static int
+sh4_run_threaded (vk_cpu_t *cpu, int cycles)
+{
+	static const void *dispatch[65536];
+	static bool dispatch_ready = false;
+	sh4_t *ctx = (sh4_t *) cpu;
+	uint16_t inst;
+
+#define idesctype sh4_label_desc_t
+#define IDEF(mask_, match_, name_) \
+	{ \
+		mask_, \
+		match_, \
+		&&op_##name_, \
+		#name_, \
+	}
+
+#include "sh-insns-desc.h"
+
+#undef idesctype
+
+	/* Instruction classes are numbered in descriptor order, SH-2 table
+	 * first; see setup_insns_handlers_from_table (). */
+	if (!dispatch_ready) {
+		const unsigned num_sh2 = NUMELEM (insns_desc_sh2);
+		unsigned i, cls;
+
+		for (i = 0; i < 65536; i++) {
+			cls = insn_class[i];
+			if (cls == 0)
+				dispatch[i] = &&op_invalid;
+			else if (cls <= num_sh2)
+				dispatch[i] = insns_desc_sh2[cls - 1].label;
+			else
+				dispatch[i] = insns_desc_sh4[cls - 1 - num_sh2].label;
+		}
+		dispatch_ready = true;
+	}
+
+	cpu->remaining = cycles;
+	goto next;
+
+#define I(name_) \
+	goto retire; \
+	op_##name_:
+
+#define IS_SH4
+
+#include "sh-insns-interp.h"
+
+#undef I
+#undef IDEF
+#undef IS_SH4
+
+retire:
+	cpu->remaining --;
+	if (fused_kind[inst] && !sh4_in_delay (ctx)) {
+		uint16_t second;
+
+		PC += 2;
+		sh4_fetch (ctx, PC, &second);
+		second = vk_cpu_patch (cpu, PC & 0x1FFFFFFF, second);
+		if (!is_fused_pair (inst, second))
+			goto next;
+		inst = second;
+		goto *dispatch[inst];
+	}
+	sh4_advance (ctx);
+next:
+	if (sh4_in_delay (ctx)) {
+		sh4_fetch (ctx, ctx->slot_pc, &inst);
+		inst = vk_cpu_patch (cpu, ctx->slot_pc & 0x1FFFFFFF, inst);
+		if (ctx->opstats)
+			sh4_opstats_record (ctx->opstats, inst);
+		goto *dispatch[inst];
+	}
+	if (cpu->remaining <= 0)
+		goto done;
+	if (cpu->state != VK_CPU_STATE_RUN) {
+		cpu->num_insns += cycles - cpu->remaining;
+		if (ctx->profile)
+			ctx->profile->num_sleep_cycles += cpu->remaining;
+		return 0;
+	}
+	sh4_process_irqs (cpu);
+	if (ctx->profile && --ctx->profile->countdown == 0)
+		sh4_profile_sample (ctx);
+
+	sh4_fetch (ctx, PC, &inst);
+	inst = vk_cpu_patch (cpu, PC & 0x1FFFFFFF, inst);
+	if (ctx->opstats)
+		sh4_opstats_record (ctx->opstats, inst);
+	goto *dispatch[inst];
+
+done:
+	cpu->num_insns += cycles - cpu->remaining;
+	/* XXX BSC, SCI */
+	sh4_tmu_run (ctx, cycles);
+	return -cpu->remaining;
+}
+
 static void
 sh4_set_state (vk_cpu_t *cpu, vk_cpu_state_t state)
 {
@@ -1319,8 +1939,10 @@ sh4_reset (vk_device_t *dev, vk_reset_type_t type)
 	              VK_CPU_STATE_STOP;
 
 	ctx->in_slot = false;
+	ctx->slot_pending = false;
 
 	memset ((void *) &ctx->regs, 0, sizeof (ctx->regs));
+	memset ((void *) ctx->sq, 0, sizeof (ctx->sq));
 
 	PC = 0xA0000000;
 
@@ -1334,6 +1956,9 @@ sh4_reset (vk_device_t *dev, vk_reset_type_t type)
 	FPSCR.bit.rm = 1;
 	FPSCR.bit.dn = 1;
 
+	update_r_banks (ctx);
+	update_f_banks (ctx);
+
 	/* See Table A.1, "Address List" */
 	vk_buffer_clear (ctx->iregs);
 
@@ -1386,11 +2011,15 @@ sh4_load_state (vk_device_t *dev, vk_state_t *state)
 
 	LOAD (ctx->in_slot);
 	LOAD (ctx->regs);
+	LOAD (ctx->sq);
 	LOAD (ctx->intc);
 	LOAD (ctx->dmac);
 	LOAD (ctx->tmu);
 	LOAD (ctx->config);
 
+	update_r_banks (ctx);
+	update_f_banks (ctx);
+
 	return ret;
 }
 
@@ -1402,6 +2031,7 @@ sh4_save_state (vk_device_t *dev, vk_state_t *state)
 
 	SAVE (ctx->in_slot);
 	SAVE (ctx->regs);
+	SAVE (ctx->sq);
 	SAVE (ctx->intc);
 	SAVE (ctx->dmac);
 	SAVE (ctx->tmu);
@@ -1434,6 +2064,29 @@ sh4_set_porta_handlers (vk_cpu_t *cpu,
 	ctx->porta.put = put;
 }
 
+static void
+sh4_destroy (vk_device_t **dev_)
+{
+	sh4_t *ctx = (sh4_t *) *dev_;
+	vk_machine_t *mach = (*dev_)->mach;
+	char path[128];
+
+	if (ctx->profile) {
+		snprintf (path, sizeof (path), "%s-profile.txt", ctx->profile->name);
+		vk_profile_report (ctx->profile, path, getenv ("SH4_PROFILE_MAP"));
+		vk_profile_destroy (&ctx->profile);
+	}
+
+	if (ctx->opstats) {
+		snprintf (path, sizeof (path), "%s-%s-opstats.txt",
+		          (mach && mach->game) ? mach->game->name : "unknown",
+		          ctx->config.master ? "sh4-master" : "sh4-slave");
+		sh4_opstats_report (ctx->opstats, path);
+		free (ctx->opstats);
+		ctx->opstats = NULL;
+	}
+}
+
 vk_cpu_t *
 sh4_new (vk_machine_t *mach, vk_mmap_t *mmap, bool master, bool le)
 {
@@ -1448,25 +2101,43 @@ sh4_new (vk_machine_t *mach, vk_mmap_t *mmap, bool master, bool le)
 		goto fail;
 
 	dev->reset		= sh4_reset;
-	dev->destroy		= NULL;
+	dev->destroy		= sh4_destroy;
 	dev->load_state		= sh4_load_state;
 	dev->save_state		= sh4_save_state;
 
 	cpu->set_state		= sh4_set_state;
-	cpu->run		= sh4_run;
+	cpu->run		= vk_util_get_bool_option ("SH4_THREADED", true) ?
+				  sh4_run_threaded : sh4_run;
 	cpu->set_irq_state	= sh4_set_irq_state;
 	cpu->get_debug_string	= sh4_get_debug_string;
 
 	ctx->config.master = master;
 	ctx->config.little_endian = le;
 
+	if (vk_util_get_int_option ("SH4_PROFILE", 0) > 0) {
+		ctx->profile = vk_profile_new (master ? "sh4-master" : "sh4-slave",
+		                               vk_util_get_int_option ("SH4_PROFILE", 0));
+		if (!ctx->profile)
+			goto fail;
+	}
+
 	ctx->iregs = vk_buffer_le32_new (0x10000, 0);
 	if (!ctx->iregs)
 		goto fail;
 
 	vk_machine_register_buffer (mach, ctx->iregs);
 
+	if (vk_util_get_bool_option ("SH4_OPSTATS", false)) {
+		ctx->opstats = ALLOC (sh4_opstats_t);
+		if (!ctx->opstats)
+			goto fail;
+	}
+
 	setup_insns_handlers ();
+	setup_fsca_table ();
+	/* Statistics are about the unfused instruction stream */
+	if (!ctx->opstats && vk_util_get_bool_option ("SH4_FUSE", true))
+		setup_fused_handlers ();
 
 	return (vk_cpu_t *) ctx;
 fail:
@@ -22,6 +22,7 @@
 #include "vk/core.h"
 #include "vk/buffer.h"
 #include "vk/cpu.h"
+#include "vk/profile.h"
 
 typedef union {
 	struct {
@@ -124,17 +125,28 @@ typedef struct {
 	uint32_t code;
 } sh4_irq_state_t;
 
+/* Aligned for the vector FIPR/FTRV paths */
+typedef union {
+	alias32uf_t f[16];
+	alias64uf_t d[8];
+} __attribute__ ((aligned (16))) sh4_fbank_t;
+
 typedef struct sh4_t sh4_t;
+typedef struct sh4_opstats_t sh4_opstats_t;
 
 struct sh4_t {
 	vk_cpu_t base;
 
 	/* State */
 	bool		in_slot;
+	bool		slot_pending;
+	uint32_t	slot_pc;
 
 	/* Registers */
 	struct {
-		uint32_t	r[16];
+		/* R0-R7 of both banks, then R8-R15 */
+		uint32_t	rbank[2][8];
+		uint32_t	rhi[8];
 		uint32_t	pc;
 		sh4_sr_t	sr;
 		uint32_t	pr;
@@ -145,18 +157,27 @@ struct sh4_t {
 		uint32_t	spc;
 		sh4_sr_t	ssr;
 		uint32_t	sgr;
-		uint32_t	rbank[8];
-		union {
-			alias32uf_t f[16];
-			alias64uf_t d[8];
-		} f, x;
+		/* FR0-FR15 of both banks */
+		sh4_fbank_t	fbank[2];
 		alias32uf_t	fpul;
 		sh4_fpscr_t	fpscr;
 	} regs;
 
+	/* Active register banks, selected by SR.MD/RB and FPSCR.FR; switching
+	 * banks only repoints these. R(n) is r[n >> 3][n & 7]. */
+	struct {
+		uint32_t	*r[2];
+		uint32_t	*rbank;
+		sh4_fbank_t	*fr;
+		sh4_fbank_t	*xf;
+	} bank;
+
 	/* On-Chip Modules */
 	vk_buffer_t	*iregs;
 
+	/* Store queues: two 32-byte buffers, written back by PREF */
+	uint32_t	sq[2][8];
+
 	struct {
 		/* True if any interrupt is pending */
 		bool pending;
@@ -185,6 +206,12 @@ struct sh4_t {
 		bool	master;
 		bool	little_endian;
 	} config;
+
+	/* Sampling profiler; NULL unless SH4_PROFILE is set */
+	vk_profile_t	*profile;
+
+	/* Instruction pair/triple statistics; NULL unless SH4_OPSTATS is set */
+	sh4_opstats_t	*opstats;
 };
 
 vk_cpu_t	*sh4_new (vk_machine_t *mach, vk_mmap_t *mmap, bool master, bool le);
@@ -102,6 +102,8 @@ on_cp_begin (hikaru_gpu_t *gpu)
 	PC = REG15 (0x70);
 	SP(0) = REG15 (0x74);
 	SP(1) = REG15 (0x78);
+
+	vk_trace_event (VK_TRACE_CP_BEGIN, 0, PC);
 }
 
 static void
@@ -110,6 +112,8 @@ on_cp_end (hikaru_gpu_t *gpu)
 	if (gpu->debug.log_cp)
 		VK_LOG (" ==== CP END ==== ");
 
+	vk_trace_event (VK_TRACE_CP_END, 0, PC);
+
 	/* Turn off the busy bits */
 	REG15 (0x58) &= ~3;
 	REG1A (0x24) &= ~1;
@@ -251,7 +255,7 @@ static void
 push_pc (hikaru_gpu_t *gpu)
 {
 	VK_ASSERT ((SP(0) >> 24) == 0x48);
-	vk_buffer_put (gpu->cmdram, 4, SP(0) & 0x3FFFFFF, PC);
+	vk_buffer_put32_le (gpu->cmdram, SP(0) & 0x3FFFFFF, PC);
 	SP(0) -= 4;
 }
 
@@ -260,7 +264,7 @@ pop_pc (hikaru_gpu_t *gpu)
 {
 	SP(0) += 4;
 	VK_ASSERT ((SP(0) >> 24) == 0x48);
-	PC = vk_buffer_get (gpu->cmdram, 4, SP(0) & 0x3FFFFFF) + 8;
+	PC = vk_buffer_get32_le (gpu->cmdram, SP(0) & 0x3FFFFFF) + 8;
 }
 
 static int
@@ -302,6 +306,7 @@ hikaru_gpu_cp_exec (hikaru_gpu_t *gpu, int cycles)
 		}
 
 		op = inst[0] & 0x1FF;
+		vk_trace_count (VK_TRACE_CP_INSN, op);
 
 		flags = insns[op].flags;
 		if (flags & FLAG_INVALID) {
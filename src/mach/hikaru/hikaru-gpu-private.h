@@ -20,6 +20,8 @@
 #define __HIKARU_GPU_PRIVATE_H__
 
 #include "vk/device.h"
+#include "vk/timer.h"
+#include "vk/trace.h"
 
 #define NUM_VIEWPORTS	8
 #define NUM_MODELVIEWS	256
@@ -407,6 +409,10 @@ typedef struct {
 		uint32_t log_cp		: 1;
 	} debug;
 
+	struct {
+		vk_timer_t *cp, *idma;
+	} timers;
+
 } hikaru_gpu_t;
 
 #define REG15(addr_)	(*(uint32_t *) &gpu->regs._15[(addr_) & 0xFF])
@@ -469,7 +475,7 @@ typedef struct {
 	uint8_t padding3;
 	vec2f_t texcoords;	/* 0x20 */
 	vec4b_t specular;	/* 0x28 */
-	uint32_t padding2;
+	uint32_t variant;	/* 0x2C, filled in by the renderer's ubershader */
 	vec3s_t unknown;	/* 0x30 */
 	uint16_t padding4;
 } hikaru_vertex_body_t;
@@ -736,11 +736,26 @@ copy_level (vk_buffer_t *srcbuf, vk_buffer_t *texram, uint32_t bus_addr,
 	unsigned x, y;
 
 	offs = bus_addr & (vk_buffer_get_size (srcbuf) - 1);
+
+	/* Word-aligned rows: each word lands with its two texels swapped,
+	 * so move the rows in bulk */
+	if (!((offs | (x0 * 2) | (w * 2)) & 3) && w <= 2048) {
+		uint32_t row[1024];
+
+		for (y = 0; y < h; y++, offs += w * 2) {
+			uint32_t temp = (y0 + y) * 4096 + x0 * 2;
+			vk_buffer_read_block (srcbuf, offs, row, w * 2);
+			vk_hswap32_block (row, row, w * 2);
+			vk_buffer_write_block (texram, temp, row, w * 2);
+		}
+		return;
+	}
+
 	for (y = 0; y < h; y++) {
 		for (x = 0; x < w; x++, offs += 2) {
 			uint32_t temp = (y0 + y) * 4096 + (x0 + x) * 2;
-			uint32_t texel = vk_buffer_get (srcbuf, 2, offs);
-			vk_buffer_put (texram, 2, temp ^ 2, texel);
+			uint16_t texel = vk_buffer_get16_le (srcbuf, offs);
+			vk_buffer_put16_le (texram, temp ^ 2, texel);
 		}
 	}
 }
@@ -816,6 +831,9 @@ process_idma_entry (hikaru_gpu_t *gpu, uint32_t entry[4])
 	texhead.logh	= (entry[2] >> 19) & 7;
 	texhead.format	= (entry[2] >> 26) & 7;
 
+	vk_trace_event (VK_TRACE_IDMA, texhead.format,
+	                ((16 << texhead.logw) << 16) | (16 << texhead.logh));
+
 	if (gpu->debug.log_idma) {
 		VK_LOG ("GPU IDMA %08X %08X %08X %08X : %s",
 		        entry[0], entry[1], entry[2], entry[3],
@@ -884,10 +902,10 @@ hikaru_gpu_step_idma (hikaru_gpu_t *gpu)
 	/* Read the IDMA table address in CMDRAM */
 	addr = (REG15 (0x0C) & 0xFFFFFF);
 
-	entry[0] = vk_buffer_get (gpu->cmdram, 4, addr+0x0);
-	entry[1] = vk_buffer_get (gpu->cmdram, 4, addr+0x4);
-	entry[2] = vk_buffer_get (gpu->cmdram, 4, addr+0x8);
-	entry[3] = vk_buffer_get (gpu->cmdram, 4, addr+0xC);
+	entry[0] = vk_buffer_get32_le (gpu->cmdram, addr+0x0);
+	entry[1] = vk_buffer_get32_le (gpu->cmdram, addr+0x4);
+	entry[2] = vk_buffer_get32_le (gpu->cmdram, addr+0x8);
+	entry[3] = vk_buffer_get32_le (gpu->cmdram, addr+0xC);
 
 	/* If the entry supplies a positive size, process it */
 	if (entry[1]) {
@@ -972,8 +990,8 @@ hikaru_gpu_begin_dma (hikaru_gpu_t *gpu)
 			uint32_t src_offs = (src_y + i) * 4096 + (src_x + j) * 2;
 			uint32_t dst_offs = (dst_y + i) * 4096 + (dst_x + j) * 2;
 			uint16_t pixel;
-			pixel = vk_buffer_get (gpu->fb, 2, src_offs);
-			vk_buffer_put (gpu->fb, 2, dst_offs, pixel);
+			pixel = vk_buffer_get16_le (gpu->fb, src_offs);
+			vk_buffer_put16_le (gpu->fb, dst_offs, pixel);
 		}
 	}
 
@@ -992,6 +1010,8 @@ hikaru_gpu_hblank_in (vk_device_t *dev, unsigned line)
 	/* Update the line counter; we ignore the _putative_ pixel counter
 	 * as it doesn't seem to be used so far. */
 	REG1A(0x1C) = (REG1A(0x1C) & ~0x003FF800) | (line << 11);
+
+	vk_trace_event (VK_TRACE_HBLANK, line, 0);
 }
 
 void
@@ -1001,6 +1021,8 @@ hikaru_gpu_vblank_in (vk_device_t *dev)
 
 	REG1A(0x1C) ^= 0x01800000;
 
+	vk_trace_event (VK_TRACE_VBLANK_IN, 0, 0);
+
 	hikaru_gpu_cp_vblank_in (gpu);
 }
 
@@ -1009,6 +1031,8 @@ hikaru_gpu_vblank_out (vk_device_t *dev)
 {
 	hikaru_gpu_t *gpu = (hikaru_gpu_t *) dev;
 
+	vk_trace_event (VK_TRACE_VBLANK_OUT, 0, 0);
+
 	hikaru_gpu_raise_irq (gpu, 0, GPU1A_IRQ_VBLANK);
 	hikaru_gpu_fill_layer_info (gpu);
 	hikaru_gpu_cp_vblank_out (gpu);
@@ -1023,11 +1047,16 @@ hikaru_gpu_exec (vk_device_t *dev, int cycles)
 	/* XXX */
 
 	/* Exec the IDMA */
+	vk_timer_begin (gpu->timers.idma);
 	hikaru_gpu_step_idma (gpu);
+	vk_timer_end (gpu->timers.idma);
 
 	/* Exec the CP */
-	if (REG15 (0x58) == 3)
+	if (REG15 (0x58) == 3) {
+		vk_timer_begin (gpu->timers.cp);
 		hikaru_gpu_cp_exec (gpu, cycles);
+		vk_timer_end (gpu->timers.cp);
+	}
 
 	return 0;
 }
@@ -1301,6 +1330,9 @@ hikaru_gpu_new (vk_machine_t *mach,
 	gpu->debug.log_cp =
 		vk_util_get_bool_option ("GPU_LOG_CP", false);
 
+	gpu->timers.cp		= vk_timer_get ("gpu-cp");
+	gpu->timers.idma	= vk_timer_get ("idma");
+
 	hikaru_gpu_cp_init (gpu);
 
 	return dev;
@@ -443,6 +443,26 @@ rombd_get (hikaru_t *hikaru, unsigned size, uint32_t bus_addr, void *val)
 	return 0;
 }
 
+/* The RAMs are little-endian arena buffers, and most bus accesses (DMA,
+ * CPU word accesses) are 32-bit: use the inline accessors for those. */
+
+static inline uint64_t
+ram_get (vk_buffer_t *buf, unsigned size, uint32_t offs)
+{
+	if (size == 4)
+		return vk_buffer_get32_le (buf, offs);
+	return vk_buffer_get (buf, size, offs);
+}
+
+static inline void
+ram_put (vk_buffer_t *buf, unsigned size, uint32_t offs, uint64_t val)
+{
+	if (size == 4)
+		vk_buffer_put32_le (buf, offs, (uint32_t) val);
+	else
+		vk_buffer_put (buf, size, offs, val);
+}
+
 static int
 memctl_bus_get (hikaru_memctl_t *memctl, unsigned size, uint32_t bus_addr, void *val)
 {
@@ -454,10 +474,10 @@ memctl_bus_get (hikaru_memctl_t *memctl, unsigned size, uint32_t bus_addr, void
 	set_ptr (val, size, 0);
 	if (bus_addr >= 0x04000000 && bus_addr <= 0x043FFFFF) {
 		/* TEXRAM Bank 0 */
-		set_ptr (val, size, vk_buffer_get (hikaru->texram[0], size, offs));
+		set_ptr (val, size, ram_get (hikaru->texram[0], size, offs));
 	} else if (bus_addr >= 0x06000000 && bus_addr <= 0x063FFFFF) {
 		/* TEXRAM Bank 1 */
-		set_ptr (val, size, vk_buffer_get (hikaru->texram[1], size, offs));
+		set_ptr (val, size, ram_get (hikaru->texram[1], size, offs));
 	} else if (bus_addr >= 0x0A000000 && bus_addr <= 0x0AFFFFFF) {
 		/* Unknown */
 		/* Here's the thing: the value of bits 2 and 3 of 0C00F01C
@@ -501,10 +521,10 @@ memctl_bus_get (hikaru_memctl_t *memctl, unsigned size, uint32_t bus_addr, void
 		return rombd_get (hikaru, size, bus_addr, val);
 	} else if (bus_addr >= 0x40000000 && bus_addr <= 0x41FFFFFF) {
 		/* Slave RAM */
-		set_ptr (val, size, vk_buffer_get (hikaru->ram_s, size, bus_addr & 0x01FFFFFF));
+		set_ptr (val, size, ram_get (hikaru->ram_s, size, bus_addr & 0x01FFFFFF));
 	} else if (bus_addr >= 0x70000000 && bus_addr <= 0x71FFFFFF) {
 		/* Master RAM */
-		set_ptr (val, size, vk_buffer_get (hikaru->ram_m, size, bus_addr & 0x01FFFFFF));
+		set_ptr (val, size, ram_get (hikaru->ram_m, size, bus_addr & 0x01FFFFFF));
 	} else if (bank == hikaru->rombd_config.eeprom_bank && offs == 0) {
 		/* ROMBD EEPROM */
 		set_ptr (val, size, 0xFFFFFFFF);
@@ -559,15 +579,15 @@ static void
 texram_put (hikaru_t *hikaru, uint32_t bank, uint32_t size, uint32_t offs, uint64_t val)
 {
 	if (hikaru_gpu_is_texram_twiddled (hikaru->gpu)) 
-		vk_buffer_put (hikaru->texram[bank], size, offs, val);
+		ram_put (hikaru->texram[bank], size, offs, val);
 	else {
 		uint32_t toffs_lo = twiddle_offs ((offs + 0) >> 1) << 1;
 		uint32_t toffs_hi = twiddle_offs ((offs + 2) >> 1) << 1;
 
 		VK_ASSERT (size == 4);
 
-		vk_buffer_put (hikaru->texram[bank], 2, toffs_lo, bswap16 (val));
-		vk_buffer_put (hikaru->texram[bank], 2, toffs_hi, bswap16 (val >> 16));
+		vk_buffer_put16_le (hikaru->texram[bank], toffs_lo, bswap16 (val));
+		vk_buffer_put16_le (hikaru->texram[bank], toffs_hi, bswap16 (val >> 16));
 	}
 }
 
@@ -599,13 +619,13 @@ memctl_bus_put (hikaru_memctl_t *memctl, unsigned size, uint32_t bus_addr, uint6
 		log = true;
 	} else if (bus_addr >= 0x40000000 && bus_addr <= 0x41FFFFFF) {
 		/* Slave RAM */
-		vk_buffer_put (hikaru->ram_s, size, bus_addr & 0x01FFFFFF, val);
+		ram_put (hikaru->ram_s, size, bus_addr & 0x01FFFFFF, val);
 	} else if (bus_addr >= 0x48000000 && bus_addr <= 0x483FFFFF) {
 		/* GPU CMD RAM */
-		vk_buffer_put (hikaru->cmdram, size, bus_addr & 0x3FFFFF, val);
+		ram_put (hikaru->cmdram, size, bus_addr & 0x3FFFFF, val);
 	} else if (bus_addr >= 0x70000000 && bus_addr <= 0x71FFFFFF) {
 		/* Master RAM */
-		vk_buffer_put (hikaru->ram_m, size, bus_addr & 0x01FFFFFF, val);
+		ram_put (hikaru->ram_m, size, bus_addr & 0x01FFFFFF, val);
 	} else if (bank == hikaru->rombd_config.eeprom_bank && offs == 0) {
 		/* ROMBD EEPROM */
 		log = true;
@@ -618,6 +638,38 @@ memctl_bus_put (hikaru_memctl_t *memctl, unsigned size, uint32_t bus_addr, uint6
 	return 0;
 }
 
+/* Returns the RAM buffer a bus address falls in, if the range is plain
+ * linear memory, and the offset and number of bytes left within it. Used
+ * by the DMA to move data in bulk. */
+
+static vk_buffer_t *
+memctl_bus_get_ram (hikaru_memctl_t *memctl, uint32_t bus_addr, bool write,
+                    uint32_t *offs, uint32_t *avail)
+{
+	hikaru_t *hikaru = (hikaru_t *) memctl->base.mach;
+	vk_buffer_t *buf;
+	uint32_t mask;
+
+	if (bus_addr >= 0x40000000 && bus_addr <= 0x41FFFFFF) {
+		buf = hikaru->ram_s;
+		mask = 0x01FFFFFF;
+	} else if (bus_addr >= 0x70000000 && bus_addr <= 0x71FFFFFF) {
+		buf = hikaru->ram_m;
+		mask = 0x01FFFFFF;
+	} else if (write && bus_addr >= 0x48000000 && bus_addr <= 0x483FFFFF) {
+		buf = hikaru->cmdram;
+		mask = 0x3FFFFF;
+	} else {
+		*offs = 0;
+		*avail = 0;
+		return NULL;
+	}
+
+	*offs = bus_addr & mask;
+	*avail = mask + 1 - *offs;
+	return buf;
+}
+
 static uint32_t
 get_bank_for_addr (hikaru_memctl_t *memctl, uint32_t addr)
 {
@@ -704,13 +756,13 @@ hikaru_memctl_exec (vk_device_t *dev, int cycles)
 	hikaru_memctl_t *memctl = (hikaru_memctl_t *) dev;
 	uint32_t src, dst, len, ctl, todo;
 
-	len = vk_buffer_get (memctl->regs, 4, 0x38);
+	len = vk_buffer_get32_le (memctl->regs, 0x38);
 
 	if (!(len & 0x01000000))
 		return 0;
 
-	src = vk_buffer_get (memctl->regs, 4, 0x30);
-	dst = vk_buffer_get (memctl->regs, 4, 0x34);
+	src = vk_buffer_get32_le (memctl->regs, 0x30);
+	dst = vk_buffer_get32_le (memctl->regs, 0x34);
 	ctl = len >> 24;
 	len = len & 0xFFFFFF;
 
@@ -723,27 +775,49 @@ hikaru_memctl_exec (vk_device_t *dev, int cycles)
 
 	VK_ASSERT ((len & 0xFF000000) == 0);
 
-	while (todo--) {
-		uint32_t tmp;
-		memctl_bus_get (memctl, 4, src & 0x7FFFFFFF, &tmp);
-		memctl_bus_put (memctl, 4, dst & 0x7FFFFFFF, tmp);
-		src += 4;
-		dst += 4;
+	while (todo) {
+		vk_buffer_t *srcbuf, *dstbuf;
+		uint32_t src_offs, dst_offs, src_avail, dst_avail;
+
+		/* RAM to RAM: move whole blocks */
+		srcbuf = memctl_bus_get_ram (memctl, src & 0x7FFFFFFF, false,
+		                             &src_offs, &src_avail);
+		dstbuf = memctl_bus_get_ram (memctl, dst & 0x7FFFFFFF, true,
+		                             &dst_offs, &dst_avail);
+		if (srcbuf && dstbuf && !((src | dst) & 3)) {
+			uint32_t tmp[256];
+			uint32_t n = MIN2 (todo, NUMELEM (tmp));
+			n = MIN2 (n, src_avail / 4);
+			n = MIN2 (n, dst_avail / 4);
+
+			vk_buffer_read_block (srcbuf, src_offs, tmp, n * 4);
+			vk_buffer_write_block (dstbuf, dst_offs, tmp, n * 4);
+			src += n * 4;
+			dst += n * 4;
+			todo -= n;
+		} else {
+			uint32_t tmp;
+			memctl_bus_get (memctl, 4, src & 0x7FFFFFFF, &tmp);
+			memctl_bus_put (memctl, 4, dst & 0x7FFFFFFF, tmp);
+			src += 4;
+			dst += 4;
+			todo--;
+		}
 	}
 
 	/* Transfer completed */
 	if (len == 0) {
 		ctl = 0;
 		/* Set DMA done, clear error flags */
-		vk_buffer_put (memctl->regs, 2, 0x04, 0x1000);
+		vk_buffer_put16_le (memctl->regs, 0x04, 0x1000);
 		/* Raise an IRQ */
 		hikaru_raise_memctl_irq (memctl->base.mach);
 	}
 
 	/* Write the values back */
-	vk_buffer_put (memctl->regs, 4, 0x30, src);
-	vk_buffer_put (memctl->regs, 4, 0x34, dst);
-	vk_buffer_put (memctl->regs, 4, 0x38, (ctl << 24) | len);
+	vk_buffer_put32_le (memctl->regs, 0x30, src);
+	vk_buffer_put32_le (memctl->regs, 0x34, dst);
+	vk_buffer_put32_le (memctl->regs, 0x38, (ctl << 24) | len);
 
 	return 0;
 }
@@ -37,6 +37,8 @@ enum {
 	HR_DEBUG_NO_DIFFUSE,
 	HR_DEBUG_NO_SPECULAR,
 	HR_DEBUG_FOG,
+	HR_DEBUG_NO_BATCHING,
+	HR_DEBUG_UBERSHADER,
 
 	HR_NUM_DEBUG_VARS
 };
@@ -72,13 +74,57 @@ typedef union {
 	uint32_t full;
 } hikaru_glsl_variant_t;
 
+/* Program cache key of the ubershader. Never a valid variant, as light
+ * types only go up to 2. */
+#define HR_UBERSHADER_VARIANT	(~0u)
+
 typedef struct {
 	GLuint id;
 	hikaru_texhead_t th;
 } hikaru_texture_t;
 
+/* Must be a power of two, larger than the number of programs we expect. */
+#define HR_PROGRAM_CACHE_SIZE	1024
+
+typedef struct {
+	hikaru_glsl_variant_t	variant;
+	GLuint			program;
+} hikaru_program_t;
+
+/* Uniform blocks of the mesh shaders; the indices double as binding
+ * points. The structures below must match the std140 layout of the
+ * blocks declared in mesh_vs_source and mesh_fs_source. */
+enum {
+	HR_BLOCK_VIEWPORT,
+	HR_BLOCK_MODELVIEW,
+	HR_BLOCK_LIGHTSET,
+
+	HR_NUM_BLOCKS
+};
+
+typedef struct {
+	mtx4x4f_t	projection;
+	vec4f_t		ambient;
+	vec4f_t		fog;
+	vec4f_t		fog_color;
+} hikaru_viewport_block_t;
+
+typedef struct {
+	mtx4x4f_t	modelview;
+} hikaru_modelview_block_t;
+
 typedef struct {
-	GLuint			vbo;
+	struct {
+		vec4f_t	position;
+		vec4f_t	direction;
+		vec4f_t	diffuse;
+		vec4f_t	specular;
+		vec4f_t	extents;
+	} lights[4];
+} hikaru_lightset_block_t;
+
+typedef struct {
+	uint32_t		first;
 	uint32_t		num_tris;
 	uint32_t		addr[2];
 	uint32_t		vp_index;
@@ -90,6 +136,9 @@ typedef struct {
 	float			alpha_thresh[2];
 	float			depth_bias;
 	uint32_t		num;
+	hikaru_glsl_variant_t	variant;
+	hikaru_glsl_variant_t	program_key;
+	uint32_t		tex_key;
 } hikaru_mesh_t;
 
 typedef struct {
@@ -126,26 +175,38 @@ typedef struct {
 	struct {
 		hikaru_mesh_t		*current;
 
-		hikaru_glsl_variant_t	variant;
+		/* Program cache key of the bound program. */
+		hikaru_glsl_variant_t	program_key;
 		GLuint			program;
-		GLuint			vao;
+		GLuint			vao, vbo;
+
+		/* Vertex data for all meshes in the current frame; it is
+		 * uploaded to the VBO in one go before drawing. */
+		hikaru_vertex_body_t	*vertices;
+		uint32_t		 num_vertices, max_vertices;
+
+		/* State currently bound to the GL; used to skip redundant
+		 * uploads between meshes. */
+		struct {
+			uint32_t	vp_index;
+			uint32_t	mv_index;
+			uint32_t	ls_index;
+			GLuint		texture;
+			float		depth_bias;
+		} bound;
 
 		struct {
-			GLuint		u_projection;
-			GLuint		u_modelview;
-			GLuint		u_normal;
-			struct {
-				GLuint	position;
-				GLuint	direction;
-				GLuint	diffuse;
-				GLuint	specular;
-				GLuint	extents;
-			} u_lights[4];
-			GLuint		u_ambient;
 			GLuint		u_texture;
-			GLuint		u_fog;
-			GLuint		u_fog_color;
 		} locs;
+
+		/* Per-frame viewport, modelview and lightset state, uploaded
+		 * once per frame; each draw selects its entry by binding the
+		 * corresponding range of the buffer. */
+		struct {
+			GLuint		ubo;
+			uint32_t	stride;
+			uint8_t		*data;
+		} blocks[HR_NUM_BLOCKS];
 	} meshes;
 
 	struct {
@@ -153,6 +214,18 @@ typedef struct {
 		bool is_clear[2];
 	} textures;
 
+	/* Open-addressing hash table of compiled programs, keyed by
+	 * variant; empty slots have program == 0. Program binaries are
+	 * appended to the on-disk cache as they are compiled. */
+	struct {
+		hikaru_program_t	table[HR_PROGRAM_CACHE_SIZE];
+		unsigned		num;
+		FILE			*fp;
+	} programs;
+
+	/* Layer textures persist across frames; only the FB rows written
+	 * since the last upload (FB generation gen) are sent again. A layer
+	 * whose format or origin changes is uploaded in full. */
 	struct {
 		GLuint program, vao, vbo;
 		struct {
@@ -160,12 +233,20 @@ typedef struct {
 			GLuint u_texture;
 			GLuint u_texture_multiplier;
 		} locs;
+		struct {
+			GLuint id;
+			hikaru_layer_t layer;
+			bool valid;
+			uint32_t gen;
+		} tex[2];
 	} layers;
 
 	struct {
 		int32_t flags[HR_NUM_DEBUG_VARS];
 	} debug;
 
+	vk_timer_t *draw_scene_timer;
+
 } hikaru_renderer_t;
 
 #define LOG(fmt_, args_...) \
@@ -38,6 +38,19 @@
 #define isnonnegative(x_) \
 	(isfinite(x_) && (x_) >= 0.0)
 
+#define VK_COPY_VEC2F(dst_, src_) \
+	do { \
+		dst_[0] = src_[0]; \
+		dst_[1] = src_[1]; \
+	} while (0)
+
+#define VK_COPY_VEC3F(dst_, src_) \
+	do { \
+		dst_[0] = src_[0]; \
+		dst_[1] = src_[1]; \
+		dst_[2] = src_[2]; \
+	} while (0)
+
 /****************************************************************************
  Debug
 ****************************************************************************/
@@ -61,6 +74,8 @@ static const struct {
 	[HR_DEBUG_NO_DIFFUSE]		= {  0, 1, SDLK_d },
 	[HR_DEBUG_NO_SPECULAR]		= {  0, 1, SDLK_s },
 	[HR_DEBUG_FOG]			= {  0, 1, SDLK_g },
+	[HR_DEBUG_NO_BATCHING]		= {  0, 1, SDLK_b },
+	[HR_DEBUG_UBERSHADER]		= {  0, 1, SDLK_k },
 };
 
 static void
@@ -73,6 +88,8 @@ init_debug_flags (hikaru_renderer_t *hr)
 
 	hr->debug.flags[HR_DEBUG_LOG] =
 		vk_util_get_bool_option ("HR_LOG", false) ? 1 : 0;
+	hr->debug.flags[HR_DEBUG_UBERSHADER] =
+		vk_util_get_bool_option ("HR_UBERSHADER", false) ? 1 : 0;
 }
 
 static void
@@ -110,6 +127,19 @@ is_texhead_eq (hikaru_renderer_t *hr,
 	       (a->sloty == b->sloty);
 }
 
+/* Packs the fields compared by is_texhead_eq into a single sort key. */
+static uint32_t
+get_texhead_key (hikaru_texhead_t *th)
+{
+	return (1u << 31) |
+	       (th->bank << 25) |
+	       (th->slotx << 17) |
+	       (th->sloty << 9) |
+	       (th->format << 6) |
+	       (th->logw << 3) |
+	       th->logh;
+}
+
 static void
 destroy_texture (hikaru_texture_t *tex)
 {
@@ -150,7 +180,7 @@ decode_texture_abgr1111 (vk_buffer_t *texram,
 	for (y = 0; y < h; y++) {
 		for (x = 0; x < w; x += 4) {
 			uint32_t offs = (basey + y) * 4096 + (basex + x);
-			uint32_t texels = vk_buffer_get (texram, 4, offs);
+			uint32_t texels = vk_buffer_get32_le (texram, offs);
 			PUT16 (x + 2, y*2 + 0, abgr1111_to_rgba4444 (texels >> 28));
 			PUT16 (x + 3, y*2 + 0, abgr1111_to_rgba4444 (texels >> 24));
 	      		PUT16 (x + 2, y*2 + 1, abgr1111_to_rgba4444 (texels >> 20));
@@ -182,6 +212,8 @@ upload_texture (hikaru_renderer_t *hr, hikaru_texhead_t *th)
 	get_texhead_coords (&basex, &basey, th);
 	bank = th->bank;
 
+	vk_trace_event (VK_TRACE_TEX_UPLOAD, th->format, (w << 16) | h);
+
 	glGenTextures (1, &id);
 	VK_ASSERT_NO_GL_ERROR ();
 
@@ -370,6 +402,9 @@ hikaru_renderer_invalidate_texcache (vk_renderer_t *rend, hikaru_texhead_t *th)
 
 	VK_ASSERT (hr);
 
+	if (vk_renderer_is_null (rend))
+		return;
+
 	if (th == NULL) {
 		clear_texcache_bank (hr, 0);
 		clear_texcache_bank (hr, 1);
@@ -388,9 +423,16 @@ static const char *mesh_vs_source =
 										\n \
 %s										\n \
 										\n \
-uniform mat4 u_projection;							\n \
-uniform mat4 u_modelview;							\n \
-uniform mat3 u_normal;								\n \
+layout(std140) uniform viewport_block {						\n \
+	mat4	u_projection;							\n \
+	vec4	u_ambient;							\n \
+	vec4	u_fog;								\n \
+	vec4	u_fog_color;							\n \
+};										\n \
+										\n \
+layout(std140) uniform modelview_block {					\n \
+	mat4	u_modelview;							\n \
+};										\n \
 										\n \
 layout(location = 0) in vec3 i_position;					\n \
 layout(location = 1) in vec3 i_normal;						\n \
@@ -401,6 +443,12 @@ layout(location = 5) in vec3 i_unknown;						\n \
 layout(location = 6) in vec2 i_texcoords;					\n \
 layout(location = 7) in float i_alpha;						\n \
 										\n \
+#ifdef UBERSHADER								\n \
+layout(location = 8) in uint i_variant;						\n \
+flat out uint p_variant;							\n \
+#define VARIANT_INPUT i_variant							\n \
+#endif										\n \
+										\n \
 out vec4 p_position;								\n \
 out vec3 p_normal;								\n \
 out vec3 p_diffuse;								\n \
@@ -423,6 +471,9 @@ void main (void) {								\n \
 	p_unknown = i_unknown;							\n \
 	p_texcoords = i_texcoords;						\n \
 	p_alpha = i_alpha;							\n \
+#ifdef UBERSHADER								\n \
+	p_variant = i_variant;							\n \
+#endif										\n \
 }";
 
 static const char *mesh_fs_source =
@@ -431,18 +482,25 @@ static const char *mesh_fs_source =
 %s										\n \
 										\n \
 struct light_t {								\n \
-	vec3 position;								\n \
-	vec3 direction;								\n \
-	vec3 diffuse;								\n \
-	vec3 specular;								\n \
-	vec2 extents;								\n \
+	vec4 position;								\n \
+	vec4 direction;								\n \
+	vec4 diffuse;								\n \
+	vec4 specular;								\n \
+	vec4 extents;								\n \
+};										\n \
+										\n \
+layout(std140) uniform viewport_block {						\n \
+	mat4	u_projection;							\n \
+	vec4	u_ambient;							\n \
+	vec4	u_fog;								\n \
+	vec4	u_fog_color;							\n \
+};										\n \
+										\n \
+layout(std140) uniform lightset_block {						\n \
+	light_t	u_lights[4];							\n \
 };										\n \
 										\n \
-uniform light_t		u_lights[4];						\n \
-uniform vec3		u_ambient;						\n \
 uniform sampler2D	u_texture;						\n \
-uniform vec2		u_fog;							\n \
-uniform vec3		u_fog_color;						\n \
 										\n \
 in vec4 p_position;								\n \
 in vec3 p_normal;								\n \
@@ -453,6 +511,11 @@ in vec3 p_unknown;								\n \
 in vec2 p_texcoords;								\n \
 in float p_alpha;								\n \
 										\n \
+#ifdef UBERSHADER								\n \
+flat in uint p_variant;								\n \
+#define VARIANT_INPUT p_variant							\n \
+#endif										\n \
+										\n \
 void										\n \
 apply_light (inout vec3 diffuse,						\n \
              inout vec3 specular,						\n \
@@ -465,10 +528,10 @@ apply_light (inout vec3 diffuse,						\n \
 	float distance, attenuation, intensity;					\n \
 										\n \
 	if (type == 0) {							\n \
-		light_direction = normalize (light.direction);			\n \
+		light_direction = normalize (light.direction.xyz);			\n \
 		distance = 0.001;						\n \
 	} else {								\n \
-		vec3 delta = light.position - p_position.xyz;			\n \
+		vec3 delta = light.position.xyz - p_position.xyz;			\n \
 		distance = length (delta);					\n \
 		light_direction = normalize (delta);				\n \
 	}									\n \
@@ -485,18 +548,18 @@ apply_light (inout vec3 diffuse,						\n \
 //	intensity = max (dot (p_normal, light_direction), 0.0);			\n \
 	intensity = abs (dot (p_normal, light_direction));			\n \
 	if (type == 2) {							\n \
-		vec3 spot_direction = normalize (light.direction);		\n \
+		vec3 spot_direction = normalize (light.direction.xyz);		\n \
 		if (dot (spot_direction, light_direction) < 0.95)		\n \
 			intensity = 0.0;					\n \
 	}									\n \
 										\n \
-	diffuse += attenuation * intensity * p_diffuse * light.diffuse;		\n \
+	diffuse += attenuation * intensity * p_diffuse * light.diffuse.rgb;		\n \
 										\n \
 	if (has_specular != 0) {								\n \
 		vec3 view_direction = normalize (-p_position.xyz);				\n \
 		vec3 reflect_direction = normalize (-reflect (light_direction, p_normal));	\n \
 		float angle = max (dot (view_direction, reflect_direction), 0.0);		\n \
-		specular += p_specular.rgb * light.specular * pow (angle, p_specular.a);	\n \
+		specular += p_specular.rgb * light.specular.rgb * pow (angle, p_specular.a);	\n \
 	}											\n \
 }										\n \
 										\n \
@@ -505,42 +568,35 @@ main (void)									\n \
 {										\n \
 	vec4 texel, color;							\n \
 										\n \
-#if HAS_TEXTURE									\n \
-	texel = texture (u_texture, p_texcoords);				\n \
-#else										\n \
-	texel = vec4 (1.0);							\n \
-#endif										\n \
+	if (HAS_TEXTURE != 0)							\n \
+		texel = texture (u_texture, p_texcoords);			\n \
+	else									\n \
+		texel = vec4 (1.0);						\n \
 										\n \
-#if HAS_LIGHTING								\n \
-	vec3 diffuse  = vec3 (0.0);						\n \
-	vec3 specular = vec3 (0.0);						\n \
-	vec3 ambient  = u_ambient * p_ambient;					\n \
+	if (HAS_LIGHTING != 0) {						\n \
+		vec3 diffuse  = vec3 (0.0);					\n \
+		vec3 specular = vec3 (0.0);					\n \
+		vec3 ambient  = u_ambient.rgb * p_ambient;			\n \
 										\n \
-#if HAS_LIGHT0									\n \
-	apply_light (diffuse, specular, u_lights[0], LIGHT0_TYPE, LIGHT0_ATT_TYPE, HAS_LIGHT0_SPECULAR);		\n \
-#endif										\n \
-#if HAS_LIGHT1									\n \
-	apply_light (diffuse, specular, u_lights[1], LIGHT1_TYPE, LIGHT1_ATT_TYPE, HAS_LIGHT1_SPECULAR);		\n \
-#endif										\n \
-#if HAS_LIGHT2									\n \
-	apply_light (diffuse, specular, u_lights[2], LIGHT2_TYPE, LIGHT2_ATT_TYPE, HAS_LIGHT2_SPECULAR);		\n \
-#endif										\n \
-#if HAS_LIGHT3									\n \
-	apply_light (diffuse, specular, u_lights[3], LIGHT3_TYPE, LIGHT3_ATT_TYPE, HAS_LIGHT3_SPECULAR);		\n \
-#endif										\n \
+		if (HAS_LIGHT0 != 0)						\n \
+			apply_light (diffuse, specular, u_lights[0], LIGHT0_TYPE, LIGHT0_ATT_TYPE, HAS_LIGHT0_SPECULAR);	\n \
+		if (HAS_LIGHT1 != 0)						\n \
+			apply_light (diffuse, specular, u_lights[1], LIGHT1_TYPE, LIGHT1_ATT_TYPE, HAS_LIGHT1_SPECULAR);	\n \
+		if (HAS_LIGHT2 != 0)						\n \
+			apply_light (diffuse, specular, u_lights[2], LIGHT2_TYPE, LIGHT2_ATT_TYPE, HAS_LIGHT2_SPECULAR);	\n \
+		if (HAS_LIGHT3 != 0)						\n \
+			apply_light (diffuse, specular, u_lights[3], LIGHT3_TYPE, LIGHT3_ATT_TYPE, HAS_LIGHT3_SPECULAR);	\n \
 										\n \
-	color = vec4 (ambient +  diffuse, p_alpha) * texel + vec4 (specular, 0.0);	\n \
-#else										\n \
-	color = vec4 (p_ambient, p_alpha) * texel;				\n \
-#endif										\n \
+		color = vec4 (ambient +  diffuse, p_alpha) * texel + vec4 (specular, 0.0);	\n \
+	} else									\n \
+		color = vec4 (p_ambient, p_alpha) * texel;			\n \
 										\n \
-#if HAS_FOG									\n \
-	float z = gl_FragCoord.z / gl_FragCoord.w;				\n \
-	float a = clamp (u_fog[0] * (z - u_fog[1]), 0.0, 1.0);			\n \
-	gl_FragColor = mix (color, vec4 (u_fog_color, 1.0), a);			\n \
-#else										\n \
-	gl_FragColor = color;							\n \
-#endif										\n \
+	if (HAS_FOG != 0) {							\n \
+		float z = gl_FragCoord.z / gl_FragCoord.w;			\n \
+		float a = clamp (u_fog[0] * (z - u_fog[1]), 0.0, 1.0);		\n \
+		gl_FragColor = mix (color, vec4 (u_fog_color.rgb, 1.0), a);	\n \
+	} else									\n \
+		gl_FragColor = color;						\n \
 }";
 
 static hikaru_light_att_t
@@ -633,18 +689,39 @@ get_glsl_variant (hikaru_renderer_t *hr, hikaru_mesh_t *mesh)
 	return variant;
 }
 
-#define MAX_PROGRAMS	256
+static void
+invalidate_bound_state (hikaru_renderer_t *hr)
+{
+	hr->meshes.bound.vp_index = ~0;
+	hr->meshes.bound.mv_index = ~0;
+	hr->meshes.bound.ls_index = ~0;
+	hr->meshes.bound.texture = ~0;
+	/* NaN never compares equal, forcing the next glPolygonOffset. */
+	hr->meshes.bound.depth_bias = NAN;
+}
 
-static struct {
-	hikaru_glsl_variant_t variant;
-	GLuint program;
-} program_cache[MAX_PROGRAMS];
-unsigned num_programs;
+static const char *uniform_block_names[HR_NUM_BLOCKS] = {
+	[HR_BLOCK_VIEWPORT]	= "viewport_block",
+	[HR_BLOCK_MODELVIEW]	= "modelview_block",
+	[HR_BLOCK_LIGHTSET]	= "lightset_block",
+};
 
 static void
-upload_glsl_program (hikaru_renderer_t *hr, hikaru_mesh_t *mesh)
+bind_uniform_blocks (GLuint program)
 {
-	static const char *definitions_template =
+	unsigned i;
+
+	for (i = 0; i < HR_NUM_BLOCKS; i++) {
+		GLuint index = glGetUniformBlockIndex (program,
+		                                       uniform_block_names[i]);
+		/* Unused blocks may be optimized away. */
+		if (index != GL_INVALID_INDEX)
+			glUniformBlockBinding (program, index, i);
+	}
+	VK_ASSERT_NO_GL_ERROR ();
+}
+
+static const char *definitions_template =
 	"#define HAS_TEXTURE %d\n"
 	"#define HAS_LIGHTING %d\n"
 	"#define HAS_PHONG %d\n"
@@ -666,26 +743,47 @@ upload_glsl_program (hikaru_renderer_t *hr, hikaru_mesh_t *mesh)
 	"#define HAS_LIGHT3_SPECULAR %d\n"
 	"#define HAS_FOG %d\n";
 
-	hikaru_glsl_variant_t variant;
-	char *definitions, *vs_source, *fs_source;
-	int ret, i;
-
-	variant = get_glsl_variant (hr, mesh);
-	if (hr->meshes.variant.full == variant.full)
-		return;
-
-	hr->meshes.variant.full = variant.full;
+/* The ubershader reads the variant from a per-vertex attribute instead, so
+ * that meshes of different variants can share a multi-draw; the bit
+ * positions must match hikaru_glsl_variant_t. Each stage defines
+ * VARIANT_INPUT as its own copy of the attribute. */
+static const char *uber_definitions =
+	"#define UBERSHADER 1\n"
+	"#define VARIANT_BITS(shift_, width_) int ((VARIANT_INPUT >> shift_) & ((1u << width_) - 1u))\n"
+	"#define HAS_TEXTURE VARIANT_BITS (0u, 1u)\n"
+	"#define HAS_LIGHTING VARIANT_BITS (1u, 1u)\n"
+	"#define HAS_PHONG VARIANT_BITS (2u, 1u)\n"
+	"#define HAS_LIGHT0 VARIANT_BITS (3u, 1u)\n"
+	"#define LIGHT0_TYPE VARIANT_BITS (4u, 2u)\n"
+	"#define LIGHT0_ATT_TYPE VARIANT_BITS (6u, 3u)\n"
+	"#define HAS_LIGHT0_SPECULAR VARIANT_BITS (9u, 1u)\n"
+	"#define HAS_LIGHT1 VARIANT_BITS (10u, 1u)\n"
+	"#define LIGHT1_TYPE VARIANT_BITS (11u, 2u)\n"
+	"#define LIGHT1_ATT_TYPE VARIANT_BITS (13u, 3u)\n"
+	"#define HAS_LIGHT1_SPECULAR VARIANT_BITS (16u, 1u)\n"
+	"#define HAS_LIGHT2 VARIANT_BITS (17u, 1u)\n"
+	"#define LIGHT2_TYPE VARIANT_BITS (18u, 2u)\n"
+	"#define LIGHT2_ATT_TYPE VARIANT_BITS (20u, 3u)\n"
+	"#define HAS_LIGHT2_SPECULAR VARIANT_BITS (23u, 1u)\n"
+	"#define HAS_LIGHT3 VARIANT_BITS (24u, 1u)\n"
+	"#define LIGHT3_TYPE VARIANT_BITS (25u, 2u)\n"
+	"#define LIGHT3_ATT_TYPE VARIANT_BITS (27u, 3u)\n"
+	"#define HAS_LIGHT3_SPECULAR VARIANT_BITS (30u, 1u)\n"
+	"#define HAS_FOG VARIANT_BITS (31u, 1u)\n";
 
-	for (i = 0; i < num_programs; i++) {
-		if (program_cache[i].variant.full == variant.full) {
-			hr->meshes.program = program_cache[i].program;
-			goto update_locations;
-		}
-	}
+static GLuint
+compile_glsl_program (hikaru_glsl_variant_t variant)
+{
+	char *definitions, *vs_source, *fs_source;
+	GLuint program;
+	int ret;
 
 	VK_LOG ("compiling shader for variant %X", variant.full);
 
-	ret = asprintf (&definitions, definitions_template,
+	if (variant.full == HR_UBERSHADER_VARIANT)
+		ret = asprintf (&definitions, "%s", uber_definitions);
+	else
+		ret = asprintf (&definitions, definitions_template,
 	                variant.has_texture,
 	                variant.has_lighting,
 	                variant.has_phong,
@@ -714,68 +812,281 @@ upload_glsl_program (hikaru_renderer_t *hr, hikaru_mesh_t *mesh)
 	ret = asprintf (&fs_source, mesh_fs_source, definitions);
 	VK_ASSERT (ret >= 0);
 
-	hr->meshes.variant = variant;
-	hr->meshes.program = vk_renderer_compile_program (vs_source, fs_source);
+	program = vk_renderer_compile_program (vs_source, fs_source);
 
 	free (definitions);
 	free (vs_source);
 	free (fs_source);
 
 	if (0) {
-		vk_renderer_print_uniforms (hr->meshes.program);
+		vk_renderer_print_uniforms (program);
 		VK_ASSERT_NO_GL_ERROR ();
 	}
 
-	program_cache[num_programs].variant.full = variant.full;
-	program_cache[num_programs].program = hr->meshes.program;
-	num_programs++;
-	VK_ASSERT (num_programs < MAX_PROGRAMS);
+	bind_uniform_blocks (program);
+	return program;
+}
+
+/****************************************************************************
+ Program Cache
+****************************************************************************/
 
-update_locations:
+/* The on-disk cache starts with a 32-byte header, followed by a 32-bit
+ * hash of the GL driver strings and of the shader sources; if either
+ * changes, the whole cache is discarded. Each entry is made of the
+ * variant, the binary format and length (all 32-bit), and the binary. */
 
-	glUseProgram (hr->meshes.program);
-	VK_ASSERT_NO_GL_ERROR ();
+#define PROGRAM_CACHE_VERSION	1
+#define PROGRAM_CACHE_FILE	"hikaru-programs.bin"
 
-	hr->meshes.locs.u_projection =
-		glGetUniformLocation (hr->meshes.program, "u_projection");
-	hr->meshes.locs.u_modelview =
-		glGetUniformLocation (hr->meshes.program, "u_modelview");
-	hr->meshes.locs.u_normal =
-		glGetUniformLocation (hr->meshes.program, "u_normal");
-	for (i = 0; i < 4; i++) {
-		char temp[64];
-
-		sprintf (temp, "u_lights[%d].position", i);
-		hr->meshes.locs.u_lights[i].position =
-			glGetUniformLocation (hr->meshes.program, temp);
-		sprintf (temp, "u_lights[%d].direction", i);
-		hr->meshes.locs.u_lights[i].direction =
-			glGetUniformLocation (hr->meshes.program, temp);
-		sprintf (temp, "u_lights[%d].diffuse", i);
-		hr->meshes.locs.u_lights[i].diffuse =
-			glGetUniformLocation (hr->meshes.program, temp);
-		sprintf (temp, "u_lights[%d].specular", i);
-		hr->meshes.locs.u_lights[i].specular =
-			glGetUniformLocation (hr->meshes.program, temp);
-		sprintf (temp, "u_lights[%d].extents", i);
-		hr->meshes.locs.u_lights[i].extents =
-			glGetUniformLocation (hr->meshes.program, temp);
+static hikaru_program_t *
+lookup_program (hikaru_renderer_t *hr, hikaru_glsl_variant_t variant)
+{
+	uint32_t i = (variant.full * 2654435761u) & (HR_PROGRAM_CACHE_SIZE - 1);
+
+	/* Linear probing; the table is never full, see insert_program. */
+	while (hr->programs.table[i].program &&
+	       hr->programs.table[i].variant.full != variant.full)
+		i = (i + 1) & (HR_PROGRAM_CACHE_SIZE - 1);
+	return &hr->programs.table[i];
+}
+
+static void
+insert_program (hikaru_renderer_t *hr, hikaru_glsl_variant_t variant,
+                GLuint program)
+{
+	hikaru_program_t *slot = lookup_program (hr, variant);
+
+	VK_ASSERT (!slot->program);
+	VK_ASSERT (hr->programs.num < HR_PROGRAM_CACHE_SIZE / 2);
+
+	slot->variant = variant;
+	slot->program = program;
+	hr->programs.num++;
+}
+
+static uint32_t
+hash_string (uint32_t hash, const char *str)
+{
+	/* FNV-1a */
+	for (; str && *str; str++)
+		hash = (hash ^ (uint8_t) *str) * 16777619u;
+	return hash;
+}
+
+static uint32_t
+get_program_cache_key (void)
+{
+	uint32_t hash = 2166136261u;
+
+	hash = hash_string (hash, (const char *) glGetString (GL_VENDOR));
+	hash = hash_string (hash, (const char *) glGetString (GL_RENDERER));
+	hash = hash_string (hash, (const char *) glGetString (GL_VERSION));
+	hash = hash_string (hash, mesh_vs_source);
+	hash = hash_string (hash, mesh_fs_source);
+	hash = hash_string (hash, definitions_template);
+	hash = hash_string (hash, uber_definitions);
+	return hash;
+}
+
+/* Returns false if the file doesn't end right after a complete entry, as
+ * happens if we crashed while appending to it. GOOD_OFFS is set to the end
+ * of the last complete entry. */
+
+static bool
+load_program_cache_entries (hikaru_renderer_t *hr, FILE *fp, long *good_offs)
+{
+	uint32_t entry[3];
+	void *data;
+
+	*good_offs = ftell (fp);
+	while (fread (entry, sizeof (entry), 1, fp) == 1) {
+		hikaru_glsl_variant_t variant;
+		GLuint program;
+
+		variant.full = entry[0];
+		data = malloc (entry[2]);
+		if (!data || fread (data, entry[2], 1, fp) != 1) {
+			free (data);
+			return false;
+		}
+
+		if (!lookup_program (hr, variant)->program &&
+		    hr->programs.num < HR_PROGRAM_CACHE_SIZE / 2) {
+			program = vk_renderer_load_program_binary (entry[1], data,
+			                                           entry[2]);
+			if (program) {
+				bind_uniform_blocks (program);
+				insert_program (hr, variant, program);
+			}
+		}
+		free (data);
+		*good_offs = ftell (fp);
+	}
+	return feof (fp) && ftell (fp) == *good_offs;
+}
+
+static void
+load_program_cache (hikaru_renderer_t *hr)
+{
+	char header[32], expected[32];
+	uint32_t key, cached_key;
+	bool valid = false, clean = true;
+	long good_offs = 0;
+	char *path;
+	FILE *fp;
+
+	if (!vk_util_get_bool_option ("HR_PROGRAM_CACHE", true) ||
+	    !vk_renderer_has_program_binary ())
+		return;
+
+	path = vk_util_get_cache_path (PROGRAM_CACHE_FILE);
+	if (!path)
+		return;
+
+	memset (expected, 0, sizeof (expected));
+	snprintf (expected, sizeof (expected), "valkyrie programs %08X\n",
+	          PROGRAM_CACHE_VERSION);
+	key = get_program_cache_key ();
+
+	fp = fopen (path, "rb");
+	if (fp) {
+		if (fread (header, sizeof (header), 1, fp) == 1 &&
+		    fread (&cached_key, sizeof (cached_key), 1, fp) == 1 &&
+		    !memcmp (header, expected, sizeof (header)) &&
+		    cached_key == key) {
+			clean = load_program_cache_entries (hr, fp, &good_offs);
+			valid = true;
+		}
+		fclose (fp);
 	}
-	hr->meshes.locs.u_ambient =
-		glGetUniformLocation (hr->meshes.program, "u_ambient");
-	hr->meshes.locs.u_texture =
-		glGetUniformLocation (hr->meshes.program, "u_texture");
-	hr->meshes.locs.u_fog =
-		glGetUniformLocation (hr->meshes.program, "u_fog");
-	hr->meshes.locs.u_fog_color =
-		glGetUniformLocation (hr->meshes.program, "u_fog_color");
+
+	VK_LOG ("loaded %u programs from '%s'", hr->programs.num, path);
+
+	/* Drop a truncated trailing entry, or new entries appended after it
+	 * would never be read back. */
+	if (valid && !clean) {
+		VK_LOG ("truncating program cache '%s' to %ld bytes",
+		        path, good_offs);
+		if (good_offs < 0 || truncate (path, good_offs))
+			valid = false;
+	}
+
+	/* Append new programs to a valid cache; start afresh otherwise. */
+	if (valid)
+		hr->programs.fp = fopen (path, "ab");
+	else {
+		hr->programs.fp = fopen (path, "wb");
+		if (hr->programs.fp &&
+		    (fwrite (expected, sizeof (expected), 1, hr->programs.fp) != 1 ||
+		     fwrite (&key, sizeof (key), 1, hr->programs.fp) != 1)) {
+			fclose (hr->programs.fp);
+			hr->programs.fp = NULL;
+		}
+	}
+	if (!hr->programs.fp)
+		VK_ERROR ("could not open program cache '%s'", path);
+
+	free (path);
 	VK_ASSERT_NO_GL_ERROR ();
 }
 
 static void
-upload_viewport (hikaru_renderer_t *hr, hikaru_mesh_t *mesh)
+save_program_binary (hikaru_renderer_t *hr, hikaru_glsl_variant_t variant,
+                     GLuint program)
+{
+	uint32_t entry[3];
+	GLenum format;
+	GLsizei length;
+	void *data;
+
+	if (!hr->programs.fp)
+		return;
+
+	data = vk_renderer_get_program_binary (program, &format, &length);
+	if (!data)
+		return;
+
+	entry[0] = variant.full;
+	entry[1] = format;
+	entry[2] = length;
+
+	if (fwrite (entry, sizeof (entry), 1, hr->programs.fp) != 1 ||
+	    fwrite (data, length, 1, hr->programs.fp) != 1)
+		VK_ERROR ("could not write to the program cache");
+	fflush (hr->programs.fp);
+
+	free (data);
+}
+
+static void
+destroy_program_cache (hikaru_renderer_t *hr)
+{
+	unsigned i;
+
+	if (hr->programs.fp)
+		fclose (hr->programs.fp);
+	hr->programs.fp = NULL;
+
+	glUseProgram (0);
+	for (i = 0; i < HR_PROGRAM_CACHE_SIZE; i++)
+		vk_renderer_destroy_program (hr->programs.table[i].program);
+
+	memset ((void *) &hr->programs, 0, sizeof (hr->programs));
+}
+
+static void
+upload_glsl_program (hikaru_renderer_t *hr, hikaru_mesh_t *mesh)
+{
+	hikaru_glsl_variant_t key = mesh->program_key;
+	hikaru_program_t *slot;
+
+	if (hr->meshes.program && hr->meshes.program_key.full == key.full)
+		return;
+
+	hr->meshes.program_key.full = key.full;
+
+	slot = lookup_program (hr, key);
+	if (!slot->program) {
+		GLuint program = compile_glsl_program (key);
+
+		insert_program (hr, key, program);
+		save_program_binary (hr, key, program);
+
+		slot = lookup_program (hr, key);
+	}
+
+	if (hr->meshes.program != slot->program) {
+		hr->meshes.program = slot->program;
+
+		glUseProgram (hr->meshes.program);
+		VK_ASSERT_NO_GL_ERROR ();
+
+		hr->meshes.locs.u_texture =
+			glGetUniformLocation (hr->meshes.program, "u_texture");
+		VK_ASSERT_NO_GL_ERROR ();
+
+		glUniform1i (hr->meshes.locs.u_texture, 0);
+		VK_ASSERT_NO_GL_ERROR ();
+	}
+}
+
+static void
+get_light_ambient (hikaru_renderer_t *hr, hikaru_viewport_t *vp, float *out)
+{
+	if (hr->debug.flags[HR_DEBUG_NO_AMBIENT])
+		out[0] = out[1] = out[2] = 0.0f;
+	else {
+		out[0] = vp->color.ambient[0] * INV255;
+		out[1] = vp->color.ambient[1] * INV255;
+		out[2] = vp->color.ambient[2] * INV255;
+	}
+}
+
+static void
+fill_viewport_block (hikaru_renderer_t *hr, hikaru_viewport_t *vp,
+                     hikaru_viewport_block_t *block)
 {
-	hikaru_viewport_t *vp = &hr->vp_list[mesh->vp_index];
 	const float h = vp->clip.t - vp->clip.b;
 	const float w = vp->clip.r - vp->clip.l;
 	const float n_over_f = vp->clip.n / vp->clip.f;
@@ -783,9 +1094,6 @@ upload_viewport (hikaru_renderer_t *hr, hikaru_mesh_t *mesh)
 	const float hw_at_n = hh_at_n * (w / h);
 	const float dcx = (vp->offset.x - (w / 2.0f));
 	const float dcy = (vp->offset.y - (h / 2.0f));
-	mtx4x4f_t projection;
-
-	VK_ASSERT (mesh->vp_index != ~0);
 
 	if (!isnonnegative (vp->clip.l) || !isnonnegative (vp->clip.r) ||
 	    !isnonnegative (vp->clip.b) || !isnonnegative (vp->clip.t) ||
@@ -813,100 +1121,28 @@ upload_viewport (hikaru_renderer_t *hr, hikaru_mesh_t *mesh)
 	LOG ("vp  = %s : [w=%f h=%f dcx=%f dcy=%f]",
 	     get_viewport_str (vp), w, h, dcx, dcy);
 
-	vk_renderer_frustum (projection,
+	vk_renderer_frustum (block->projection,
 	                     -hw_at_n, hw_at_n,
 	                     -hh_at_n, hh_at_n,
 	                     vp->clip.n, 1e5);
-//	vk_renderer_translate (projection, dcx, -dcy, 0.0f);
-
-	glUniformMatrix4fv (hr->meshes.locs.u_projection, 1, GL_FALSE,
-	                    (const GLfloat *) projection);
-
-	glViewport (vp->clip.l,
-	            vp->clip.b,
-	            vp->clip.r - vp->clip.l,
-	            vp->clip.t - vp->clip.b);
+//	vk_renderer_translate (block->projection, dcx, -dcy, 0.0f);
 
-	if (hr->meshes.variant.has_fog) {
-		vec2f_t fog;
-		vec3f_t fog_color;
+	get_light_ambient (hr, vp, block->ambient);
 
-		fog[0] = vp->depth.density;
-		fog[1] = vp->depth.bias;
-		glUniform2fv (hr->meshes.locs.u_fog, 1, fog);
+	block->fog[0] = vp->depth.density;
+	block->fog[1] = vp->depth.bias;
 
-		fog_color[0] = vp->depth.mask[0] * INV255;
-		fog_color[1] = vp->depth.mask[1] * INV255;
-		fog_color[2] = vp->depth.mask[2] * INV255;
-		glUniform3fv (hr->meshes.locs.u_fog_color, 1, fog_color);
-	}
+	block->fog_color[0] = vp->depth.mask[0] * INV255;
+	block->fog_color[1] = vp->depth.mask[1] * INV255;
+	block->fog_color[2] = vp->depth.mask[2] * INV255;
 }
 
 static void
-upload_modelview (hikaru_renderer_t *hr, hikaru_mesh_t *mesh, unsigned i)
+fill_modelview_block (hikaru_renderer_t *hr, hikaru_modelview_t *mv,
+                      hikaru_modelview_block_t *block)
 {
-	hikaru_modelview_t *mv = &hr->mv_list[mesh->mv_index + i];
-	mtx3x3f_t normal;
-
-	if (mesh->mv_index == ~0) {
-		static const hikaru_modelview_t identity_mv = {
-			.mtx = {
-				{ 1.0f, 0.0f, 0.0f, 0.0f },
-				{ 0.0f, 1.0f, 0.0f, 0.0f },
-				{ 0.0f, 0.0f, 1.0f, 0.0f },
-				{ 0.0f, 0.0f, 0.0f, 1.0f }
-			}
-		};
-
-		VK_ERROR ("attempting to draw with no modelview!");
-
-		/* Attempt to render something anyway. */
-		mv = (hikaru_modelview_t *) &identity_mv;
-	}
-
-	vk_renderer_compute_normal_matrix (normal, mv->mtx);
-
-	LOG ("mv  = [%u+%u] %s", mesh->mv_index, i, get_modelview_str (mv));
-	glUniformMatrix4fv (hr->meshes.locs.u_modelview, 1, GL_FALSE,
-	                    (const GLfloat *) mv->mtx);
-
-	glUniformMatrix3fv (hr->meshes.locs.u_normal, 1, GL_FALSE,
-	                    (const GLfloat *) normal);
-}
-
-static void
-upload_material_texhead (hikaru_renderer_t *hr, hikaru_mesh_t *mesh)
-{
-	hikaru_texture_t *tex;
-
-	if (!hr->meshes.variant.has_texture)
-		return;
-
-	tex = get_texture (hr, &hr->tex_list[mesh->tex_index]);
-
-	glActiveTexture (GL_TEXTURE0 + 0);
-	VK_ASSERT_NO_GL_ERROR ();
-
-	glBindTexture (GL_TEXTURE_2D, tex ? tex->id : 0);
-	VK_ASSERT_NO_GL_ERROR ();
-
-	glUniform1i (hr->meshes.locs.u_texture, 0);
-	VK_ASSERT_NO_GL_ERROR ();
-}
-
-static void
-get_light_ambient (hikaru_renderer_t *hr, hikaru_mesh_t *mesh, float *out)
-{
-	hikaru_viewport_t *vp =
-		(mesh->vp_index == ~0) ? NULL : &hr->vp_list[mesh->vp_index];
-
-	if (hr->debug.flags[HR_DEBUG_NO_AMBIENT] || !vp)
-		out[0] = out[1] = out[2] = 0.0f;
-	else {
-		out[0] = vp->color.ambient[0] * INV255;
-		out[1] = vp->color.ambient[1] * INV255;
-		out[2] = vp->color.ambient[2] * INV255;
-	}
+	memcpy ((void *) block->modelview, (const void *) mv->mtx,
+	        sizeof (mtx4x4f_t));
 }
 
 static void
@@ -941,65 +1177,179 @@ get_light_specular (hikaru_renderer_t *hr, hikaru_light_t *lit, float *out)
 }
 
 static void
-upload_lightset (hikaru_renderer_t *hr, hikaru_mesh_t *mesh)
+fill_lightset_block (hikaru_renderer_t *hr, hikaru_lightset_t *ls,
+                     hikaru_lightset_block_t *block)
 {
-	hikaru_lightset_t *ls = &hr->ls_list[mesh->ls_index];
-	float tmp[4];
 	unsigned i;
 
-	if (!hr->meshes.variant.has_lighting)
-		return;
-
 	LOG ("lightset = %s", get_lightset_str (ls));
 
-	get_light_ambient (hr, mesh, tmp);
-	glUniform3fv (hr->meshes.locs.u_ambient, 1, (const GLfloat *) tmp);
-	VK_ASSERT_NO_GL_ERROR ();
-
 	for (i = 0; i < 4; i++) {
 		hikaru_light_t *lt = &ls->lights[i];
 
-		if (ls->mask & (1 << i))
-			continue;
+		if (ls->mask & (1 << i))
+			continue;
+
+		VK_COPY_VEC3F (block->lights[i].position, lt->position);
+		VK_COPY_VEC3F (block->lights[i].direction, lt->direction);
+		get_light_diffuse (hr, lt, block->lights[i].diffuse);
+		get_light_specular (hr, lt, block->lights[i].specular);
+		VK_COPY_VEC2F (block->lights[i].extents, lt->attenuation);
+	}
+}
+
+#define BLOCK(type_, name_) \
+	((type_ *) &hr->meshes.blocks[HR_BLOCK_##name_].data[i * \
+	            hr->meshes.blocks[HR_BLOCK_##name_].stride])
+
+static void
+upload_block_data (hikaru_renderer_t *hr, unsigned block, unsigned num)
+{
+	glBindBuffer (GL_UNIFORM_BUFFER, hr->meshes.blocks[block].ubo);
+	glBufferData (GL_UNIFORM_BUFFER,
+	              hr->meshes.blocks[block].stride * num,
+	              (const GLvoid *) hr->meshes.blocks[block].data,
+	              GL_STREAM_DRAW);
+	VK_ASSERT_NO_GL_ERROR ();
+}
+
+/* Uploads the viewport, modelview and lightset state of the whole frame to
+ * the uniform buffers. */
+static void
+upload_uniform_blocks (hikaru_renderer_t *hr)
+{
+	static const hikaru_modelview_t identity_mv = {
+		.mtx = {
+			{ 1.0f, 0.0f, 0.0f, 0.0f },
+			{ 0.0f, 1.0f, 0.0f, 0.0f },
+			{ 0.0f, 0.0f, 1.0f, 0.0f },
+			{ 0.0f, 0.0f, 0.0f, 1.0f }
+		}
+	};
+	unsigned i;
+
+	for (i = 0; i < hr->num_vps; i++)
+		fill_viewport_block (hr, &hr->vp_list[i],
+		                     BLOCK (hikaru_viewport_block_t, VIEWPORT));
+	upload_block_data (hr, HR_BLOCK_VIEWPORT, hr->num_vps);
+
+	/* The entry past the last modelview is the identity, used as a
+	 * fallback for meshes with no modelview. */
+	for (i = 0; i < hr->num_mvs; i++)
+		fill_modelview_block (hr, &hr->mv_list[i],
+		                      BLOCK (hikaru_modelview_block_t, MODELVIEW));
+	fill_modelview_block (hr, (hikaru_modelview_t *) &identity_mv,
+	                      BLOCK (hikaru_modelview_block_t, MODELVIEW));
+	upload_block_data (hr, HR_BLOCK_MODELVIEW, hr->num_mvs + 1);
+
+	for (i = 0; i < hr->num_lss; i++)
+		fill_lightset_block (hr, &hr->ls_list[i],
+		                     BLOCK (hikaru_lightset_block_t, LIGHTSET));
+	upload_block_data (hr, HR_BLOCK_LIGHTSET, hr->num_lss);
+
+	glBindBuffer (GL_UNIFORM_BUFFER, 0);
+}
+
+#undef BLOCK
+
+static void
+bind_block (hikaru_renderer_t *hr, unsigned block, unsigned index,
+            size_t size)
+{
+	glBindBufferRange (GL_UNIFORM_BUFFER, block,
+	                   hr->meshes.blocks[block].ubo,
+	                   index * hr->meshes.blocks[block].stride, size);
+	VK_ASSERT_NO_GL_ERROR ();
+}
+
+static void
+upload_viewport (hikaru_renderer_t *hr, hikaru_mesh_t *mesh)
+{
+	hikaru_viewport_t *vp = &hr->vp_list[mesh->vp_index];
+
+	VK_ASSERT (mesh->vp_index != ~0);
+
+	if (hr->meshes.bound.vp_index == mesh->vp_index)
+		return;
+	hr->meshes.bound.vp_index = mesh->vp_index;
+
+	bind_block (hr, HR_BLOCK_VIEWPORT, mesh->vp_index,
+	            sizeof (hikaru_viewport_block_t));
+
+	glViewport (vp->clip.l,
+	            vp->clip.b,
+	            vp->clip.r - vp->clip.l,
+	            vp->clip.t - vp->clip.b);
+}
+
+static void
+upload_modelview (hikaru_renderer_t *hr, hikaru_mesh_t *mesh, unsigned i)
+{
+	uint32_t index = mesh->mv_index + i;
+
+	if (mesh->mv_index == ~0) {
+		VK_ERROR ("attempting to draw with no modelview!");
+
+		/* Attempt to render something anyway. */
+		index = hr->num_mvs;
+	}
+
+	if (hr->meshes.bound.mv_index == index)
+		return;
+	hr->meshes.bound.mv_index = index;
+
+	LOG ("mv  = [%u+%u] %s", mesh->mv_index, i,
+	     (index < hr->num_mvs) ?
+	     get_modelview_str (&hr->mv_list[index]) : "identity");
+
+	bind_block (hr, HR_BLOCK_MODELVIEW, index,
+	            sizeof (hikaru_modelview_block_t));
+}
+
+static void
+upload_material_texhead (hikaru_renderer_t *hr, hikaru_mesh_t *mesh)
+{
+	hikaru_texture_t *tex;
+	GLuint id;
+
+	/* Batches never mix textured and untextured meshes; see tex_key. */
+	if (!mesh->variant.has_texture)
+		return;
+
+	tex = get_texture (hr, &hr->tex_list[mesh->tex_index]);
+	id = tex ? tex->id : 0;
+
+	if (hr->meshes.bound.texture == id)
+		return;
+	hr->meshes.bound.texture = id;
 
-		glUniform3fv (hr->meshes.locs.u_lights[i].position, 1,
-		              lt->position);
-		VK_ASSERT_NO_GL_ERROR ();
+	glActiveTexture (GL_TEXTURE0 + 0);
+	VK_ASSERT_NO_GL_ERROR ();
 
-		glUniform3fv (hr->meshes.locs.u_lights[i].direction, 1,
-		              lt->direction);
-		VK_ASSERT_NO_GL_ERROR ();
+	glBindTexture (GL_TEXTURE_2D, id);
+	VK_ASSERT_NO_GL_ERROR ();
+}
 
-		get_light_diffuse (hr, lt, tmp);
-		glUniform3fv (hr->meshes.locs.u_lights[i].diffuse, 1, tmp);
-		VK_ASSERT_NO_GL_ERROR ();
+static void
+upload_lightset (hikaru_renderer_t *hr, hikaru_mesh_t *mesh)
+{
+	/* An ubershader batch may mix lit and unlit meshes. */
+	if (!mesh->variant.has_lighting &&
+	    mesh->program_key.full != HR_UBERSHADER_VARIANT)
+		return;
 
-		get_light_specular (hr, lt, tmp);
-		glUniform3fv (hr->meshes.locs.u_lights[i].specular, 1, tmp);
-		VK_ASSERT_NO_GL_ERROR ();
+	if (hr->meshes.bound.ls_index == mesh->ls_index)
+		return;
+	hr->meshes.bound.ls_index = mesh->ls_index;
 
-		glUniform2fv (hr->meshes.locs.u_lights[i].extents, 1,
-		              lt->attenuation);
-	}
+	bind_block (hr, HR_BLOCK_LIGHTSET, mesh->ls_index,
+	            sizeof (hikaru_lightset_block_t));
 }
 
 /****************************************************************************
  Meshes
 ****************************************************************************/
 
-#define VK_COPY_VEC2F(dst_, src_) \
-	do { \
-		dst_[0] = src_[0]; \
-		dst_[1] = src_[1]; \
-	} while (0)
-
-#define VK_COPY_VEC3F(dst_, src_) \
-	do { \
-		dst_[0] = src_[0]; \
-		dst_[1] = src_[1]; \
-		dst_[2] = src_[2]; \
-	} while (0)
-
 static float
 clampf (float x, float min_, float max_)
 {
@@ -1104,7 +1454,7 @@ hikaru_renderer_push_vertices (vk_renderer_t *rend,
 	VK_ASSERT (num == 1 || num == 3);
 	VK_ASSERT (v->info.tricap == 0 || v->info.tricap == 7);
 
-	if (hr->debug.flags[HR_DEBUG_NO_3D])
+	if (vk_renderer_is_null (rend) || hr->debug.flags[HR_DEBUG_NO_3D])
 		return;
 
 	if (hr->debug.flags[HR_DEBUG_SELECT_VIEWPORT] >= 0 &&
@@ -1201,21 +1551,32 @@ update_and_set_rendstate (hikaru_renderer_t *hr, hikaru_mesh_t *mesh)
 	hikaru_gpu_t *gpu = hr->gpu;
 	unsigned i;
 
-	LOG ("RENDSTATE updating vp %u/%u", hr->num_vps, MAX_VIEWPORTS);
-	hr->vp_list[hr->num_vps++] = VP0;
-	VK_ASSERT (hr->num_vps < MAX_VIEWPORTS);
+	/* Only append state that differs from the last entry; this way,
+	 * meshes sharing the same state also share the same indices, which
+	 * is what draw-time batching compares. */
+	if (!hr->num_vps || memcmp (&VP0, &hr->vp_list[hr->num_vps - 1], sizeof (VP0))) {
+		LOG ("RENDSTATE updating vp %u/%u", hr->num_vps, MAX_VIEWPORTS);
+		hr->vp_list[hr->num_vps++] = VP0;
+		VK_ASSERT (hr->num_vps < MAX_VIEWPORTS);
+	}
 
-	LOG ("RENDSTATE updating mat %u/%u", hr->num_mats, MAX_MATERIALS);
-	hr->mat_list[hr->num_mats++] = MAT0;
-	VK_ASSERT (hr->num_mats < MAX_MATERIALS);
+	if (!hr->num_mats || memcmp (&MAT0, &hr->mat_list[hr->num_mats - 1], sizeof (MAT0))) {
+		LOG ("RENDSTATE updating mat %u/%u", hr->num_mats, MAX_MATERIALS);
+		hr->mat_list[hr->num_mats++] = MAT0;
+		VK_ASSERT (hr->num_mats < MAX_MATERIALS);
+	}
 
-	LOG ("RENDSTATE updating tex %u/%u", hr->num_texs, MAX_TEXHEADS);
-	hr->tex_list[hr->num_texs++] = TEX0;
-	VK_ASSERT (hr->num_texs < MAX_TEXHEADS);
+	if (!hr->num_texs || memcmp (&TEX0, &hr->tex_list[hr->num_texs - 1], sizeof (TEX0))) {
+		LOG ("RENDSTATE updating tex %u/%u", hr->num_texs, MAX_TEXHEADS);
+		hr->tex_list[hr->num_texs++] = TEX0;
+		VK_ASSERT (hr->num_texs < MAX_TEXHEADS);
+	}
 
-	LOG ("RENDSTATE updating ls %u/%u", hr->num_lss, MAX_LIGHTSETS);
-	hr->ls_list[hr->num_lss++] = LS0;
-	VK_ASSERT (hr->num_lss < MAX_LIGHTSETS);
+	if (!hr->num_lss || memcmp (&LS0, &hr->ls_list[hr->num_lss - 1], sizeof (LS0))) {
+		LOG ("RENDSTATE updating ls %u/%u", hr->num_lss, MAX_LIGHTSETS);
+		hr->ls_list[hr->num_lss++] = LS0;
+		VK_ASSERT (hr->num_lss < MAX_LIGHTSETS);
+	}
 
 	/* Copy the per-instance modelviews from last to first. */
 	/* TODO optimize by setting MV.total to 0 (and fix the fallback). */
@@ -1270,23 +1631,48 @@ update_and_set_rendstate (hikaru_renderer_t *hr, hikaru_mesh_t *mesh)
 	}
 
 static void
-draw_mesh (hikaru_renderer_t *hr, hikaru_mesh_t *mesh)
+set_vertex_attribs (hikaru_renderer_t *hr)
 {
-	unsigned i;
+	VAP (0, 3, GL_FLOAT,          position,  GL_FALSE);
+	VAP (1, 3, GL_FLOAT,          normal,    GL_FALSE);
+	VAP (2, 3, GL_UNSIGNED_BYTE,  diffuse,   GL_TRUE);
+	VAP (3, 3, GL_UNSIGNED_BYTE,  ambient,   GL_TRUE);
+	VAP (4, 4, GL_UNSIGNED_BYTE,  specular,  GL_TRUE);
+	VAP (5, 3, GL_UNSIGNED_SHORT, unknown,   GL_TRUE);
+	VAP (6, 2, GL_FLOAT,          texcoords, GL_FALSE);
+	VAP (7, 1, GL_UNSIGNED_BYTE,  alpha,     GL_TRUE);
+
+	/* Only read by the ubershader. */
+	glVertexAttribIPointer (8, 1, GL_UNSIGNED_INT,
+	                        sizeof (hikaru_vertex_body_t), OFFSET (variant));
+	glEnableVertexAttribArray (8);
+	VK_ASSERT_NO_GL_ERROR ();
+}
+
+#define MAX_BATCH	256
+
+/* Draws NUM consecutive meshes sharing the same rendering state; see
+ * can_batch_meshes (). A batch of more than one mesh is drawn with a
+ * single glMultiDrawArrays call. */
+static void
+draw_batch (hikaru_renderer_t *hr, hikaru_mesh_t *meshes, unsigned num)
+{
+	hikaru_mesh_t *mesh = &meshes[0];
+	unsigned i, num_vertices = 0;
 
 	VK_ASSERT (mesh);
-	VK_ASSERT (mesh->vbo);
+	VK_ASSERT (num > 0 && num <= MAX_BATCH);
 
-	LOG ("==== DRAWING MESH @%p (#vertices=%u #instances=%u) ====",
-	     mesh, mesh->num_tris * 3, mesh->num_instances);
+	LOG ("==== DRAWING MESH @%p (#vertices=%u #instances=%u #batched=%u) ====",
+	     mesh, mesh->num_tris * 3, mesh->num_instances, num);
 
 	print_rendstate (hr, mesh, "D");
 
-	glBindVertexArray (hr->meshes.vao);
-	VK_ASSERT_NO_GL_ERROR ();
-
-	glBindBuffer (GL_ARRAY_BUFFER, mesh->vbo);
-	VK_ASSERT_NO_GL_ERROR ();
+	if (vk_trace_enabled) {
+		for (i = 0; i < num; i++)
+			num_vertices += meshes[i].num_tris * 3;
+		vk_trace_event (VK_TRACE_DRAW, num, num_vertices);
+	}
 
 	upload_glsl_program (hr, mesh);
 	VK_ASSERT_NO_GL_ERROR ();
@@ -1296,61 +1682,71 @@ draw_mesh (hikaru_renderer_t *hr, hikaru_mesh_t *mesh)
 	upload_lightset (hr, mesh);
 	VK_ASSERT_NO_GL_ERROR ();
 
-	/* We must do it here since locs are computed in upload_glsl_program. */
-	VAP (0, 3, GL_FLOAT,          position,  GL_FALSE);
-	VAP (1, 3, GL_FLOAT,          normal,    GL_FALSE);
-	VAP (2, 3, GL_UNSIGNED_BYTE,  diffuse,   GL_TRUE);
-	VAP (3, 3, GL_UNSIGNED_BYTE,  ambient,   GL_TRUE);
-	VAP (4, 4, GL_UNSIGNED_BYTE,  specular,  GL_TRUE);
-	VAP (5, 3, GL_UNSIGNED_SHORT, unknown,   GL_TRUE);
-	VAP (6, 2, GL_FLOAT,          texcoords, GL_FALSE);
-	VAP (7, 1, GL_UNSIGNED_BYTE,  alpha,     GL_TRUE);
+	if (hr->meshes.bound.depth_bias != mesh->depth_bias) {
+		hr->meshes.bound.depth_bias = mesh->depth_bias;
+		glPolygonOffset (0.0f, -mesh->depth_bias);
+	}
 
-	glPolygonOffset (0.0f, -mesh->depth_bias);
+	if (num > 1) {
+		GLint first[MAX_BATCH];
+		GLsizei count[MAX_BATCH];
 
-	if (hr->debug.flags[HR_DEBUG_NO_INSTANCING]) {
+		for (i = 0; i < num; i++) {
+			first[i] = meshes[i].first;
+			count[i] = meshes[i].num_tris * 3;
+		}
+		upload_modelview (hr, mesh, 0);
+		glMultiDrawArrays (GL_TRIANGLES, first, count, num);
+	} else if (hr->debug.flags[HR_DEBUG_NO_INSTANCING]) {
 		unsigned i = MIN2 (hr->debug.flags[HR_DEBUG_SELECT_INSTANCE],
 		                   mesh->num_instances - 1);
 		upload_modelview (hr, mesh, i);
-		glDrawArrays (GL_TRIANGLES, 0, mesh->num_tris * 3);
+		glDrawArrays (GL_TRIANGLES, mesh->first, mesh->num_tris * 3);
 	} else {
 		for (i = 0; i < mesh->num_instances; i++) {
 			upload_modelview (hr, mesh, i);
-			glDrawArrays (GL_TRIANGLES, 0, mesh->num_tris * 3);
+			glDrawArrays (GL_TRIANGLES, mesh->first, mesh->num_tris * 3);
 		}
 	}
-
-	glBindVertexArray (0);
 }
 
 #undef OFFSET
 
 static void
-upload_vertex_data (hikaru_renderer_t *hr, hikaru_mesh_t *mesh)
+store_vertex_data (hikaru_renderer_t *hr, hikaru_mesh_t *mesh)
 {
+	uint32_t num_vertices;
+
 	VK_ASSERT (mesh);
 
 	mesh->num_tris = hr->push.num_tris;
+	num_vertices = mesh->num_tris * 3;
 
-	/* Generate the VAO if required. */
-	if (!hr->meshes.vao) {
-		glGenVertexArrays (1, &hr->meshes.vao);
-		VK_ASSERT_NO_GL_ERROR ();
-	}
+	/* Grow the frame vertex store if required. */
+	if (hr->meshes.num_vertices + num_vertices > hr->meshes.max_vertices) {
+		uint32_t max = hr->meshes.max_vertices * 2;
+		hikaru_vertex_body_t *tmp;
 
-	/* Bind the VAO. */
-	glBindVertexArray (hr->meshes.vao);
-	VK_ASSERT_NO_GL_ERROR ();
+		while (max < hr->meshes.num_vertices + num_vertices)
+			max *= 2;
 
-	/* Generate the mesh VBO. */
-	glGenBuffers (1, &mesh->vbo);
+		tmp = (hikaru_vertex_body_t *)
+		      realloc (hr->meshes.vertices,
+		               sizeof (hikaru_vertex_body_t) * max);
+		if (!tmp)
+			VK_ABORT ("out of memory growing the vertex store");
 
-	/* Upload the vertex data to the VBO. */
-	glBindBuffer (GL_ARRAY_BUFFER, mesh->vbo);
-	glBufferData (GL_ARRAY_BUFFER,
-	              sizeof (hikaru_vertex_body_t) * mesh->num_tris * 3,
-	              (const GLvoid *) hr->push.all, GL_DYNAMIC_DRAW);
-	VK_ASSERT_NO_GL_ERROR ();
+		hr->meshes.vertices = tmp;
+		hr->meshes.max_vertices = max;
+	}
+
+	/* Append the pushed vertex data; it is uploaded to the VBO in one
+	 * go in draw_scene (). */
+	mesh->first = hr->meshes.num_vertices;
+	memcpy ((void *) &hr->meshes.vertices[mesh->first],
+	        (const void *) hr->push.all,
+	        sizeof (hikaru_vertex_body_t) * num_vertices);
+	hr->meshes.num_vertices += num_vertices;
 }
 
 void
@@ -1367,7 +1763,7 @@ hikaru_renderer_begin_mesh (vk_renderer_t *rend, uint32_t addr,
 	VK_ASSERT (hr);
 	VK_ASSERT (!hr->meshes.current);
 
-	if (hr->debug.flags[HR_DEBUG_NO_3D])
+	if (vk_renderer_is_null (rend) || hr->debug.flags[HR_DEBUG_NO_3D])
 		return;
 
 	/* Create a new mesh. */
@@ -1393,32 +1789,101 @@ hikaru_renderer_end_mesh (vk_renderer_t *rend, uint32_t addr)
 
 	VK_ASSERT (hr);
 
-	if (hr->debug.flags[HR_DEBUG_NO_3D])
+	if (vk_renderer_is_null (rend) || hr->debug.flags[HR_DEBUG_NO_3D])
 		return;
 
 	VK_ASSERT (hr->meshes.current);
 
-	/* Upload the pushed vertex data. */
-	upload_vertex_data (hr, hr->meshes.current);
+	/* Store the pushed vertex data. */
+	store_vertex_data (hr, hr->meshes.current);
 	hr->meshes.current->addr[1] = addr;
 
+	vk_trace_event (VK_TRACE_MESH, hr->meshes.current->vp_index,
+	                hr->meshes.current->num_tris);
+
 	/* Make sure there is no current mesh bound. */
 	hr->meshes.current = NULL;
 }
 
+static int
+compare_meshes (const void *a_, const void *b_)
+{
+	const hikaru_mesh_t *a = (const hikaru_mesh_t *) a_;
+	const hikaru_mesh_t *b = (const hikaru_mesh_t *) b_;
+
+#define CMP(field_) \
+	if (a->field_ != b->field_) \
+		return (a->field_ < b->field_) ? -1 : 1;
+
+	/* Most expensive state changes first. In ubershader mode, all
+	 * meshes share the program key. */
+	CMP (program_key.full);
+	CMP (tex_key);
+	CMP (vp_index);
+	CMP (ls_index);
+	CMP (mv_index);
+	/* Preserve the submission order for equal state. */
+	CMP (num);
+
+#undef CMP
+
+	return 0;
+}
+
+static bool
+can_batch_meshes (hikaru_mesh_t *a, hikaru_mesh_t *b)
+{
+	return a->program_key.full == b->program_key.full &&
+	       a->tex_key == b->tex_key &&
+	       a->vp_index == b->vp_index &&
+	       a->ls_index == b->ls_index &&
+	       a->mv_index == b->mv_index &&
+	       a->num_instances == 1 &&
+	       b->num_instances == 1 &&
+	       a->depth_bias == b->depth_bias;
+}
+
+/* Computes the sorting/batching keys of all meshes in the frame. In
+ * ubershader mode, each vertex also gets its mesh's variant, so that it
+ * must run before the vertex data is uploaded. */
+static void
+compute_mesh_keys (hikaru_renderer_t *hr)
+{
+	bool uber = hr->debug.flags[HR_DEBUG_UBERSHADER];
+	unsigned vpi, polytype, j, k;
+
+	for (vpi = 0; vpi < 8; vpi++)
+		for (polytype = 0; polytype < 8; polytype++)
+			for (j = 0; j < hr->num_meshes[vpi][polytype]; j++) {
+				hikaru_mesh_t *mesh = &hr->mesh_list[vpi][polytype][j];
+				hikaru_vertex_body_t *v = &hr->meshes.vertices[mesh->first];
+
+				mesh->variant = get_glsl_variant (hr, mesh);
+				mesh->program_key.full = uber ?
+					HR_UBERSHADER_VARIANT : mesh->variant.full;
+				mesh->tex_key = mesh->variant.has_texture ?
+					get_texhead_key (&hr->tex_list[mesh->tex_index]) : 0;
+
+				if (uber)
+					for (k = 0; k < mesh->num_tris * 3; k++)
+						v[k].variant = mesh->variant.full;
+			}
+}
+
 static void
 draw_meshes_for_polytype (hikaru_renderer_t *hr, unsigned vpi, int polytype)
 {
 	hikaru_mesh_t *meshes = hr->mesh_list[vpi][polytype];
 	unsigned num = hr->num_meshes[vpi][polytype];
-	int j;
+	bool batching = !hr->debug.flags[HR_DEBUG_NO_BATCHING];
+	unsigned j, k;
 
 	if (num == 0)
 		return;
 
 	if (hr->debug.flags[HR_DEBUG_SELECT_POLYTYPE] >= 0 &&
 	    hr->debug.flags[HR_DEBUG_SELECT_POLYTYPE] != polytype)
-		goto destroy_meshes;
+		return;
 
 	LOG (" ==== DRAWING VP %u, POLYTYPE %d ====", vpi, polytype);
 
@@ -1442,17 +1907,20 @@ draw_meshes_for_polytype (hikaru_renderer_t *hr, unsigned vpi, int polytype)
 		glDisable (GL_POLYGON_OFFSET_FILL);
 		break;
 	}
-	
-	for (j = 0; j < num; j++) {
-		hikaru_mesh_t *mesh = &meshes[j];
-		draw_mesh (hr, mesh);
-	}
 
-destroy_meshes:
-	for (j = 0; j < num; j++) {
-		hikaru_mesh_t *mesh = &meshes[j];
-		if (mesh->vbo)
-			glDeleteBuffers (1, &mesh->vbo);
+	/* Opaque meshes can be drawn in any order; sort them by state to
+	 * minimize state changes and maximize batching. Blended meshes
+	 * must be drawn in submission order. */
+	if (batching && polytype == HIKARU_POLYTYPE_OPAQUE)
+		qsort (meshes, num, sizeof (hikaru_mesh_t), compare_meshes);
+
+	for (j = 0; j < num; j = k) {
+		k = j + 1;
+		if (batching)
+			while (k < num && (k - j) < MAX_BATCH &&
+			       can_batch_meshes (&meshes[j], &meshes[k]))
+				k++;
+		draw_batch (hr, &meshes[j], k - j);
 	}
 }
 
@@ -1491,6 +1959,20 @@ draw_scene (hikaru_renderer_t *hr)
 	glEnable (GL_CULL_FACE);
 	glCullFace (GL_BACK);
 
+	compute_mesh_keys (hr);
+
+	/* Upload the vertex data of all meshes at once. */
+	glBindVertexArray (hr->meshes.vao);
+	glBindBuffer (GL_ARRAY_BUFFER, hr->meshes.vbo);
+	glBufferData (GL_ARRAY_BUFFER,
+	              sizeof (hikaru_vertex_body_t) * hr->meshes.num_vertices,
+	              (const GLvoid *) hr->meshes.vertices, GL_STREAM_DRAW);
+	VK_ASSERT_NO_GL_ERROR ();
+
+	upload_uniform_blocks (hr);
+
+	invalidate_bound_state (hr);
+
 	for (vpi = 0; vpi < 8; vpi++) {
 		glDepthMask (GL_TRUE);
 		glClear (GL_DEPTH_BUFFER_BIT);
@@ -1500,6 +1982,8 @@ draw_scene (hikaru_renderer_t *hr)
 
 	glDepthMask (GL_TRUE);
 
+	glBindVertexArray (0);
+
 	glDisable (GL_SCISSOR_TEST);
 	glViewport (0, 0, 640, 480);
 }
@@ -1519,19 +2003,51 @@ destroy_3d_state (hikaru_renderer_t *hr)
 		for (i = 0; i < 8; i++)
 			free (hr->mesh_list[vpi][i]);
 
-	vk_renderer_destroy_program (hr->meshes.program);
+	free (hr->meshes.vertices);
+
+	glBindBuffer (GL_UNIFORM_BUFFER, 0);
+	for (i = 0; i < HR_NUM_BLOCKS; i++) {
+		free (hr->meshes.blocks[i].data);
+		if (hr->meshes.blocks[i].ubo)
+			glDeleteBuffers (1, &hr->meshes.blocks[i].ubo);
+	}
+
+	destroy_program_cache (hr);
 	VK_ASSERT_NO_GL_ERROR ();
 
+	if (hr->meshes.vbo) {
+		glBindBuffer (GL_ARRAY_BUFFER, 0);
+		glDeleteBuffers (1, &hr->meshes.vbo);
+	}
+
 	if (hr->meshes.vao) {
 		glBindVertexArray (0);
 		glDeleteVertexArrays (1, &hr->meshes.vao);
 	}
 }
 
+static int
+build_uniform_block (hikaru_renderer_t *hr, unsigned block,
+                     size_t size, unsigned num, GLint align)
+{
+	/* Each entry must start at a multiple of the alignment for
+	 * glBindBufferRange. */
+	hr->meshes.blocks[block].stride = (size + align - 1) & ~(align - 1);
+	hr->meshes.blocks[block].data = (uint8_t *)
+		calloc (num, hr->meshes.blocks[block].stride);
+	if (!hr->meshes.blocks[block].data)
+		return -1;
+
+	glGenBuffers (1, &hr->meshes.blocks[block].ubo);
+	VK_ASSERT_NO_GL_ERROR ();
+	return 0;
+}
+
 static int
 build_3d_state (hikaru_renderer_t *hr)
 {
 	unsigned vpi, i;
+	GLint align;
 
 	hr->vp_list = (hikaru_viewport_t *)
 			malloc (sizeof (hikaru_viewport_t) * MAX_VIEWPORTS);
@@ -1556,6 +2072,43 @@ build_3d_state (hikaru_renderer_t *hr)
 		}
 	}
 
+	hr->meshes.max_vertices = MAX_VERTICES_PER_MESH * 4;
+	hr->meshes.vertices = (hikaru_vertex_body_t *)
+		malloc (sizeof (hikaru_vertex_body_t) * hr->meshes.max_vertices);
+	if (!hr->meshes.vertices)
+		return -1;
+
+	/* Create the VAO/VBO; the attribute layout never changes, so it is
+	 * set up only once. */
+	glGenVertexArrays (1, &hr->meshes.vao);
+	glBindVertexArray (hr->meshes.vao);
+	VK_ASSERT_NO_GL_ERROR ();
+
+	glGenBuffers (1, &hr->meshes.vbo);
+	glBindBuffer (GL_ARRAY_BUFFER, hr->meshes.vbo);
+	VK_ASSERT_NO_GL_ERROR ();
+
+	set_vertex_attribs (hr);
+
+	glBindVertexArray (0);
+	VK_ASSERT_NO_GL_ERROR ();
+
+	/* Create the uniform buffers. */
+	glGetIntegerv (GL_UNIFORM_BUFFER_OFFSET_ALIGNMENT, &align);
+	VK_ASSERT_NO_GL_ERROR ();
+	VK_ASSERT (align > 0 && !(align & (align - 1)));
+
+	if (build_uniform_block (hr, HR_BLOCK_VIEWPORT,
+	                         sizeof (hikaru_viewport_block_t),
+	                         MAX_VIEWPORTS, align) ||
+	    build_uniform_block (hr, HR_BLOCK_MODELVIEW,
+	                         sizeof (hikaru_modelview_block_t),
+	                         MAX_MODELVIEWS + 1, align) ||
+	    build_uniform_block (hr, HR_BLOCK_LIGHTSET,
+	                         sizeof (hikaru_lightset_block_t),
+	                         MAX_LIGHTSETS, align))
+		return -1;
+
 	return 0;
 }
 
@@ -1661,6 +2214,14 @@ build_2d_state (hikaru_renderer_t *hr)
 static void
 destroy_2d_state (hikaru_renderer_t *hr)
 {
+	unsigned i;
+
+	for (i = 0; i < 2; i++) {
+		glDeleteTextures (1, &hr->layers.tex[i].id);
+		hr->layers.tex[i].id = 0;
+		hr->layers.tex[i].valid = false;
+	}
+
 	glBindBuffer (GL_ARRAY_BUFFER, 0);
 	glDeleteBuffers (1, &hr->layers.vbo);
 
@@ -1670,77 +2231,142 @@ destroy_2d_state (hikaru_renderer_t *hr)
 	vk_renderer_destroy_program (hr->layers.program);
 }
 
-static void
-draw_layer (hikaru_renderer_t *hr, hikaru_layer_t *layer)
-{
-	mtx4x4f_t projection;
-	float mult;
-	void *data;
-	GLuint id;
-
-	LOG ("drawing LAYER %s", get_layer_str (layer));
-
-	vk_renderer_ortho (projection, 0.0f, 1.0f, 1.0f, 0.0f, -1.0f, 1.0f);
-
-	/* Setup the GLSL program. */
-	glUseProgram (hr->layers.program);
-	glUniformMatrix4fv (hr->layers.locs.u_projection, 1, GL_FALSE,
-	                    (const GLfloat *) projection);
-	glUniform1i (hr->layers.locs.u_texture, 0);
-
+#define FB_ROW_SIZE	4096
+#define LAYER_WIDTH	640
+#define LAYER_HEIGHT	480
 
-	/* Upload the layer data to a new texture. */
-	glGenTextures (1, &id);
-	VK_ASSERT_NO_GL_ERROR ();
+static bool
+is_layer_texture_valid (hikaru_renderer_t *hr, unsigned i, hikaru_layer_t *layer)
+{
+	hikaru_layer_t *cached = &hr->layers.tex[i].layer;
 
-	glActiveTexture (GL_TEXTURE0 + 0);
-	VK_ASSERT_NO_GL_ERROR ();
+	return hr->layers.tex[i].valid &&
+	       cached->x0 == layer->x0 &&
+	       cached->y0 == layer->y0 &&
+	       cached->format == layer->format;
+}
 
-	glBindTexture (GL_TEXTURE_2D, id);
-	VK_ASSERT_NO_GL_ERROR ();
+/* Upload rows [y, y + h) of the layer into its texture; the whole texture
+ * is (re)specified if full is set. */
 
-	glTexParameteri (GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
-	glTexParameteri (GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
-	VK_ASSERT_NO_GL_ERROR ();
-	glTexParameteri (GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
-	glTexParameteri (GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
-	VK_ASSERT_NO_GL_ERROR ();
-	glTexParameteri (GL_TEXTURE_2D, GL_TEXTURE_MAX_LEVEL, 0);
-	VK_ASSERT_NO_GL_ERROR ();
+static void
+upload_layer_rows (hikaru_renderer_t *hr, hikaru_layer_t *layer,
+                   unsigned y, unsigned h, bool full)
+{
+	void *data;
 
 	data = vk_buffer_get_ptr (hr->gpu->fb,
-	                          layer->y0 * 4096 + layer->x0 * 4);
+	                          (layer->y0 + y) * FB_ROW_SIZE + layer->x0 * 4);
 
-	glPixelStorei (GL_UNPACK_ALIGNMENT, 1);
 	switch (layer->format) {
 	case HIKARU_FORMAT_ABGR1555:
 		glPixelStorei (GL_UNPACK_ROW_LENGTH, 2048);
-
-		glTexImage2D (GL_TEXTURE_2D, 0,
-		              GL_RGB5_A1,
-		              640, 480, 0,
-		              GL_RGBA, GL_UNSIGNED_SHORT_1_5_5_5_REV,
-		              data);
-
-		mult = 1.0f;
+		if (full)
+			glTexImage2D (GL_TEXTURE_2D, 0,
+			              GL_RGB5_A1,
+			              LAYER_WIDTH, LAYER_HEIGHT, 0,
+			              GL_RGBA, GL_UNSIGNED_SHORT_1_5_5_5_REV,
+			              data);
+		else
+			glTexSubImage2D (GL_TEXTURE_2D, 0,
+			                 0, y, LAYER_WIDTH, h,
+			                 GL_RGBA, GL_UNSIGNED_SHORT_1_5_5_5_REV,
+			                 data);
 		break;
 	case HIKARU_FORMAT_A2BGR10:
 		glPixelStorei (GL_UNPACK_ROW_LENGTH, 1024);
-
-		glTexImage2D (GL_TEXTURE_2D, 0,
-		              GL_RGB10_A2,
-		              640, 480, 0,
-		              GL_RGBA, GL_UNSIGNED_INT_2_10_10_10_REV,
-		              data);
-
-		mult = 4.0f;
+		if (full)
+			glTexImage2D (GL_TEXTURE_2D, 0,
+			              GL_RGB10_A2,
+			              LAYER_WIDTH, LAYER_HEIGHT, 0,
+			              GL_RGBA, GL_UNSIGNED_INT_2_10_10_10_REV,
+			              data);
+		else
+			glTexSubImage2D (GL_TEXTURE_2D, 0,
+			                 0, y, LAYER_WIDTH, h,
+			                 GL_RGBA, GL_UNSIGNED_INT_2_10_10_10_REV,
+			                 data);
 		break;
 	default:
 		VK_ASSERT (0);
 	}
 	glPixelStorei (GL_UNPACK_ROW_LENGTH, 0);
 	VK_ASSERT_NO_GL_ERROR ();
+}
+
+static void
+update_layer_texture (hikaru_renderer_t *hr, unsigned i, hikaru_layer_t *layer)
+{
+	vk_buffer_t *fb = hr->gpu->fb;
+	uint32_t since = hr->layers.tex[i].gen;
+	unsigned y, h;
+
+	hr->layers.tex[i].gen = vk_buffer_watch (fb);
+
+	glActiveTexture (GL_TEXTURE0 + 0);
+	VK_ASSERT_NO_GL_ERROR ();
+
+	if (!hr->layers.tex[i].id) {
+		glGenTextures (1, &hr->layers.tex[i].id);
+		VK_ASSERT_NO_GL_ERROR ();
+
+		glBindTexture (GL_TEXTURE_2D, hr->layers.tex[i].id);
+		VK_ASSERT_NO_GL_ERROR ();
+
+		glTexParameteri (GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+		glTexParameteri (GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+		VK_ASSERT_NO_GL_ERROR ();
+		glTexParameteri (GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+		glTexParameteri (GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+		VK_ASSERT_NO_GL_ERROR ();
+		glTexParameteri (GL_TEXTURE_2D, GL_TEXTURE_MAX_LEVEL, 0);
+		VK_ASSERT_NO_GL_ERROR ();
+	} else
+		glBindTexture (GL_TEXTURE_2D, hr->layers.tex[i].id);
+
+	glPixelStorei (GL_UNPACK_ALIGNMENT, 1);
+
+	if (!is_layer_texture_valid (hr, i, layer)) {
+		upload_layer_rows (hr, layer, 0, LAYER_HEIGHT, true);
+		hr->layers.tex[i].layer = *layer;
+		hr->layers.tex[i].valid = true;
+		return;
+	}
+
+	/* Upload each run of consecutive dirty rows with a single call. */
+	for (y = 0; y < LAYER_HEIGHT; y += h) {
+		unsigned offs = (layer->y0 + y) * FB_ROW_SIZE + layer->x0 * 4;
+		if (!vk_buffer_is_dirty_since (fb, offs, since)) {
+			h = 1;
+			continue;
+		}
+		for (h = 1; y + h < LAYER_HEIGHT; h++)
+			if (!vk_buffer_is_dirty_since (fb, offs + h * FB_ROW_SIZE, since))
+				break;
+		upload_layer_rows (hr, layer, y, h, false);
+	}
+}
+
+static void
+draw_layer (hikaru_renderer_t *hr, unsigned i, hikaru_layer_t *layer)
+{
+	mtx4x4f_t projection;
+	float mult;
+
+	LOG ("drawing LAYER %s", get_layer_str (layer));
+
+	vk_renderer_ortho (projection, 0.0f, 1.0f, 1.0f, 0.0f, -1.0f, 1.0f);
+
+	/* Setup the GLSL program. */
+	glUseProgram (hr->layers.program);
+	glUniformMatrix4fv (hr->layers.locs.u_projection, 1, GL_FALSE,
+	                    (const GLfloat *) projection);
+	glUniform1i (hr->layers.locs.u_texture, 0);
+
+	/* Bring the layer texture up to date. */
+	update_layer_texture (hr, i, layer);
 
+	mult = (layer->format == HIKARU_FORMAT_A2BGR10) ? 4.0f : 1.0f;
 	glUniform1f (hr->layers.locs.u_texture_multiplier, mult);
 
 	/* Draw. */
@@ -1753,10 +2379,6 @@ draw_layer (hikaru_renderer_t *hr, hikaru_layer_t *layer)
 	glBindVertexArray (0);
 	glUseProgram (0);
 	VK_ASSERT_NO_GL_ERROR ();
-
-	/* Get rid of the layer texture. */
-	glDeleteTextures (1, &id);
-	VK_ASSERT_NO_GL_ERROR ();
 }
 
 static void
@@ -1764,31 +2386,33 @@ draw_layers (hikaru_renderer_t *hr)
 {
 	hikaru_gpu_t *gpu = hr->gpu;
 	hikaru_layer_t *layer;
+	unsigned i;
 
-	if (!LAYERS.enabled)
-		return;
-
-	glDisable (GL_DEPTH_TEST);
-	VK_ASSERT_NO_GL_ERROR ();
-
-	glEnable (GL_BLEND);
-	VK_ASSERT_NO_GL_ERROR ();
+	if (LAYERS.enabled) {
+		glDisable (GL_DEPTH_TEST);
+		VK_ASSERT_NO_GL_ERROR ();
 
-	glBlendFunc (GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA);
+		glEnable (GL_BLEND);
+		VK_ASSERT_NO_GL_ERROR ();
 
-	glDisable (GL_POLYGON_OFFSET_FILL);
+		glBlendFunc (GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA);
 
-	/* Only draw unit 0 for now. I think unit 1 is there only for
-	 * multi-monitor, which case we don't care about. */
-	layer = &LAYERS.layer[0][1];
-	if (layer->enabled && !hr->debug.flags[HR_DEBUG_NO_LAYER2])
-		draw_layer (hr, layer);
+		glDisable (GL_POLYGON_OFFSET_FILL);
 
-	layer = &LAYERS.layer[0][0];
-	if (layer->enabled && !hr->debug.flags[HR_DEBUG_NO_LAYER2])
-		draw_layer (hr, layer);
+		/* Only draw unit 0 for now. I think unit 1 is there only for
+		 * multi-monitor, which case we don't care about. */
+		for (i = 2; i-- > 0; ) {
+			layer = &LAYERS.layer[0][i];
+			if (layer->enabled && !hr->debug.flags[HR_DEBUG_NO_LAYER2])
+				draw_layer (hr, i, layer);
+		}
+	}
 }
 
+#undef FB_ROW_SIZE
+#undef LAYER_WIDTH
+#undef LAYER_HEIGHT
+
 /****************************************************************************
  Interface
 ****************************************************************************/
@@ -1799,7 +2423,7 @@ hikaru_renderer_begin_frame (vk_renderer_t *renderer)
 	hikaru_renderer_t *hr = (hikaru_renderer_t *) renderer;
 	unsigned vpi, i;
 
-	hr->meshes.variant.full = ~0;
+	hr->meshes.program = 0;
 
 	hr->num_vps = 0;
 	hr->num_mvs = 0;
@@ -1808,6 +2432,8 @@ hikaru_renderer_begin_frame (vk_renderer_t *renderer)
 	hr->num_texs = 0;
 	hr->num_lss = 0;
 
+	hr->meshes.num_vertices = 0;
+
 	for (vpi = 0; vpi < 8; vpi++)
 		for (i = 0; i < 8; i++)
 			hr->num_meshes[vpi][i] = 0;
@@ -1825,7 +2451,9 @@ hikaru_renderer_end_frame (vk_renderer_t *renderer)
 
 	VK_ASSERT_NO_GL_ERROR ();
 
+	vk_timer_begin (hr->draw_scene_timer);
 	draw_scene (hr);
+	vk_timer_end (hr->draw_scene_timer);
 	VK_ASSERT_NO_GL_ERROR ();
 
 	draw_layers (hr);
@@ -1842,6 +2470,11 @@ hikaru_renderer_end_frame (vk_renderer_t *renderer)
 static void
 hikaru_renderer_reset (vk_renderer_t *renderer)
 {
+	hikaru_renderer_t *hr = (hikaru_renderer_t *) renderer;
+
+	hr->layers.tex[0].valid = false;
+	hr->layers.tex[1].valid = false;
+
 	hikaru_renderer_invalidate_texcache (renderer, NULL);
 }
 
@@ -1851,6 +2484,9 @@ hikaru_renderer_destroy (vk_renderer_t **renderer_)
 	if (renderer_) {
 		hikaru_renderer_t *hr = (hikaru_renderer_t *) *renderer_;
 
+		if (!hr || vk_renderer_is_null (*renderer_))
+			return;
+
 		destroy_3d_state (hr);
 		destroy_2d_state (hr);
 
@@ -1880,17 +2516,26 @@ hikaru_renderer_new (vk_buffer_t *fb, vk_buffer_t *texram[2])
 	if (ret)
 		goto fail;
 
-	VK_ASSERT_NO_GL_ERROR ();
+	/* With the null backend there is no GL context: all hooks return
+	 * early, and frames are neither begun nor ended. */
+	if (vk_renderer_is_null (&hr->base)) {
+		hr->base.begin_frame = NULL;
+		hr->base.end_frame = NULL;
+		return (vk_renderer_t *) hr;
+	}
 
-	memset ((void *) program_cache, 0, sizeof (program_cache));
-	num_programs = 0;
+	VK_ASSERT_NO_GL_ERROR ();
 
 	init_debug_flags (hr);
 
+	hr->draw_scene_timer = vk_timer_get ("draw-scene");
+
 	if (build_3d_state (hr))
 		goto fail;
 	VK_ASSERT_NO_GL_ERROR ();
 
+	load_program_cache (hr);
+
 	if (build_2d_state (hr))
 		goto fail;
 	VK_ASSERT_NO_GL_ERROR ();
@@ -439,15 +439,21 @@ hikaru_run_cycles (vk_machine_t *mach, int cycles)
 	hikaru_t *hikaru = (hikaru_t *) mach;
 
 	/* Run the master */
+	vk_timer_begin (hikaru->timers.sh_m);
 	hikaru->sh_current = hikaru->sh_m;
 	vk_cpu_run (hikaru->sh_m, cycles);
+	vk_timer_end (hikaru->timers.sh_m);
 
 	/* Run the slave */
+	vk_timer_begin (hikaru->timers.sh_s);
 	hikaru->sh_current = hikaru->sh_s;
 	vk_cpu_run (hikaru->sh_s, cycles);
+	vk_timer_end (hikaru->timers.sh_s);
 
 	/* Run the MEMCTL and GPU */
+	vk_timer_begin (hikaru->timers.memctl);
 	vk_device_exec (hikaru->memctl_m, cycles);
+	vk_timer_end (hikaru->timers.memctl);
 	/* XXX run the slave MEMCTL? I've never seen it used, and would
 	 * like to debug it a bit before enabling it. */
 	vk_device_exec (hikaru->gpu, cycles);
@@ -786,7 +792,7 @@ hikaru_set_rombd_config (hikaru_t *hikaru)
 
 /* XXX actually make sh4_t opaque and add accessors for the registers; that's
  * going to be needed for any possible future debugger anyway. */
-#define R(n_)	ctx->regs.r[n_]
+#define R(n_)	ctx->bank.r[(n_) >> 3][(n_) & 7]
 #define PR	ctx->regs.pr
 #define T	ctx->regs.sr.bit.t
 
@@ -917,14 +923,20 @@ hikaru_init (hikaru_t *hikaru)
 	unk_m.mach = mach;
 	unk_s.mach = mach;
 
-	hikaru->ram_m		= vk_buffer_le32_new (32*MB, 0);
-	hikaru->ram_s		= vk_buffer_le32_new (32*MB, 0);
-	hikaru->cmdram		= vk_buffer_le32_new (4*MB, 0);
-	hikaru->fb		= vk_buffer_le32_new (8*MB, 0);
-	hikaru->texram[0]	= vk_buffer_le32_new (4*MB, 0);
-	hikaru->texram[1]	= vk_buffer_le32_new (4*MB, 0);
-	hikaru->aica_ram_m	= vk_buffer_le32_new (8*MB, 0);
-	hikaru->aica_ram_s	= vk_buffer_le32_new (8*MB, 0);
+	/* The large RAMs share one huge page backed arena */
+	mach->arena = vk_arena_new (32*MB + 32*MB + 4*MB + 8*MB + 4*MB + 4*MB +
+	                            8*MB + 8*MB);
+	if (!mach->arena)
+		return -1;
+
+	hikaru->ram_m		= vk_buffer_le32_new_from_arena (mach->arena, 32*MB);
+	hikaru->ram_s		= vk_buffer_le32_new_from_arena (mach->arena, 32*MB);
+	hikaru->cmdram		= vk_buffer_le32_new_from_arena (mach->arena, 4*MB);
+	hikaru->fb		= vk_buffer_le32_new_from_arena (mach->arena, 8*MB);
+	hikaru->texram[0]	= vk_buffer_le32_new_from_arena (mach->arena, 4*MB);
+	hikaru->texram[1]	= vk_buffer_le32_new_from_arena (mach->arena, 4*MB);
+	hikaru->aica_ram_m	= vk_buffer_le32_new_from_arena (mach->arena, 8*MB);
+	hikaru->aica_ram_s	= vk_buffer_le32_new_from_arena (mach->arena, 8*MB);
 	hikaru->mie_ram		= vk_buffer_le32_new (32*KB, 0);
 	hikaru->bram		= vk_buffer_le32_new (64*KB, 0);
 
@@ -935,6 +947,11 @@ hikaru_init (hikaru_t *hikaru)
 	    !hikaru->bram || !hikaru->mie_ram)
 		return -1;
 
+	/* Track FB writes per 4096-byte row, so that the renderer only
+	 * uploads the scanlines of the layers that actually changed. */
+	if (vk_buffer_track_dirty (hikaru->fb, 12))
+		return -1;
+
 	vk_machine_register_buffer (mach, (void *) hikaru->ram_m);
 	vk_machine_register_buffer (mach, (void *) hikaru->ram_s);
 	vk_machine_register_buffer (mach, (void *) hikaru->cmdram);
@@ -972,8 +989,14 @@ hikaru_init (hikaru_t *hikaru)
 	} else {
 		/* Create a mock bootrom */                                     
 		hikaru->bootrom = vk_buffer_le32_new (2*MB, 0);
+		if (!hikaru->bootrom)
+			return -1;
 	}
 
+	hikaru->timers.sh_m	= vk_timer_get ("master");
+	hikaru->timers.sh_s	= vk_timer_get ("slave");
+	hikaru->timers.memctl	= vk_timer_get ("memctl-dma");
+
 	hikaru->memctl_m = hikaru_memctl_new (mach, true);
 	hikaru->memctl_s = hikaru_memctl_new (mach, false);
 
@@ -22,6 +22,7 @@
 #include "vk/mmap.h"
 #include "vk/cpu.h"
 #include "vk/machine.h"
+#include "vk/timer.h"
 
 typedef struct {
 	bool has_rom;
@@ -88,6 +89,11 @@ typedef struct {
 	/* ROMBD configuration */
 	hikaru_rombd_config_t rombd_config;
 
+	/* Profiling */
+	struct {
+		vk_timer_t *sh_m, *sh_s, *memctl;
+	} timers;
+
 } hikaru_t;
 
 vk_machine_t	*hikaru_new (vk_game_t *game);
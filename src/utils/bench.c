@@ -0,0 +1,289 @@
+/* 
+ * Valkyrie
+ * Copyright (C) 2011, 2012, Stefano Teso
+ * 
+ * Valkyrie is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Valkyrie is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Valkyrie.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/* Headless benchmark: run a game for a fixed number of frames and report
+ * throughput and the wall time spent in each emulated component as JSON.
+ * Only the JSON goes to stdout; everything else is printed on stderr. */
+
+#include "vk/core.h"
+#include "vk/machine.h"
+#include "vk/cpu.h"
+#include "vk/games.h"
+#include "vk/renderer.h"
+#include "vk/timer.h"
+#include "vk/trace.h"
+
+#ifdef VK_HAVE_HIKARU
+#include "mach/hikaru/hikaru.h"
+#endif
+
+unsigned vk_verbosity = 0;
+
+static struct {
+	char rom_path[256];
+	char rom_name[256];
+	char state_path[256];
+	char output_path[256];
+	int num_frames;
+	vk_renderer_backend_t backend;
+} options;
+
+static const char bench_opts[] = "R:r:n:s:H:o:vh?";
+static const char bench_help[] = "Usage: %s [options]\n"
+"	-R <path>	Path to the ROM directory\n"
+"	-r <string>	Name of the game to run\n"
+"	-n <num>	Number of frames to run (default: 600)\n"
+"	-s <path>	Load this state before starting\n"
+"	-H <backend>	Renderer backend, 'null' (default) or 'offscreen'\n"
+"	-o <path>	Write the results here instead of stdout\n"
+"	-v		Set verbosity (affects debug messages)\n"
+"	-h              Show this help\n";
+
+static int
+parse_bench_opts (int argc, char **argv)
+{
+	int opt;
+
+	memset (&options, 0, sizeof (options));
+	options.num_frames = 600;
+	options.backend = VK_RENDERER_BACKEND_NULL;
+
+	while ((opt = getopt (argc, argv, bench_opts)) != -1) {
+		switch (opt) {
+		case 'R':
+			strncpy (options.rom_path, optarg, 255);
+			break;
+		case 'r':
+			strncpy (options.rom_name, optarg, 32);
+			break;
+		case 'n':
+			options.num_frames = atoi (optarg);
+			break;
+		case 's':
+			strncpy (options.state_path, optarg, 255);
+			break;
+		case 'H':
+			if (!strcmp (optarg, "null"))
+				options.backend = VK_RENDERER_BACKEND_NULL;
+			else if (!strcmp (optarg, "offscreen"))
+				options.backend = VK_RENDERER_BACKEND_OFFSCREEN;
+			else {
+				VK_ERROR ("unknown backend '%s'", optarg);
+				return -1;
+			}
+			break;
+		case 'o':
+			strncpy (options.output_path, optarg, 255);
+			break;
+		case 'v':
+			vk_verbosity = 1;
+			break;
+		default:
+			VK_ERROR ("unrecognized option '%c'", opt);
+			/* fall-through */
+		case 'h':
+		case '?':
+			fprintf (stdout, bench_help, argv[0]);
+			return -1;
+		}
+	}
+
+	if (!options.rom_name[0] || options.num_frames <= 0) {
+		fprintf (stdout, bench_help, argv[0]);
+		return -1;
+	}
+	return 0;
+}
+
+static vk_machine_t *
+get_machine_for_game (vk_game_t *game)
+{
+#ifdef VK_HAVE_HIKARU
+	if (!strcmp (game->mach, "hikaru"))
+		return hikaru_new (game);
+#endif
+	return NULL;
+}
+
+static void
+write_cpu (FILE *fp, const char *name, vk_cpu_t *cpu, uint64_t insns,
+           double seconds, bool last)
+{
+	insns = cpu->num_insns - insns;
+	fprintf (fp, "\t\t\"%s\": { \"insns\": %llu, \"mips\": %.3f }%s\n",
+	         name, (unsigned long long) insns,
+	         insns / seconds / 1e6, last ? "" : ",");
+}
+
+/* Hash of the full machine state after the run. Emulation is deterministic,
+ * so two runs from the same start must agree; comparing the hash across
+ * builds or interpreter modes (e.g. SH4_THREADED=0 and 1) cross-checks
+ * them. */
+
+static uint64_t
+get_state_hash (vk_machine_t *mach)
+{
+	uint64_t hash = 0xCBF29CE484222325ull;
+	vk_state_t *state;
+	size_t i;
+
+	state = vk_state_new_memory ();
+	if (!state)
+		return 0;
+
+	if (!vk_machine_save_to_state (mach, state))
+		for (i = 0; i < state->mem_size; i++) {
+			hash ^= state->mem[i];
+			hash *= 0x100000001B3ull;
+		}
+
+	vk_state_destroy (&state, 0);
+	return hash;
+}
+
+static void
+write_results (FILE *fp, vk_machine_t *mach, uint64_t insns[2], double seconds)
+{
+	vk_timer_t *timer;
+	unsigned i;
+
+	fprintf (fp, "{\n");
+	fprintf (fp, "\t\"game\": \"%s\",\n", mach->game->name);
+	fprintf (fp, "\t\"backend\": \"%s\",\n",
+	         options.backend == VK_RENDERER_BACKEND_NULL ? "null" : "offscreen");
+	fprintf (fp, "\t\"state\": \"%s\",\n", options.state_path);
+	fprintf (fp, "\t\"frames\": %d,\n", options.num_frames);
+	fprintf (fp, "\t\"seconds\": %.6f,\n", seconds);
+	fprintf (fp, "\t\"fps\": %.3f,\n", options.num_frames / seconds);
+	fprintf (fp, "\t\"state_hash\": \"%016llx\",\n",
+	         (unsigned long long) get_state_hash (mach));
+
+	fprintf (fp, "\t\"cpus\": {\n");
+#ifdef VK_HAVE_HIKARU
+	{
+		hikaru_t *hikaru = (hikaru_t *) mach;
+		write_cpu (fp, "master", hikaru->sh_m, insns[0], seconds, false);
+		write_cpu (fp, "slave", hikaru->sh_s, insns[1], seconds, true);
+	}
+#endif
+	fprintf (fp, "\t},\n");
+
+	fprintf (fp, "\t\"timers\": {\n");
+	for (i = 0; (timer = vk_timer_get_nth (i)) != NULL; i++) {
+		double t = timer->total * 1e-9;
+		fprintf (fp, "\t\t\"%s\": { \"seconds\": %.6f, \"share\": %.4f, \"calls\": %llu }%s\n",
+		         timer->name, t, t / seconds,
+		         (unsigned long long) timer->count,
+		         vk_timer_get_nth (i + 1) ? "," : "");
+	}
+	fprintf (fp, "\t}\n");
+	fprintf (fp, "}\n");
+}
+
+int
+main (int argc, char **argv)
+{
+	vk_game_list_t *game_list = NULL;
+	vk_game_t *game = NULL;
+	vk_machine_t *mach = NULL;
+	uint64_t start, insns[2] = { 0, 0 };
+	double seconds;
+	FILE *fp = NULL;
+	int frame, results_fd, ret = 1;
+
+	if (parse_bench_opts (argc, argv))
+		goto fail;
+
+	/* The emulator prints its progress messages to stdout; move them to
+	 * stderr, so that the results are all that's written to stdout. */
+	fflush (stdout);
+	results_fd = dup (STDOUT_FILENO);
+	if (results_fd < 0 || dup2 (STDERR_FILENO, STDOUT_FILENO) < 0) {
+		VK_ERROR ("failed to redirect stdout: %s", strerror (errno));
+		goto fail;
+	}
+
+	vk_renderer_set_default_backend (options.backend);
+	vk_trace_init ();
+
+	game_list = vk_game_list_new_default ();
+	if (!game_list) {
+		VK_ERROR ("failed to load the game list");
+		goto fail;
+	}
+
+	game = vk_game_new (game_list, options.rom_path, options.rom_name);
+	if (!game) {
+		VK_ERROR ("failed to load '%s': can't load game files", options.rom_name);
+		goto fail;
+	}
+
+	mach = get_machine_for_game (game);
+	if (!mach) {
+		VK_ERROR ("failed to load '%s': no machine for game", options.rom_name);
+		goto fail;
+	}
+
+	vk_machine_reset (mach, VK_RESET_TYPE_HARD);
+
+	if (options.state_path[0] &&
+	    vk_machine_load_state (mach, options.state_path)) {
+		VK_ERROR ("failed to load state '%s'", options.state_path);
+		goto fail;
+	}
+
+#ifdef VK_HAVE_HIKARU
+	insns[0] = ((hikaru_t *) mach)->sh_m->num_insns;
+	insns[1] = ((hikaru_t *) mach)->sh_s->num_insns;
+#endif
+
+	vk_timer_reset_all ();
+	vk_timer_set_enabled (true);
+
+	start = vk_util_get_ns ();
+	for (frame = 0; frame < options.num_frames; frame++) {
+		vk_renderer_begin_frame (mach->renderer);
+		vk_machine_run_frame (mach);
+		vk_renderer_end_frame (mach->renderer);
+	}
+	seconds = (vk_util_get_ns () - start) * 1e-9;
+
+	vk_timer_set_enabled (false);
+
+	if (options.output_path[0]) {
+		close (results_fd);
+		fp = fopen (options.output_path, "w");
+	} else
+		fp = fdopen (results_fd, "w");
+	if (!fp) {
+		VK_ERROR ("failed to open '%s'", options.output_path[0] ?
+		          options.output_path : "stdout");
+		goto fail;
+	}
+
+	write_results (fp, mach, insns, seconds);
+	ret = fclose (fp) ? 1 : 0;
+
+	if (vk_trace_enabled)
+		vk_trace_dump ("vkbench-trace");
+fail:
+	/* XXX free the game list and the game data, see main.c */
+	if (mach)
+		vk_machine_destroy (&mach);
+	return ret;
+}
@@ -23,8 +23,7 @@ int
 main (int argc, char **argv)
 {
 	vk_buffer_t *buf = NULL;
-	uint32_t *val32, i;
-	uint16_t *val16;
+	void *ptr;
 	int ret = 1;
 
 	if (argc < 4) {
@@ -38,16 +37,13 @@ main (int argc, char **argv)
 		goto fail;
 	}
 
+	ptr = vk_buffer_get_ptr (buf, 0);
 	switch (atoi (argv[1])) {
 	case 816:
-		val16 = (uint16_t *) vk_buffer_get_ptr (buf, 0);
-		for (i = 0; i < vk_buffer_get_size (buf); i += 2, val16++)
-			*val16 = bswap16 (*val16);
+		vk_bswap16_block (ptr, ptr, vk_buffer_get_size (buf));
 		break;
 	case 832:
-		val32 = (uint32_t *) vk_buffer_get_ptr (buf, 0);
-		for (i = 0; i < vk_buffer_get_size (buf); i += 4, val32++)
-			*val32 = bswap32 (*val32);
+		vk_bswap32_block (ptr, ptr, vk_buffer_get_size (buf));
 		break;
 	default:
 		fprintf (stderr, "ERROR: invalid mode '%s'\n", argv[1]);
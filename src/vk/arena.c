@@ -0,0 +1,135 @@
+/* 
+ * Valkyrie
+ * Copyright (C) 2011-2013, Stefano Teso
+ * 
+ * Valkyrie is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Valkyrie is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Valkyrie.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "vk/arena.h"
+
+#include <sys/mman.h>
+
+#define ARENA_HUGE_PAGE_SIZE	(2*MB)
+#define ARENA_PAGE_SIZE	4096
+
+#define ALIGN_UP(x_, a_) \
+	(((x_) + (a_) - 1) & ~((size_t) (a_) - 1))
+
+/* Tries explicit huge pages first (VK_HUGETLB, on by default); that fails
+ * unless a huge page pool has been reserved, in which case regular pages are
+ * mapped on a huge page boundary and transparent huge pages requested. */
+
+vk_arena_t *
+vk_arena_new (size_t size)
+{
+	vk_arena_t *arena;
+	uint8_t *ptr;
+	size_t head, tail;
+
+	arena = ALLOC (vk_arena_t);
+	if (!arena)
+		return NULL;
+
+	size = ALIGN_UP (size, ARENA_HUGE_PAGE_SIZE);
+
+#ifdef MAP_HUGETLB
+	if (vk_util_get_bool_option ("VK_HUGETLB", true)) {
+		ptr = mmap (NULL, size, PROT_READ | PROT_WRITE,
+		            MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB,
+		            -1, 0);
+		if (ptr != MAP_FAILED) {
+			arena->base = ptr;
+			arena->size = size;
+			arena->hugetlb = true;
+			return arena;
+		}
+	}
+#endif
+
+	ptr = mmap (NULL, size + ARENA_HUGE_PAGE_SIZE, PROT_READ | PROT_WRITE,
+	            MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+	if (ptr == MAP_FAILED) {
+		free (arena);
+		return NULL;
+	}
+
+	/* Trim the mapping to a huge page boundary */
+	head = ALIGN_UP ((uintptr_t) ptr, ARENA_HUGE_PAGE_SIZE) - (uintptr_t) ptr;
+	tail = ARENA_HUGE_PAGE_SIZE - head;
+	if (head)
+		munmap (ptr, head);
+	if (tail)
+		munmap (ptr + head + size, tail);
+
+	arena->base = ptr + head;
+	arena->size = size;
+
+#ifdef MADV_HUGEPAGE
+	if (madvise (arena->base, size, MADV_HUGEPAGE))
+		VK_LOG ("arena: MADV_HUGEPAGE failed: %s", strerror (errno));
+#endif
+	return arena;
+}
+
+void
+vk_arena_destroy (vk_arena_t **arena_)
+{
+	if (arena_) {
+		vk_arena_t *arena = *arena_;
+		if (arena)
+			munmap (arena->base, arena->size);
+		free (arena);
+		*arena_ = NULL;
+	}
+}
+
+/* Blocks of a huge page or more start on a huge page boundary; smaller ones
+ * on a page boundary, so that they can be cleared independently. */
+
+void *
+vk_arena_alloc (vk_arena_t *arena, size_t size)
+{
+	size_t align = (size >= ARENA_HUGE_PAGE_SIZE) ? ARENA_HUGE_PAGE_SIZE : ARENA_PAGE_SIZE;
+	size_t offs;
+
+	VK_ASSERT (arena);
+	VK_ASSERT (size > 0);
+
+	offs = ALIGN_UP (arena->used, align);
+	if (offs + size > arena->size)
+		return NULL;
+
+	arena->used = offs + ALIGN_UP (size, ARENA_PAGE_SIZE);
+	return arena->base + offs;
+}
+
+/* Zeroes a range by dropping its pages; they are faulted back in, zeroed,
+ * on first access. Falls back to memset () for partial pages and for
+ * hugetlb mappings on kernels that don't support it. */
+
+void
+vk_arena_clear (vk_arena_t *arena, void *ptr, size_t size)
+{
+	size_t page = arena->hugetlb ? ARENA_HUGE_PAGE_SIZE : ARENA_PAGE_SIZE;
+
+	VK_ASSERT (arena);
+	VK_ASSERT ((uint8_t *) ptr >= arena->base &&
+	           (uint8_t *) ptr + size <= arena->base + arena->size);
+
+	if (!((uintptr_t) ptr & (page - 1)) && !(size & (page - 1)) &&
+	    !madvise (ptr, size, MADV_DONTNEED))
+		return;
+
+	memset (ptr, 0, size);
+}
@@ -0,0 +1,40 @@
+/* 
+ * Valkyrie
+ * Copyright (C) 2011-2013, Stefano Teso
+ * 
+ * Valkyrie is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Valkyrie is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Valkyrie.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef __VK_ARENA_H__
+#define __VK_ARENA_H__
+
+#include "vk/core.h"
+
+/* A single anonymous mapping that backs several large machine buffers, so
+ * that guest RAM is laid out on as few (huge) host pages as possible. Memory
+ * is handed out in order and only given back when the arena is destroyed;
+ * clearing a range drops its pages, which read back as zero. */
+
+typedef struct {
+	uint8_t *base;
+	size_t size, used;
+	bool hugetlb;
+} vk_arena_t;
+
+vk_arena_t	*vk_arena_new (size_t size);
+void		 vk_arena_destroy (vk_arena_t **arena_);
+void		*vk_arena_alloc (vk_arena_t *arena, size_t size);
+void		 vk_arena_clear (vk_arena_t *arena, void *ptr, size_t size);
+
+#endif /* __VK_ARENA_H__ */
@@ -18,6 +18,10 @@
 
 #include "vk/buffer.h"
 
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+
 static unsigned
 get_file_size (FILE *fp)
 {
@@ -104,11 +108,18 @@ vk_buffer_be32_put (vk_buffer_t *buf, unsigned size, uint32_t offs, uint64_t val
 		*(uint32_t *) &(buf->ptr[offs]) = cpu_to_be32 ((uint32_t) val);
 		break;
 	default:
-		*(uint64_t *) &(buf->ptr[offs]) = cpu_to_be64 ((uint32_t) val);
+		*(uint64_t *) &(buf->ptr[offs]) = cpu_to_be64 (val);
 		break;
 	}
 }
 
+static void
+vk_buffer_tracked_put (vk_buffer_t *buf, unsigned size, uint32_t offs, uint64_t val)
+{
+	buf->untracked_put (buf, size, offs, val);
+	buf->dirty[offs >> buf->dirty_shift] = buf->dirty_gen;
+}
+
 #ifdef VK_LITTLE_ENDIAN
 #define vk_buffer_native_get vk_buffer_le32_get
 #define vk_buffer_native_put vk_buffer_le32_put
@@ -170,6 +181,36 @@ vk_buffer_be32_new (unsigned size, unsigned alignment)
 	return buf;
 }
 
+/* The memory comes from ARENA and is released along with it; clearing the
+ * buffer drops its pages instead of writing zeroes. */
+
+vk_buffer_t *
+vk_buffer_le32_new_from_arena (vk_arena_t *arena, unsigned size)
+{
+	vk_buffer_t *buf;
+	void *ptr;
+
+	VK_ASSERT (arena);
+
+	/* Arena memory cannot be given back: allocate the descriptor first */
+	buf = ALLOC (vk_buffer_t);
+	if (!buf)
+		return NULL;
+
+	ptr = vk_arena_alloc (arena, size);
+	if (!ptr) {
+		free (buf);
+		return NULL;
+	}
+
+	buf->ptr = (uint8_t *) ptr;
+	buf->size = size;
+	buf->arena = arena;
+	buf->get = vk_buffer_le32_get;
+	buf->put = vk_buffer_le32_put;
+	return buf;
+}
+
 vk_buffer_t *
 vk_buffer_new_from_file (const char *path, unsigned reqsize)
 {
@@ -198,6 +239,7 @@ vk_buffer_new_from_file (const char *path, unsigned reqsize)
 		goto fail;
 	}
 
+	fclose (fp);
 	return buffer;
 fail:
 	vk_buffer_destroy (&buffer);
@@ -206,18 +248,72 @@ fail:
 	return  NULL;
 }
 
+/* Maps the file privately instead of reading it: pages are only loaded when
+ * first accessed, and are shared with the page cache until written to. */
+
+vk_buffer_t *
+vk_buffer_new_from_file_mapped (const char *path, unsigned reqsize)
+{
+	vk_buffer_t *buffer = NULL;
+	struct stat st;
+	void *ptr;
+	int fd;
+
+	fd = open (path, O_RDONLY);
+	if (fd < 0)
+		return NULL;
+
+	if (fstat (fd, &st) || st.st_size == 0 ||
+	    (st.st_size != reqsize && reqsize != ~0))
+		goto fail;
+
+	ptr = mmap (NULL, st.st_size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+	if (ptr == MAP_FAILED)
+		goto fail;
+
+	buffer = ALLOC (vk_buffer_t);
+	if (!buffer) {
+		munmap (ptr, st.st_size);
+		goto fail;
+	}
+
+	buffer->ptr = (uint8_t *) ptr;
+	buffer->size = st.st_size;
+	buffer->mapped = true;
+	buffer->get = vk_buffer_native_get;
+	buffer->put = vk_buffer_native_put;
+
+fail:
+	close (fd);
+	return buffer;
+}
+
 void
 vk_buffer_destroy (vk_buffer_t **buf_)
 {
 	if (buf_) {
 		vk_buffer_t *buf = *buf_;
-		if (buf)
-			free (buf->ptr);
+		if (buf) {
+			if (buf->mapped)
+				munmap (buf->ptr, buf->size);
+			else if (!buf->arena)
+				free (buf->ptr);
+			free (buf->dirty);
+		}
 		free (buf);
 		*buf_ = NULL;
 	}
 }
 
+/* True if BUF has the layout the vk_buffer_*_le () accessors expect */
+
+bool
+vk_buffer_is_le32 (vk_buffer_t *buf)
+{
+	VK_ASSERT (buf);
+	return buf->get == vk_buffer_le32_get;
+}
+
 unsigned
 vk_buffer_get_size (vk_buffer_t *buf)
 {
@@ -237,9 +333,92 @@ vk_buffer_clear (vk_buffer_t *buf)
 {
 	VK_ASSERT (buf);
 	VK_ASSERT (buf->ptr);
-	memset (buf->ptr, 0, buf->size);
+	if (buf->arena)
+		vk_arena_clear (buf->arena, buf->ptr, buf->size);
+	else
+		memset (buf->ptr, 0, buf->size);
+	if (buf->dirty)
+		vk_buffer_mark_dirty (buf, 0, buf->size);
 }
 
+/* Start tracking writes to the buffer with a granularity of (1 << shift)
+ * bytes. Every page starts out dirty. Writes done through put (), the
+ * typed accessors, the block and copy functions and state loading are
+ * tracked; writes done through vk_buffer_get_ptr () must be reported with
+ * vk_buffer_mark_dirty (). */
+
+int
+vk_buffer_track_dirty (vk_buffer_t *buf, unsigned shift)
+{
+	unsigned num_pages;
+
+	VK_ASSERT (buf);
+	VK_ASSERT (!buf->dirty);
+
+	num_pages = (buf->size + (1 << shift) - 1) >> shift;
+
+	buf->dirty = (uint32_t *) malloc (num_pages * sizeof (uint32_t));
+	if (!buf->dirty)
+		return -1;
+
+	buf->dirty_shift = shift;
+	buf->dirty_gen = 1;
+	buf->untracked_put = buf->put;
+	buf->put = vk_buffer_tracked_put;
+
+	vk_buffer_mark_dirty (buf, 0, buf->size);
+	return 0;
+}
+
+void
+vk_buffer_mark_dirty (vk_buffer_t *buf, unsigned offs, unsigned len)
+{
+	unsigned i, last;
+
+	VK_ASSERT (buf);
+
+	if (!buf->dirty || !len)
+		return;
+
+	i = offs >> buf->dirty_shift;
+	last = (offs + len - 1) >> buf->dirty_shift;
+	for (; i <= last; i++)
+		buf->dirty[i] = buf->dirty_gen;
+}
+
+/* Returns a generation number for the caller to compare pages against
+ * later: writes from now on are newer than it. */
+
+uint32_t
+vk_buffer_watch (vk_buffer_t *buf)
+{
+	VK_ASSERT (buf);
+	VK_ASSERT (buf->dirty);
+
+	return buf->dirty_gen++;
+}
+
+bool
+vk_buffer_is_range_dirty_since (vk_buffer_t *buf, unsigned offs, unsigned len, uint32_t gen)
+{
+	unsigned i, last;
+
+	VK_ASSERT (buf);
+	VK_ASSERT (buf->dirty);
+
+	if (!len)
+		return false;
+
+	i = offs >> buf->dirty_shift;
+	last = (offs + len - 1) >> buf->dirty_shift;
+	for (; i <= last; i++)
+		if (buf->dirty[i] > gen)
+			return true;
+	return false;
+}
+
+/* Copies the first NBYTES of SRC to DST at OFFS. */
+
 int
 vk_buffer_copy (vk_buffer_t *dst, vk_buffer_t *src, unsigned offs, unsigned nbytes)
 {
@@ -247,19 +426,97 @@ vk_buffer_copy (vk_buffer_t *dst, vk_buffer_t *src, unsigned offs, unsigned nbyt
 	VK_ASSERT (src);
 	VK_ASSERT (nbytes > 0);
 
-	/* TODO see games.c */
-	return -1;
+	if (nbytes > src->size || offs + nbytes > dst->size)
+		return -1;
+
+	memcpy (&dst->ptr[offs], src->ptr, nbytes);
+	if (dst->dirty)
+		vk_buffer_mark_dirty (dst, offs, nbytes);
+	return 0;
 }
 
+/* Block accessors: DST/SRC hold 32-bit words in host order, as get () and
+ * put () would return and take them. When the buffer layout matches the
+ * host's they're a plain memcpy (); otherwise the words are byte-swapped
+ * in bulk. */
+
+void
+vk_buffer_read_block (vk_buffer_t *buf, unsigned offs, void *dst, unsigned nbytes)
+{
+	VK_ASSERT (buf);
+	VK_ASSERT (dst);
+	VK_ASSERT (!(offs & 3) && !(nbytes & 3));
+	VK_ASSERT (offs + nbytes <= buf->size);
+
+	if (buf->get == vk_buffer_native_get)
+		memcpy (dst, &buf->ptr[offs], nbytes);
+	else
+		vk_bswap32_block (dst, &buf->ptr[offs], nbytes);
+}
+
+void
+vk_buffer_write_block (vk_buffer_t *buf, unsigned offs, const void *src, unsigned nbytes)
+{
+	VK_ASSERT (buf);
+	VK_ASSERT (src);
+	VK_ASSERT (!(offs & 3) && !(nbytes & 3));
+	VK_ASSERT (offs + nbytes <= buf->size);
+
+	if (buf->get == vk_buffer_native_get)
+		memcpy (&buf->ptr[offs], src, nbytes);
+	else
+		vk_bswap32_block (&buf->ptr[offs], src, nbytes);
+
+	if (buf->dirty)
+		vk_buffer_mark_dirty (buf, offs, nbytes);
+}
+
+#define INTERLEAVE(type_) \
+	do { \
+		type_ *d = (type_ *) &dst->ptr[offs]; \
+		const type_ *s = (const type_ *) src->ptr; \
+		for (i = 0; i < n; i++) \
+			d[i * 2] = s[i]; \
+	} while (0)
+
+/* Copies all of SRC to DST as NBYTES-wide units, one every 2 * NBYTES bytes
+ * starting at OFFS; two calls with OFFS differing by NBYTES interleave a
+ * pair of ROM chips. */
+
 int
 vk_buffer_copy_interleave (vk_buffer_t *dst, vk_buffer_t *src, unsigned offs, unsigned nbytes)
 {
+	unsigned i, n;
+
 	VK_ASSERT (dst);
 	VK_ASSERT (src);
 	VK_ASSERT (nbytes > 0);
 
-	/* TODO see games.c */
-	return -1;
+	if (!is_size_valid (nbytes) || (src->size % nbytes) || (offs % nbytes))
+		return -1;
+
+	n = src->size / nbytes;
+	if (offs + (2 * n - 1) * nbytes > dst->size)
+		return -1;
+
+	switch (nbytes) {
+	case 1:
+		INTERLEAVE (uint8_t);
+		break;
+	case 2:
+		INTERLEAVE (uint16_t);
+		break;
+	case 4:
+		INTERLEAVE (uint32_t);
+		break;
+	default:
+		INTERLEAVE (uint64_t);
+		break;
+	}
+
+	if (dst->dirty)
+		vk_buffer_mark_dirty (dst, offs, (2 * n - 1) * nbytes);
+	return 0;
 }
 
 void
@@ -313,6 +570,7 @@ vk_buffer_load_state (vk_buffer_t *buffer, vk_state_t *state)
 	VK_ASSERT (buffer);
 	VK_ASSERT (state);
 
+	vk_buffer_mark_dirty (buffer, 0, buffer->size);
 	return vk_state_get (state, buffer->ptr, buffer->size);
 }
 
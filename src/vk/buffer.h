@@ -21,14 +21,27 @@
 
 #include "vk/core.h"
 #include "vk/state.h"
+#include "vk/arena.h"
 
 typedef struct vk_buffer_t vk_buffer_t;
 
 struct vk_buffer_t {
 	uint8_t *ptr;
 	unsigned size;
+	bool mapped;
+	/* Set if the memory belongs to an arena */
+	vk_arena_t *arena;
 	uint64_t (* get) (vk_buffer_t *buf, unsigned size, uint32_t addr);
 	void	 (* put) (vk_buffer_t *buf, unsigned size, uint32_t addr, uint64_t val);
+
+	/* Optional write tracking: one generation number per page of
+	 * (1 << dirty_shift) bytes, set to dirty_gen by every write. Each
+	 * watcher keeps the value vk_buffer_watch () returned to it, and asks
+	 * which pages have been written since. */
+	uint32_t *dirty;
+	unsigned dirty_shift;
+	uint32_t dirty_gen;
+	void	 (* untracked_put) (vk_buffer_t *buf, unsigned size, uint32_t addr, uint64_t val);
 };
 
 static inline bool
@@ -61,9 +74,12 @@ set_ptr (void *ptr, unsigned size, uint64_t val)
 
 vk_buffer_t	*vk_buffer_new (unsigned size, unsigned alignment);
 vk_buffer_t	*vk_buffer_new_from_file (const char *path, unsigned size);
+vk_buffer_t	*vk_buffer_new_from_file_mapped (const char *path, unsigned size);
 vk_buffer_t	*vk_buffer_le32_new (unsigned size, unsigned alignment);
 vk_buffer_t	*vk_buffer_be32_new (unsigned size, unsigned alignment);
+vk_buffer_t	*vk_buffer_le32_new_from_arena (vk_arena_t *arena, unsigned size);
 void		 vk_buffer_destroy (vk_buffer_t **buffer_);
+bool		 vk_buffer_is_le32 (vk_buffer_t *buf);
 unsigned	 vk_buffer_get_size (vk_buffer_t *buf);
 void		*vk_buffer_get_ptr (vk_buffer_t *buf, unsigned offs);
 void		 vk_buffer_clear (vk_buffer_t *buffer);
@@ -73,6 +89,14 @@ void		 vk_buffer_dump (vk_buffer_t *buffer, const char *path);
 void		 vk_buffer_dumpf (vk_buffer_t *buffer, const char *fmt, ...);
 int		 vk_buffer_load_state (vk_buffer_t *buffer, vk_state_t *state);
 int		 vk_buffer_save_state (vk_buffer_t *buffer, vk_state_t *state);
+int		 vk_buffer_copy (vk_buffer_t *dst, vk_buffer_t *src, unsigned offs, unsigned nbytes);
+int		 vk_buffer_copy_interleave (vk_buffer_t *dst, vk_buffer_t *src, unsigned offs, unsigned nbytes);
+void		 vk_buffer_read_block (vk_buffer_t *buf, unsigned offs, void *dst, unsigned nbytes);
+void		 vk_buffer_write_block (vk_buffer_t *buf, unsigned offs, const void *src, unsigned nbytes);
+int		 vk_buffer_track_dirty (vk_buffer_t *buf, unsigned shift);
+void		 vk_buffer_mark_dirty (vk_buffer_t *buf, unsigned offs, unsigned len);
+uint32_t	 vk_buffer_watch (vk_buffer_t *buf);
+bool		 vk_buffer_is_range_dirty_since (vk_buffer_t *buf, unsigned offs, unsigned len, uint32_t gen);
 
 static inline uint64_t
 vk_buffer_get (vk_buffer_t *buf, unsigned size, uint32_t addr)
@@ -88,4 +112,64 @@ vk_buffer_put (vk_buffer_t *buf, unsigned size, uint32_t addr, uint64_t val)
 	buf->put (buf, size, addr, val);
 }
 
+/* Statically typed accessors, for hot paths that know the size of the access
+ * and the layout of the buffer: vk_buffer_get32_le () and so on. They must
+ * only be used on buffers created with the matching layout; they honor
+ * write tracking like put () does. */
+
+static inline void
+vk_buffer_mark_dirty_one (vk_buffer_t *buf, uint32_t offs)
+{
+	if (buf->dirty)
+		buf->dirty[offs >> buf->dirty_shift] = buf->dirty_gen;
+}
+
+#define VK_BUFFER_DEFINE_ACCESSORS(bits_, endian_) \
+	static inline uint##bits_##_t \
+	vk_buffer_get##bits_##_##endian_ (vk_buffer_t *buf, uint32_t offs) \
+	{ \
+		VK_ASSERT ((offs + (bits_ / 8) - 1) < buf->size); \
+		return cpu_to_##endian_##bits_ (*(uint##bits_##_t *) &buf->ptr[offs]); \
+	} \
+	\
+	static inline void \
+	vk_buffer_put##bits_##_##endian_ (vk_buffer_t *buf, uint32_t offs, uint##bits_##_t val) \
+	{ \
+		VK_ASSERT ((offs + (bits_ / 8) - 1) < buf->size); \
+		*(uint##bits_##_t *) &buf->ptr[offs] = cpu_to_##endian_##bits_ (val); \
+		vk_buffer_mark_dirty_one (buf, offs); \
+	}
+
+VK_BUFFER_DEFINE_ACCESSORS (16, le)
+VK_BUFFER_DEFINE_ACCESSORS (32, le)
+VK_BUFFER_DEFINE_ACCESSORS (64, le)
+VK_BUFFER_DEFINE_ACCESSORS (16, be)
+VK_BUFFER_DEFINE_ACCESSORS (32, be)
+VK_BUFFER_DEFINE_ACCESSORS (64, be)
+
+static inline uint8_t
+vk_buffer_get8 (vk_buffer_t *buf, uint32_t offs)
+{
+	VK_ASSERT (offs < buf->size);
+	return buf->ptr[offs];
+}
+
+static inline void
+vk_buffer_put8 (vk_buffer_t *buf, uint32_t offs, uint8_t val)
+{
+	VK_ASSERT (offs < buf->size);
+	buf->ptr[offs] = val;
+	vk_buffer_mark_dirty_one (buf, offs);
+}
+
+/* True if the page containing OFFS was written after vk_buffer_watch ()
+ * returned GEN. A watcher that never called it can pass 0. */
+
+static inline bool
+vk_buffer_is_dirty_since (vk_buffer_t *buf, unsigned offs, uint32_t gen)
+{
+	VK_ASSERT (buf->dirty);
+	return buf->dirty[offs >> buf->dirty_shift] > gen;
+}
+
 #endif /* _VK_BUFFER_H__ */
@@ -16,9 +16,14 @@
  * along with Valkyrie.  If not, see <http://www.gnu.org/licenses/>.
  */
 
-#include "vk/types.h"
 #include "vk/core.h"
 
+#include <sys/stat.h>
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
 bool
 is_valid_mat4x3f (mtx4x3f_t m)
 {
@@ -67,3 +72,125 @@ vk_util_get_int_option (const char *name, int fallback)
 		return atoi (env);
 	return fallback;
 }
+
+/* Returns the user's home directory, from $HOME or the password database,
+ * or NULL if neither has it. */
+const char *
+vk_util_get_home_dir (void)
+{
+	const char *home = getenv ("HOME");
+	if (!home) {
+		struct passwd *pwd = getpwuid (getuid ());
+		if (pwd)
+			home = pwd->pw_dir;
+	}
+	return home;
+}
+
+/* Returns the path of the file NAME in the cache directory,
+ * ~/.local/share/valkyrie/cache, creating the directory if needed. The
+ * string must be freed by the caller. Returns NULL on failure. */
+char *
+vk_util_get_cache_path (const char *name)
+{
+	static const char *dirs[] = {
+		"/.local",
+		"/.local/share",
+		"/.local/share/valkyrie",
+		"/.local/share/valkyrie/cache",
+	};
+	const char *home;
+	char *path;
+	unsigned i;
+
+	home = vk_util_get_home_dir ();
+	if (!home)
+		return NULL;
+
+	for (i = 0; i < NUMELEM (dirs); i++) {
+		if (asprintf (&path, "%s%s", home, dirs[i]) < 0)
+			return NULL;
+		if (mkdir (path, 0755) && errno != EEXIST) {
+			VK_ERROR ("could not create '%s': %s", path, strerror (errno));
+			free (path);
+			return NULL;
+		}
+		free (path);
+	}
+
+	if (asprintf (&path, "%s%s/%s", home, dirs[i - 1], name) < 0)
+		return NULL;
+	return path;
+}
+
+/* Block byte swapping: 16 bytes at a time with SSE2 shuffles and shifts,
+ * with scalar code for the tail. DST may be the same as SRC. */
+
+#ifdef __SSE2__
+static inline __m128i
+swap_bytes_in_halves (__m128i x)
+{
+	return _mm_or_si128 (_mm_slli_epi16 (x, 8), _mm_srli_epi16 (x, 8));
+}
+
+static inline __m128i
+swap_halves_in_words (__m128i x)
+{
+	x = _mm_shufflelo_epi16 (x, _MM_SHUFFLE (2, 3, 0, 1));
+	return _mm_shufflehi_epi16 (x, _MM_SHUFFLE (2, 3, 0, 1));
+}
+#endif
+
+void
+vk_bswap16_block (void *dst, const void *src, unsigned nbytes)
+{
+	const uint16_t *s = (const uint16_t *) src;
+	uint16_t *d = (uint16_t *) dst;
+	unsigned i = 0, n = nbytes / 2;
+
+#ifdef __SSE2__
+	for (; i + 8 <= n; i += 8) {
+		__m128i x = _mm_loadu_si128 ((const __m128i *) &s[i]);
+		_mm_storeu_si128 ((__m128i *) &d[i], swap_bytes_in_halves (x));
+	}
+#endif
+	for (; i < n; i++)
+		d[i] = bswap16 (s[i]);
+}
+
+void
+vk_bswap32_block (void *dst, const void *src, unsigned nbytes)
+{
+	const uint32_t *s = (const uint32_t *) src;
+	uint32_t *d = (uint32_t *) dst;
+	unsigned i = 0, n = nbytes / 4;
+
+#ifdef __SSE2__
+	for (; i + 4 <= n; i += 4) {
+		__m128i x = _mm_loadu_si128 ((const __m128i *) &s[i]);
+		x = swap_bytes_in_halves (swap_halves_in_words (x));
+		_mm_storeu_si128 ((__m128i *) &d[i], x);
+	}
+#endif
+	for (; i < n; i++)
+		d[i] = bswap32 (s[i]);
+}
+
+/* Swaps the 16-bit halves of each 32-bit word */
+
+void
+vk_hswap32_block (void *dst, const void *src, unsigned nbytes)
+{
+	const uint32_t *s = (const uint32_t *) src;
+	uint32_t *d = (uint32_t *) dst;
+	unsigned i = 0, n = nbytes / 4;
+
+#ifdef __SSE2__
+	for (; i + 4 <= n; i += 4) {
+		__m128i x = _mm_loadu_si128 ((const __m128i *) &s[i]);
+		_mm_storeu_si128 ((__m128i *) &d[i], swap_halves_in_words (x));
+	}
+#endif
+	for (; i < n; i++)
+		d[i] = (s[i] << 16) | (s[i] >> 16);
+}
@@ -37,6 +37,7 @@
 #include <unistd.h>
 #include <sys/types.h>
 #include <pwd.h>
+#include <time.h>
 
 #include <GL/glew.h>
 #include <SDL.h>
@@ -104,6 +105,16 @@ is_pow2 (unsigned n)
 	return !(n & (n - 1));
 }
 
+/* Monotonic wall-clock time in nanoseconds. */
+
+static inline uint64_t
+vk_util_get_ns (void)
+{
+	struct timespec ts;
+	clock_gettime (CLOCK_MONOTONIC, &ts);
+	return (uint64_t) ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
 /* The following should automatically be detected as byte-swap operations by
  * the compiler and transformed into the corresponding CPU operation. No need
  * for hand-made assembly. */
@@ -312,6 +323,12 @@ bool	is_valid_mat4x4f (mtx4x4f_t mtx);
 
 bool	vk_util_get_bool_option (const char *name, bool fallback);
 int	vk_util_get_int_option (const char *name, int fallback);
+const char	*vk_util_get_home_dir (void);
+char	*vk_util_get_cache_path (const char *name);
+
+void	vk_bswap16_block (void *dst, const void *src, unsigned nbytes);
+void	vk_bswap32_block (void *dst, const void *src, unsigned nbytes);
+void	vk_hswap32_block (void *dst, const void *src, unsigned nbytes);
 
 #endif /* __VK_CORE_H__ */
 
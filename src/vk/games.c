@@ -20,6 +20,9 @@
 #include "vk/games.h"
 #include "vk/buffer.h"
 
+#include <sys/stat.h>
+#include <dirent.h>
+
 static const unsigned current_version = 1;
 
 enum {
@@ -52,7 +55,7 @@ load_datum (json_t *datum, const char *path, const char *game_name)
 
 	printf ("Loading %u bytes from '%s'", datum_size, full_path);
 
-	buffer = vk_buffer_new_from_file (full_path, datum_size);
+	buffer = vk_buffer_new_from_file_mapped (full_path, datum_size);
 
 	return buffer;
 }
@@ -86,6 +89,148 @@ get_section_size (json_t *data, unsigned ndata, unsigned mode)
 	return total_bytes;
 }
 
+/* Interleaved and concatenated sections are cached on disk once built, so
+ * that later runs can map them directly. The cache file name hashes the
+ * section layout together with the absolute path, size and mtime of every
+ * source file; changing any of them yields a different name, and a fresh
+ * build. Only the newest image of each game section is kept: writing one
+ * removes the others, so switching between two ROM directories for the
+ * same game rebuilds it each time. */
+
+#define SECTION_CACHE_VERSION	1
+#define SECTION_CACHE_PREFIX	"rom-%s-%s-"
+
+static uint64_t
+hash_bytes (uint64_t hash, const void *data, size_t size)
+{
+	const uint8_t *bytes = (const uint8_t *) data;
+	size_t i;
+
+	for (i = 0; i < size; i++) {
+		hash ^= bytes[i];
+		hash *= 0x100000001B3ull;
+	}
+	return hash;
+}
+
+static int
+get_section_cache_path (char *out, size_t out_size, json_t *root,
+                        unsigned mode, const char *path,
+                        const char *game_name, const char *section_name)
+{
+	json_t *data = json_object_get (root, "data");
+	uint64_t hash = 0xCBF29CE484222325ull;
+	unsigned version = SECTION_CACHE_VERSION;
+	json_int_t amnt = json_integer_value (json_object_get (root, "amnt"));
+	char name[128], *cache_path;
+	unsigned i;
+	int ret;
+
+	hash = hash_bytes (hash, &version, sizeof (version));
+	hash = hash_bytes (hash, &mode, sizeof (mode));
+	hash = hash_bytes (hash, &amnt, sizeof (amnt));
+
+	for (i = 0; i < json_array_size (data); i++) {
+		json_t *datum = json_array_get (data, i);
+		const char *datum_name = json_string_value (json_object_get (datum, "name"));
+		char full_path[256], *real_path;
+		struct stat st;
+		uint64_t tag[3];
+
+		if (!datum_name)
+			return -1;
+		snprintf (full_path, sizeof (full_path), "%s/%s/%s",
+		          path, game_name, datum_name);
+		if (stat (full_path, &st))
+			return -1;
+		real_path = realpath (full_path, NULL);
+		if (!real_path)
+			return -1;
+
+		tag[0] = st.st_size;
+		tag[1] = st.st_mtim.tv_sec;
+		tag[2] = st.st_mtim.tv_nsec;
+		hash = hash_bytes (hash, real_path, strlen (real_path));
+		hash = hash_bytes (hash, tag, sizeof (tag));
+		free (real_path);
+	}
+
+	snprintf (name, sizeof (name), SECTION_CACHE_PREFIX "%016llx.bin",
+	          game_name, section_name, (unsigned long long) hash);
+	cache_path = vk_util_get_cache_path (name);
+	if (!cache_path)
+		return -1;
+
+	ret = (snprintf (out, out_size, "%s", cache_path) < out_size) ? 0 : -1;
+	free (cache_path);
+	return ret;
+}
+
+/* Removes the images of the same game section other than CACHE_PATH. */
+
+static void
+prune_section_cache (const char *cache_path, const char *game_name,
+                     const char *section_name)
+{
+	char prefix[128], dir_path[512], stale_path[512], *slash;
+	const char *name = strrchr (cache_path, '/') + 1;
+	size_t prefix_len;
+	struct dirent *entry;
+	DIR *dir;
+
+	snprintf (prefix, sizeof (prefix), SECTION_CACHE_PREFIX,
+	          game_name, section_name);
+	prefix_len = strlen (prefix);
+
+	snprintf (dir_path, sizeof (dir_path), "%s", cache_path);
+	slash = strrchr (dir_path, '/');
+	*slash = '\0';
+
+	dir = opendir (dir_path);
+	if (!dir)
+		return;
+	while ((entry = readdir (dir)) != NULL) {
+		/* Match "<prefix><16 hex digits>.bin" exactly, so that
+		 * temporaries and other sections are left alone. */
+		if (strlen (entry->d_name) != prefix_len + 16 + 4 ||
+		    strncmp (entry->d_name, prefix, prefix_len) ||
+		    strcmp (entry->d_name + prefix_len + 16, ".bin") ||
+		    !strcmp (entry->d_name, name))
+			continue;
+		snprintf (stale_path, sizeof (stale_path), "%s/%s",
+		          dir_path, entry->d_name);
+		VK_LOG ("removing stale ROM cache '%s'", stale_path);
+		unlink (stale_path);
+	}
+	closedir (dir);
+}
+
+static void
+write_section_cache (vk_buffer_t *buffer, const char *cache_path,
+                     const char *game_name, const char *section_name)
+{
+	char tmp_path[512];
+	size_t size = vk_buffer_get_size (buffer);
+	FILE *fp;
+	bool ok;
+
+	/* Write aside and rename, so that a concurrent or interrupted run
+	 * never maps a partial image. */
+	snprintf (tmp_path, sizeof (tmp_path), "%s.%u.tmp",
+	          cache_path, (unsigned) getpid ());
+	fp = fopen (tmp_path, "wb");
+	if (!fp)
+		return;
+	ok = fwrite (vk_buffer_get_ptr (buffer, 0), 1, size, fp) == size;
+	ok = !fclose (fp) && ok;
+
+	if (!ok || rename (tmp_path, cache_path)) {
+		VK_ERROR ("could not write ROM cache '%s'", cache_path);
+		unlink (tmp_path);
+	} else
+		prune_section_cache (cache_path, game_name, section_name);
+}
+
 static int
 load_section (json_t *root, vk_game_section_t *section, const char *path, const char *game_name)
 {
@@ -93,6 +238,7 @@ load_section (json_t *root, vk_game_section_t *section, const char *path, const
 	const char *name_value, *type_value;
 	unsigned mode, ndata, i;
 	uint32_t total_size, base;
+	char cache_path[512] = "";
 
 	name = json_object_get (root, "name");
 	type = json_object_get (root, "type");
@@ -126,6 +272,21 @@ load_section (json_t *root, vk_game_section_t *section, const char *path, const
 
 	strcpy (section->name, name_value);
 
+	if (mode != MODE_ALTERNATIVE && ndata > 1 &&
+	    vk_util_get_bool_option ("VK_ROM_CACHE", true)) {
+		if (get_section_cache_path (cache_path, sizeof (cache_path), root,
+		                            mode, path, game_name, name_value))
+			cache_path[0] = '\0';
+		else {
+			section->buffer =
+				vk_buffer_new_from_file_mapped (cache_path, total_size);
+			if (section->buffer) {
+				printf ("Loaded section %s from '%s'", name_value, cache_path);
+				return 0;
+			}
+		}
+	}
+
 	switch (mode) {
 	case MODE_ALTERNATIVE:
 		section->buffer = NULL;
@@ -138,35 +299,45 @@ load_section (json_t *root, vk_game_section_t *section, const char *path, const
 		if (!section->buffer)
 			return -1;
 		break;
-	case MODE_INTERLEAVE:
-		/* XXX wrong, we need to interleave 2 by 2 for hikaru eproms,
-		 * see braveff */
+	case MODE_INTERLEAVE: {
+		/* Chips are interleaved in pairs, AMNT bytes at a time; see
+		 * vk_buffer_copy_interleave (). */
+		json_t *amnt = json_object_get (root, "amnt");
+		unsigned nbytes = json_integer_value (amnt);
+		if (!amnt)
+			return -1;
+		if (nbytes != 1 && nbytes != 2 && nbytes != 4 && nbytes != 8)
+			return -1;
 		section->buffer = vk_buffer_new (total_size, 0);
 		if (!section->buffer)
 			return -1;
 		base = 0;
 		for (i = 0; i < ndata; i++) {
 			json_t *datum = json_array_get (data, i);
-			json_t *amnt = json_object_get (root, "amnt");
-			unsigned nbytes = json_integer_value (amnt), j;
-			if (!amnt)
-				return -1;
-			if (nbytes != 1 && nbytes != 2 && nbytes != 4 && nbytes != 8)
-				return -1;
 			vk_buffer_t *buf = load_datum (datum, path, game_name);
+			int ret;
 			if (!buf)
 				return -1;
-			for (j = 0; j < vk_buffer_get_size (buf); j += nbytes) {
-				unsigned k = base + ((i & 1) + j) * nbytes;
-				uint64_t bytes = vk_buffer_get (buf, nbytes, j);
-				vk_buffer_put (section->buffer, nbytes, k, bytes);
-			}
+			ret = vk_buffer_copy_interleave (section->buffer, buf,
+			                                 base + (i & 1) * nbytes,
+			                                 nbytes);
 			if (i & 1)
 				base += vk_buffer_get_size (buf) * 2;
 			vk_buffer_destroy (&buf);
+			if (ret)
+				return -1;
 		}
 		break;
+	}
 	case MODE_CONCATENATE:
+		/* A single file needs no copy: use the mapping directly. */
+		if (ndata == 1) {
+			section->buffer = load_datum (json_array_get (data, 0),
+			                              path, game_name);
+			if (!section->buffer)
+				return -1;
+			break;
+		}
 		section->buffer = vk_buffer_new (total_size, 0);
 		if (!section->buffer)
 			return -1;
@@ -174,18 +345,22 @@ load_section (json_t *root, vk_game_section_t *section, const char *path, const
 		for (i = 0; i < ndata; i++) {
 			json_t *datum = json_array_get (data, i);
 			vk_buffer_t *buffer = load_datum (datum, path, game_name);
-			unsigned j;
+			unsigned size = vk_buffer_get_size (buffer);
+			int ret;
 			if (!buffer)
 				return -1;
-			for (j = 0; j < vk_buffer_get_size (buffer); j += 1) {
-				uint8_t byte = vk_buffer_get (buffer, 1, j);
-				vk_buffer_put (section->buffer, 1, j+base, byte);
-			}
-			base += vk_buffer_get_size (buffer);
+			ret = vk_buffer_copy (section->buffer, buffer, base, size);
+			base += size;
 			vk_buffer_destroy (&buffer);
+			if (ret)
+				return -1;
 		}
 		break;
 	}
+
+	if (cache_path[0])
+		write_section_cache (section->buffer, cache_path,
+		                     game_name, name_value);
 	return 0;
 }
 
@@ -353,6 +528,42 @@ fail:
 	return NULL;
 }
 
+/* Load the game list from the first of the default locations that
+ * holds one. */
+
+vk_game_list_t *
+vk_game_list_new_default (void)
+{
+	vk_game_list_t *list = NULL;
+	const char *home;
+	char *paths[3];
+	int i, ret[3];
+
+	home = vk_util_get_home_dir ();
+
+	paths[0] = strdup ("./vk-games.json");
+	ret[0] = paths[0] ? 0 : -1;
+	ret[1] = ret[2] = -1;
+	if (home) {
+		ret[1] = asprintf (&paths[1], "%s/vk-games.json", home);
+		ret[2] = asprintf (&paths[2], "%s/.local/share/valkyrie/vk-games.json", home);
+	}
+
+	for (i = 0; i < 3 && !list; i++) {
+		if (ret[i] < 0)
+			continue;
+		list = vk_game_list_new (paths[i]);
+		if (list)
+			printf ("loading game list from '%s'", paths[i]);
+	}
+
+	for (i = 0; i < 3; i++)
+		if (ret[i] >= 0)
+			free (paths[i]);
+
+	return list;
+}
+
 void
 vk_game_list_destroy (vk_game_list_t **game_list_)
 {
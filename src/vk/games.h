@@ -49,6 +49,7 @@ void		 vk_game_destroy (vk_game_t **game_);
 vk_buffer_t	*vk_game_get_section_data (vk_game_t *game, const char *name);
 
 vk_game_list_t	*vk_game_list_new (const char *path);
+vk_game_list_t	*vk_game_list_new_default (void);
 void		 vk_game_list_destroy (vk_game_list_t **game_list_);
 
 #endif /* __VK_GAMES_H __ */
@@ -29,6 +29,7 @@ vk_machine_destroy (vk_machine_t **mach_)
 		vk_machine_t *mach = *mach_;
 		unsigned i;
 
+		vk_state_writer_destroy (&mach->writer);
 		vk_renderer_destroy (&mach->renderer);
 		mach->destroy (mach_);
 
@@ -37,6 +38,8 @@ vk_machine_destroy (vk_machine_t **mach_)
 			vk_buffer_destroy (&buf);
 		}
 		vk_vector_destroy (&mach->buffers);
+		/* After the buffers carved out of it */
+		vk_arena_destroy (&mach->arena);
 
 		VK_VECTOR_FOREACH (mach->devices, i) {
 			vk_device_t *dev = *(vk_device_t **) &mach->devices->data[i];
@@ -130,26 +133,11 @@ vk_machine_run_frame (vk_machine_t *mach)
 }
 
 static int
-load_save_state (vk_machine_t *mach, const char *path, uint32_t mode)
+serialize (vk_machine_t *mach, vk_state_t *state, uint32_t mode)
 {
-	vk_state_t *state;
-	char *op;
+	char *op = (mode == VK_STATE_LOAD) ? "load" : "save";
 	unsigned i;
-	int ret = 0;
-
-	VK_ASSERT (mach);
-
-	op = (mode == VK_STATE_LOAD) ? "load" : "save";
-
-	state = vk_state_new (path, mode);
-	if (!state) {
-		VK_ERROR ("%s state doneed: cannot create state object", op);
-		ret = -1;
-		goto done;
-	}
-
-	if (mode == VK_STATE_LOAD)
-		vk_machine_reset (mach, VK_RESET_TYPE_HARD);
+	int ret;
 
 	VK_VECTOR_FOREACH (mach->buffers, i) {
 		vk_buffer_t *buf = *(vk_buffer_t **) &mach->buffers->data[i];
@@ -158,7 +146,7 @@ load_save_state (vk_machine_t *mach, const char *path, uint32_t mode)
 		      vk_buffer_save_state (buf, state);
 		if (ret) {
 			VK_ERROR ("%s state doneed: cannot %s buffer", op, op);
-			goto done;
+			return ret;
 		}
 	}
 
@@ -169,18 +157,46 @@ load_save_state (vk_machine_t *mach, const char *path, uint32_t mode)
 		      vk_device_save_state (dev, state);
 		if (ret) {
 			VK_ERROR ("%s state doneed: cannot %s device", op, op);
-			goto done;
+			return ret;
 		}
 	}
 
 	ret = (mode == VK_STATE_LOAD) ? mach->load_state (mach, state) :
 	                                mach->save_state (mach, state);
-	if (ret) {
+	if (ret)
 		VK_ERROR ("%s state doneed; cannot %s machine", op, op);
-		goto done;
+	return ret;
+}
+
+static int
+load_save_state (vk_machine_t *mach, const char *path, const char *base_path,
+                 uint32_t mode)
+{
+	vk_state_t *state;
+	char *op;
+	int ret = 0;
+
+	VK_ASSERT (mach);
+
+	op = (mode == VK_STATE_LOAD) ? "load" : "save";
+
+	state = base_path ? vk_state_new_with_base (path, base_path) :
+	                    vk_state_new (path, mode);
+	if (!state) {
+		VK_ERROR ("%s state doneed: cannot create state object", op);
+		return -1;
+	}
+
+	if (mode == VK_STATE_LOAD)
+		vk_machine_reset (mach, VK_RESET_TYPE_HARD);
+
+	ret = serialize (mach, state, mode);
+	if (!ret) {
+		ret = vk_state_finish (state);
+		if (ret)
+			VK_ERROR ("%s state failed: cannot flush state", op);
 	}
 
-done:
 	vk_state_destroy (&state, ret);
 	if (ret && mode == VK_STATE_LOAD) {
 		VK_ERROR ("load state doneed: resetting machine");
@@ -192,13 +208,86 @@ done:
 int
 vk_machine_load_state (vk_machine_t *mach, const char *path)
 {
-	return load_save_state (mach, path, VK_STATE_LOAD);
+	return load_save_state (mach, path, NULL, VK_STATE_LOAD);
 }
 
 int
 vk_machine_save_state (vk_machine_t *mach, const char *path)
 {
-	return load_save_state (mach, path, VK_STATE_SAVE);
+	return load_save_state (mach, path, NULL, VK_STATE_SAVE);
+}
+
+/* Saves only the pages that differ from those in the state at BASE_PATH;
+ * the others are stored as references, so BASE_PATH must be kept around. */
+
+int
+vk_machine_save_state_with_base (vk_machine_t *mach, const char *path,
+                                 const char *base_path)
+{
+	return load_save_state (mach, path, base_path, VK_STATE_SAVE);
+}
+
+/* Serialize the machine to/from an already open state, e.g. a memory-backed
+ * one. Loading resets the machine first, as vk_machine_load_state () does. */
+
+int
+vk_machine_save_to_state (vk_machine_t *mach, vk_state_t *state)
+{
+	return serialize (mach, state, VK_STATE_SAVE);
+}
+
+int
+vk_machine_load_from_state (vk_machine_t *mach, vk_state_t *state)
+{
+	int ret;
+
+	vk_machine_reset (mach, VK_RESET_TYPE_HARD);
+	ret = serialize (mach, state, VK_STATE_LOAD);
+	if (ret) {
+		VK_ERROR ("load state doneed: resetting machine");
+		vk_machine_reset (mach, VK_RESET_TYPE_HARD);
+	}
+	return ret;
+}
+
+/* Snapshots the machine into memory and writes the state to PATH on a
+ * background thread; BASE_PATH may be NULL. Use vk_machine_poll_save_state ()
+ * to collect the result. */
+
+int
+vk_machine_save_state_async (vk_machine_t *mach, const char *path,
+                             const char *base_path)
+{
+	vk_state_t *snapshot;
+	int ret;
+
+	VK_ASSERT (mach);
+
+	if (!mach->writer) {
+		mach->writer = vk_state_writer_new ();
+		if (!mach->writer)
+			return -1;
+	}
+
+	snapshot = vk_state_writer_get_snapshot (mach->writer);
+	if (!snapshot) {
+		VK_ERROR ("save state failed: previous save still in progress");
+		return -1;
+	}
+
+	ret = serialize (mach, snapshot, VK_STATE_SAVE);
+	if (ret)
+		return ret;
+
+	return vk_state_writer_start (mach->writer, path, base_path);
+}
+
+bool
+vk_machine_poll_save_state (vk_machine_t *mach, bool wait, int *ret)
+{
+	if (!mach->writer)
+		return false;
+	return vk_state_writer_poll (mach->writer, wait, ret);
 }
 
 const char *
@@ -24,6 +24,7 @@
 #include "vk/games.h"
 #include "vk/renderer.h"
 #include "vk/state.h"
+#include "vk/arena.h"
 
 typedef enum {
 	VK_RESET_TYPE_HARD,
@@ -41,9 +42,12 @@ struct vk_machine_t {
 	vk_renderer_t	*renderer;
 
 	vk_vector_t	*buffers;
+	vk_arena_t	*arena;
 	vk_vector_t	*devices;
 	vk_vector_t	*cpus;
 
+	vk_state_writer_t *writer;
+
 	void		 (* destroy)(vk_machine_t **mach_);
 	int		 (* load_game) (vk_machine_t *mach, vk_game_t *game);
 	void		 (* reset) (vk_machine_t *mach, vk_reset_type_t type);
@@ -83,6 +87,13 @@ void		 vk_machine_reset (vk_machine_t *mach, vk_reset_type_t type);
 int		 vk_machine_run_frame (vk_machine_t *mach);
 int		 vk_machine_load_state (vk_machine_t *mach, const char *path);
 int		 vk_machine_save_state (vk_machine_t *mach, const char *path);
+int		 vk_machine_save_state_with_base (vk_machine_t *mach, const char *path,
+		                                  const char *base_path);
+int		 vk_machine_save_to_state (vk_machine_t *mach, vk_state_t *state);
+int		 vk_machine_load_from_state (vk_machine_t *mach, vk_state_t *state);
+int		 vk_machine_save_state_async (vk_machine_t *mach, const char *path,
+		                              const char *base_path);
+bool		 vk_machine_poll_save_state (vk_machine_t *mach, bool wait, int *ret);
 const char	*vk_machine_get_debug_string (vk_machine_t *mach);
 
 #endif /* __VK_MACH_H__ */
@@ -23,6 +23,8 @@
 #include "vk/input.h"
 #include "vk/renderer.h"
 #include "vk/games.h"
+#include "vk/trace.h"
+#include "vk/rewind.h"
 
 #ifdef VK_HAVE_HIKARU
 #include "mach/hikaru/hikaru.h"
@@ -38,11 +40,29 @@ static struct {
 	char rom_name[256];
 	int num_frames;
 	int start_state;
+	char base_state_path[256];
+	int rewind_frames;
+	vk_renderer_backend_t backend;
 } options;
 
 static vk_game_list_t *game_list;
 static vk_game_t *game;
 static vk_machine_t *mach;
+static vk_rewind_t *rewind_ring;
+
+static void
+poll_save_state (vk_machine_t *mach, bool wait)
+{
+	int ret;
+
+	if (!vk_machine_poll_save_state (mach, wait, &ret))
+		return;
+
+	if (!ret)
+		printf ("saved state");
+	else
+		VK_ERROR ("failed to write state");
+}
 
 static int
 load_or_save_state (vk_machine_t *mach, bool flag)
@@ -54,11 +74,20 @@ load_or_save_state (vk_machine_t *mach, bool flag)
 	if (ret <= 0)
 		goto fail;
 
-	ret = flag ? vk_machine_load_state (mach, path) :
-	             vk_machine_save_state (mach, path);
+	/* Saves are written in the background; see poll_save_state (). */
+	if (flag) {
+		poll_save_state (mach, true);
+		ret = vk_machine_load_state (mach, path);
+		/* Don't let F2 step back into the previous timeline. */
+		if (!ret && rewind_ring)
+			vk_rewind_reset (rewind_ring);
+	} else
+		ret = vk_machine_save_state_async (mach, path,
+		                                   options.base_state_path[0] ?
+		                                   options.base_state_path : NULL);
 
 	if (!ret)
-		printf ("%s state '%s'", flag ? "loaded" : "saved", path);
+		printf ("%s state '%s'", flag ? "loaded" : "saving", path);
 	else
 		VK_ERROR ("failed to %s state '%s'", flag ? "load" : "save", path);
 
@@ -68,6 +97,18 @@ fail:
 }
 
 static bool paused = false;
+static bool rewinding = false;
+
+static void
+rewind_one_frame (vk_machine_t *mach)
+{
+	/* Once the history is used up, hold the oldest frame. */
+	unsigned num_back = vk_rewind_get_depth (rewind_ring) ? 1 : 0;
+
+	if (!vk_rewind_restore (rewind_ring, mach, num_back))
+		printf ("rewound, %u frames left",
+		        vk_rewind_get_depth (rewind_ring));
+}
 
 static bool
 process_events (void)
@@ -91,15 +132,30 @@ process_events (void)
 			case SDLK_F1:
 				load_or_save_state (mach, true);
 				break;
+			case SDLK_F2:
+				/* While running, main_loop () steps back one
+				 * frame per iteration until F2 is released;
+				 * while paused, each press steps back once. */
+				if (rewind_ring && !event.key.repeat) {
+					rewinding = true;
+					if (paused)
+						rewind_one_frame (mach);
+				}
+				break;
 			case SDLK_F4:
 				load_or_save_state (mach, false);
 				break;
+			case SDLK_F9:
+				vk_trace_dump ("vk-trace");
+				break;
 			default:
 				break;
 			}
 			break;
 		case SDL_KEYUP:
 			vk_input_set_key (event.key.keysym.sym, false);
+			if (event.key.keysym.sym == SDLK_F2)
+				rewinding = false;
 			break;
 		case SDL_QUIT:
 			quit = true;
@@ -117,19 +173,30 @@ main_loop (vk_machine_t *mach, int num_frames)
 		if (num_frames > 0 && frame++ >= num_frames)
 			return;
 		if (!paused) {
+			if (rewinding)
+				rewind_one_frame (mach);
 			vk_renderer_begin_frame (mach->renderer);
 			vk_machine_run_frame (mach);
 			vk_renderer_end_frame (mach->renderer);
+			/* The frame only redraws a restored state; recording
+			 * it would undo the step back. */
+			if (rewind_ring && !rewinding)
+				vk_rewind_push (rewind_ring, mach);
 		}
+		poll_save_state (mach, false);
 	}
 }
 
-static const char global_opts[] = "R:r:n:l:vh?";
+static const char global_opts[] = "R:r:n:l:b:w:H:vh?";
 static const char global_help[] = "Usage: %s [options]\n"
 "	-R <path>	Path to the ROM directory\n"
 "	-r <string>	Name of the game to run\n"
 "	-n <num>	Only run for num frames\n"
 "	-l <num>	Load state num at startup\n"
+"	-b <path>	Save states as deltas against the state at path\n"
+"	-w <num>	Keep num frames of rewind history (F2 steps back)\n"
+"	-H <backend>	Run headless; backend is 'null' (no rendering)\n"
+"			or 'offscreen' (render to an EGL FBO)\n"
 "	-v		Set verbosity (affects debug messages)\n"
 "	-h              Show this help\n";
 
@@ -166,6 +233,22 @@ parse_global_opts (int argc, char **argv)
 		case 'l':
 			options.start_state = atoi (optarg);
 			break;
+		case 'b':
+			strncpy (options.base_state_path, optarg, 255);
+			break;
+		case 'w':
+			options.rewind_frames = atoi (optarg);
+			break;
+		case 'H':
+			if (!strcmp (optarg, "null"))
+				options.backend = VK_RENDERER_BACKEND_NULL;
+			else if (!strcmp (optarg, "offscreen"))
+				options.backend = VK_RENDERER_BACKEND_OFFSCREEN;
+			else {
+				VK_ERROR ("unknown headless backend '%s'", optarg);
+				return -1;
+			}
+			break;
 		case 'v':
 			vk_verbosity = 1;
 			break;
@@ -195,48 +278,14 @@ finalize (void)
 {
 	/* XXX free the game list and the game data */
 	printf ("Finalizing");
-	if (mach)
+	if (vk_trace_enabled)
+		vk_trace_dump ("vk-trace");
+	if (rewind_ring)
+		vk_rewind_destroy (&rewind_ring);
+	if (mach) {
+		poll_save_state (mach, true);
 		vk_machine_destroy (&mach);
-}
-
-static char *
-get_home_dir (void)
-{
-	char *path;
-	path = getenv ("HOME");
-	if (!path) {
-		struct passwd *pwd = getpwuid (getuid ());
-		if (pwd)
-			path = pwd->pw_dir;
 	}
-	return path;
-}
-
-static vk_game_list_t *
-load_game_list (void)
-{
-	vk_game_list_t *list = NULL;
-	char *paths[3], *home;
-	unsigned i, ret[3] = { 0, 0, 0 };
-
-	home = get_home_dir ();
-
-	paths[0] = strdup ("./vk-games.json");
-	ret[1] = asprintf (&paths[1], "%s/vk-games.json", home);
-	ret[2] = asprintf (&paths[2], "%s/.local/share/valkyrie/vk-games.json", home);
-
-	for (i = 0; i < 3 && !list; i++)
-		if (!ret[i])
-			list = vk_game_list_new (paths[i]);
-
-	if (list)
-		printf ("loading game list from '%s'", paths[i]);
-
-	free (paths[0]);
-	free (paths[1]);
-	free (paths[2]);
-
-	return list;
 }
 
 int
@@ -251,7 +300,10 @@ main (const int argc, char **argv)
 	if (parse_global_opts (argc, argv))
 		goto fail;
 
-	game_list = load_game_list ();
+	vk_renderer_set_default_backend (options.backend);
+	vk_trace_init ();
+
+	game_list = vk_game_list_new_default ();
 	if (!game_list) {
 		VK_ERROR ("failed to load the game list");
 		goto fail;
@@ -278,6 +330,12 @@ main (const int argc, char **argv)
 	if (options.start_state >= 0)
 		load_or_save_state (mach, true);
 
+	if (options.rewind_frames > 0) {
+		rewind_ring = vk_rewind_new (options.rewind_frames);
+		if (!rewind_ring)
+			VK_ERROR ("failed to allocate the rewind history");
+	}
+
 	printf ("Running");
 	main_loop (mach, options.num_frames);
 
@@ -19,6 +19,7 @@
  */
 
 #include "vk/mmap.h"
+#include "vk/trace.h"
 
 typedef struct {
 	uint32_t lo;
@@ -31,6 +32,7 @@ typedef struct {
 		void *ptr;
 	};
 	char *name;
+	unsigned trace_key;
 } region_t;
 
 static inline unsigned
@@ -49,6 +51,8 @@ get_size_flag_for_size (unsigned size)
 	return 0;
 }
 
+static unsigned next_trace_key = 0;
+
 static int
 add_region (vk_mmap_t *mmap, uint32_t lo, uint32_t hi, uint32_t mask,
             uint32_t flags, void *ptr, const char *name)
@@ -78,6 +82,11 @@ add_region (vk_mmap_t *mmap, uint32_t lo, uint32_t hi, uint32_t mask,
 
 	VK_ASSERT (region->name);
 
+	/* Regions of all memory maps share the trace key space. */
+	region->trace_key = next_trace_key++ % VK_TRACE_NUM_KEYS;
+	vk_trace_set_key_name (VK_TRACE_MMAP_GET, region->trace_key, region->name);
+	vk_trace_set_key_name (VK_TRACE_MMAP_PUT, region->trace_key, region->name);
+
 	return 0;
 }
 
@@ -86,6 +95,8 @@ vk_mmap_add_ram (vk_mmap_t *mmap, uint32_t lo, uint32_t hi, uint32_t mask,
                  uint32_t flags, vk_buffer_t *buf, const char *name)
 {
 	flags |= VK_REGION_DIRECT | VK_REGION_RW | VK_REGION_SIZE_ALL;
+	if (vk_buffer_is_le32 (buf))
+		flags |= VK_REGION_LE32;
 	return add_region (mmap, lo, hi, mask, flags, (void *) buf, name);
 }
 
@@ -96,6 +107,8 @@ vk_mmap_add_rom (vk_mmap_t *mmap, uint32_t lo, uint32_t hi, uint32_t mask,
 	VK_ASSERT (!(flags & VK_REGION_W));
 
 	flags |= VK_REGION_DIRECT | VK_REGION_R | VK_REGION_SIZE_ALL;
+	if (vk_buffer_is_le32 (buf))
+		flags |= VK_REGION_LE32;
 	return add_region (mmap, lo, hi, mask, flags, (void *) buf, name);
 }
 
@@ -139,12 +152,26 @@ vk_mmap_get (vk_mmap_t *mmap, unsigned size, uint32_t addr, void *data)
 	if (!region || !(region->flags & get_size_flag_for_size (size)))
 		return -1;
 
+	vk_trace_count (VK_TRACE_MMAP_GET, region->trace_key);
+
 	if (region->flags & VK_REGION_LOG_R)
 		VK_MACH_LOG (mmap->mach, "%s R%u %08X", region->name, size * 8, addr);
 
 	if (region->flags & VK_REGION_DIRECT) {
 		uint32_t offs = addr & region->mask;
 		uint64_t temp;
+
+		/* Word data accesses and instruction fetches */
+		if (region->flags & VK_REGION_LE32) {
+			if (size == 4) {
+				*(uint32_t *) data = vk_buffer_get32_le (region->buf, offs);
+				return 0;
+			} else if (size == 2) {
+				*(uint16_t *) data = vk_buffer_get16_le (region->buf, offs);
+				return 0;
+			}
+		}
+
 		temp = region->buf->get (region->buf, size, offs);
 		set_ptr (data, size, temp);
 		return 0;
@@ -168,11 +195,24 @@ vk_mmap_put (vk_mmap_t *mmap, unsigned size, uint32_t addr, uint64_t data)
 	if (!(region->flags & get_size_flag_for_size (size)))
 		return -1;
 
+	vk_trace_count (VK_TRACE_MMAP_PUT, region->trace_key);
+
 	if (region->flags & VK_REGION_LOG_W)
 		VK_MACH_LOG (mmap->mach, "%s W%u %08X = %lX", region->name, size * 8, addr, data);
 
 	if (region->flags & VK_REGION_DIRECT) {
 		uint32_t offs = addr & region->mask;
+
+		if (region->flags & VK_REGION_LE32) {
+			if (size == 4) {
+				vk_buffer_put32_le (region->buf, offs, (uint32_t) data);
+				return 0;
+			} else if (size == 2) {
+				vk_buffer_put16_le (region->buf, offs, (uint16_t) data);
+				return 0;
+			}
+		}
+
 		region->buf->put (region->buf, size, offs, data);
 		return 0;
 	}
@@ -180,6 +220,48 @@ vk_mmap_put (vk_mmap_t *mmap, unsigned size, uint32_t addr, uint64_t data)
 	return vk_device_put (region->dev, size, addr, data);
 }
 
+/* Writes NBYTES of 32-bit words with a single region lookup; the whole block
+ * must fall within one region. Used for burst transfers. */
+
+int
+vk_mmap_put_block (vk_mmap_t *mmap, uint32_t addr, const void *data, unsigned nbytes)
+{
+	const uint32_t *words = (const uint32_t *) data;
+	region_t *region;
+	unsigned i;
+
+	VK_ASSERT (mmap != NULL);
+	VK_ASSERT (data != NULL);
+	VK_ASSERT (!(addr & 3) && !(nbytes & 3));
+
+	region = get_region (mmap, addr, VK_REGION_W);
+	if (!region || (addr + nbytes - 1) > region->hi)
+		return -1;
+
+	if (!(region->flags & VK_REGION_SIZE_32))
+		return -1;
+
+	vk_trace_count (VK_TRACE_MMAP_PUT, region->trace_key);
+
+	if (region->flags & VK_REGION_LOG_W)
+		VK_MACH_LOG (mmap->mach, "%s W%u %08X (block)", region->name, nbytes * 8, addr);
+
+	if (region->flags & VK_REGION_DIRECT) {
+		uint32_t offs = addr & region->mask;
+		if (offs + nbytes > region->buf->size)
+			return -1;
+		vk_buffer_write_block (region->buf, offs, data, nbytes);
+		return 0;
+	}
+
+	for (i = 0; i < nbytes / 4; i++) {
+		int ret = vk_device_put (region->dev, 4, addr + i * 4, words[i]);
+		if (ret)
+			return ret;
+	}
+	return 0;
+}
+
 vk_mmap_t *
 vk_mmap_new (vk_machine_t *mach)
 {
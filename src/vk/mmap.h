@@ -29,6 +29,8 @@
 #define VK_REGION_RW		(VK_REGION_R|VK_REGION_W)
 
 #define VK_REGION_DIRECT	(1 << 2)
+/* Set internally for direct regions backed by a little-endian buffer */
+#define VK_REGION_LE32		(1 << 3)
 
 #define VK_REGION_LOG_R		(1 << 4)
 #define VK_REGION_LOG_W		(1 << 5)
@@ -58,5 +60,6 @@ int		 vk_mmap_add_dev (vk_mmap_t *mmap, uint32_t lo, uint32_t hi,
 		                  vk_device_t *dev, const char *name);
 int		 vk_mmap_get (vk_mmap_t *mmap, unsigned size, uint32_t addr, void *data);
 int		 vk_mmap_put (vk_mmap_t *mmap, unsigned size, uint32_t addr, uint64_t data);
+int		 vk_mmap_put_block (vk_mmap_t *mmap, uint32_t addr, const void *data, unsigned nbytes);
 
 #endif /* __VK_MMAP_H__ */
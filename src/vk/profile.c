@@ -0,0 +1,304 @@
+/* 
+ * Valkyrie
+ * Copyright (C) 2011, 2012, Stefano Teso
+ * 
+ * Valkyrie is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Valkyrie is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Valkyrie.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "vk/profile.h"
+
+vk_profile_t *
+vk_profile_new (const char *name, unsigned period)
+{
+	vk_profile_t *prof;
+
+	VK_ASSERT (period > 0);
+
+	prof = ALLOC (vk_profile_t);
+	if (!prof)
+		return NULL;
+
+	strncpy (prof->name, name, sizeof (prof->name) - 1);
+	prof->period = period;
+	prof->countdown = period;
+
+	prof->size = 4096;
+	prof->entries = (vk_profile_entry_t *) calloc (prof->size,
+	                                               sizeof (vk_profile_entry_t));
+	if (!prof->entries) {
+		free (prof);
+		return NULL;
+	}
+	return prof;
+}
+
+void
+vk_profile_destroy (vk_profile_t **prof_)
+{
+	if (prof_) {
+		vk_profile_t *prof = *prof_;
+		if (prof)
+			free (prof->entries);
+		free (prof);
+		*prof_ = NULL;
+	}
+}
+
+/* The histogram is an open-addressing hash table keyed by PC; zero-count
+ * slots are empty. */
+
+static vk_profile_entry_t *
+lookup (vk_profile_entry_t *entries, unsigned size, uint32_t pc)
+{
+	unsigned i = (pc >> 1) * 2654435761u;
+
+	for (i &= size - 1; ; i = (i + 1) & (size - 1))
+		if (!entries[i].count || entries[i].pc == pc)
+			return &entries[i];
+}
+
+static int
+grow (vk_profile_t *prof)
+{
+	vk_profile_entry_t *entries;
+	unsigned size = prof->size * 2, i;
+
+	entries = (vk_profile_entry_t *) calloc (size, sizeof (vk_profile_entry_t));
+	if (!entries)
+		return -1;
+
+	for (i = 0; i < prof->size; i++)
+		if (prof->entries[i].count)
+			*lookup (entries, size, prof->entries[i].pc) = prof->entries[i];
+
+	free (prof->entries);
+	prof->entries = entries;
+	prof->size = size;
+	return 0;
+}
+
+vk_profile_entry_t *
+vk_profile_sample (vk_profile_t *prof, uint32_t pc, bool *is_new)
+{
+	vk_profile_entry_t *entry;
+
+	prof->countdown = prof->period;
+	prof->num_samples++;
+
+	if (prof->used * 2 >= prof->size && grow (prof))
+		VK_ABORT ("profile: out of memory");
+
+	entry = lookup (prof->entries, prof->size, pc);
+	*is_new = (entry->count == 0);
+	if (*is_new) {
+		entry->pc = pc;
+		prof->used++;
+	}
+	entry->count++;
+	return entry;
+}
+
+/****************************************************************************
+ Symbols
+****************************************************************************/
+
+typedef struct {
+	uint32_t addr;
+	char *name;
+	uint64_t count;
+	uint64_t idle;
+} symbol_t;
+
+static int
+compare_symbols_by_addr (const void *a_, const void *b_)
+{
+	const symbol_t *a = (const symbol_t *) a_;
+	const symbol_t *b = (const symbol_t *) b_;
+	return (a->addr < b->addr) ? -1 : (a->addr > b->addr) ? 1 : 0;
+}
+
+static int
+compare_symbols_by_count (const void *a_, const void *b_)
+{
+	const symbol_t *a = (const symbol_t *) a_;
+	const symbol_t *b = (const symbol_t *) b_;
+	return (a->count > b->count) ? -1 : (a->count < b->count) ? 1 : 0;
+}
+
+/* Each line of the map file holds a hex address and a name, optionally
+ * with a type letter in between, as printed by nm. Lines that don't parse
+ * are skipped. */
+
+static symbol_t *
+load_symbols (const char *path, unsigned *num_)
+{
+	symbol_t *symbols = NULL, *tmp;
+	unsigned num = 0, size = 0;
+	char line[256], name[256], type[8];
+	unsigned addr;
+	FILE *fp;
+
+	fp = fopen (path, "r");
+	if (!fp) {
+		VK_ERROR ("profile: could not open map file '%s'", path);
+		return NULL;
+	}
+
+	while (fgets (line, sizeof (line), fp)) {
+		if (sscanf (line, "%x %7s %255s", &addr, type, name) != 3 &&
+		    sscanf (line, "%x %255s", &addr, name) != 2)
+			continue;
+		if (num == size) {
+			size = size ? size * 2 : 256;
+			tmp = (symbol_t *) realloc (symbols, size * sizeof (symbol_t));
+			if (!tmp)
+				break;
+			symbols = tmp;
+		}
+		memset (&symbols[num], 0, sizeof (symbol_t));
+		symbols[num].addr = addr;
+		symbols[num].name = strdup (name);
+		num++;
+	}
+	fclose (fp);
+
+	if (symbols)
+		qsort (symbols, num, sizeof (symbol_t), compare_symbols_by_addr);
+	*num_ = num;
+	return symbols;
+}
+
+/* Return the last symbol at or before ADDR. */
+
+static symbol_t *
+find_symbol (symbol_t *symbols, unsigned num, uint32_t addr)
+{
+	unsigned lo = 0, hi = num;
+
+	while (lo < hi) {
+		unsigned mid = (lo + hi) / 2;
+		if (symbols[mid].addr <= addr)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	return lo ? &symbols[lo - 1] : NULL;
+}
+
+/****************************************************************************
+ Report
+****************************************************************************/
+
+static int
+compare_entries (const void *a_, const void *b_)
+{
+	const vk_profile_entry_t *a = (const vk_profile_entry_t *) a_;
+	const vk_profile_entry_t *b = (const vk_profile_entry_t *) b_;
+	return (a->count > b->count) ? -1 : (a->count < b->count) ? 1 : 0;
+}
+
+#define MAX_REPORTED_PCS 100
+
+int
+vk_profile_report (vk_profile_t *prof, const char *path, const char *map_path)
+{
+	vk_profile_entry_t *entries = NULL;
+	symbol_t *symbols = NULL;
+	uint64_t idle = 0, run_cycles, total_cycles;
+	unsigned num_symbols = 0, i, j;
+	FILE *fp = NULL;
+	int ret = -1;
+
+	VK_ASSERT (prof);
+
+	entries = (vk_profile_entry_t *) malloc (prof->used * sizeof (vk_profile_entry_t) + 1);
+	if (!entries)
+		goto fail;
+
+	for (i = 0, j = 0; i < prof->size; i++)
+		if (prof->entries[i].count) {
+			entries[j++] = prof->entries[i];
+			if (prof->entries[i].idle)
+				idle += prof->entries[i].count;
+		}
+	qsort (entries, prof->used, sizeof (vk_profile_entry_t), compare_entries);
+
+	if (map_path) {
+		symbols = load_symbols (map_path, &num_symbols);
+		for (i = 0; i < prof->used; i++) {
+			symbol_t *sym = find_symbol (symbols, num_symbols, entries[i].pc);
+			if (sym) {
+				sym->count += entries[i].count;
+				if (entries[i].idle)
+					sym->idle += entries[i].count;
+			}
+		}
+	}
+
+	fp = fopen (path, "w");
+	if (!fp) {
+		VK_ERROR ("profile: could not open '%s'", path);
+		goto fail;
+	}
+
+	/* Each sample stands for PERIOD executed instructions, i.e. cycles
+	 * as far as the interpreter is concerned. */
+	run_cycles = prof->num_samples * prof->period;
+	total_cycles = MAX2 (run_cycles + prof->num_sleep_cycles, 1);
+
+	fprintf (fp, "# %s: %llu samples, one every %u instructions\n",
+	         prof->name, (unsigned long long) prof->num_samples, prof->period);
+	fprintf (fp, "# asleep     %6.2f%%\n",
+	         100.0 * prof->num_sleep_cycles / total_cycles);
+	fprintf (fp, "# idle loops %6.2f%%\n",
+	         100.0 * idle * prof->period / total_cycles);
+	fprintf (fp, "# real work  %6.2f%%\n",
+	         100.0 * (prof->num_samples - idle) * prof->period / total_cycles);
+
+	if (num_symbols) {
+		qsort (symbols, num_symbols, sizeof (symbol_t), compare_symbols_by_count);
+		fprintf (fp, "\n# samples      %%    idle  symbol\n");
+		for (i = 0; i < num_symbols && symbols[i].count; i++)
+			fprintf (fp, "%9llu %6.2f %6.2f%%  %s\n",
+			         (unsigned long long) symbols[i].count,
+			         100.0 * symbols[i].count / prof->num_samples,
+			         100.0 * symbols[i].idle / symbols[i].count,
+			         symbols[i].name);
+		qsort (symbols, num_symbols, sizeof (symbol_t), compare_symbols_by_addr);
+	}
+
+	fprintf (fp, "\n# samples      %%  pc        symbol\n");
+	for (i = 0; i < prof->used && i < MAX_REPORTED_PCS; i++) {
+		symbol_t *sym = find_symbol (symbols, num_symbols, entries[i].pc);
+		fprintf (fp, "%9llu %6.2f  %08X  ",
+		         (unsigned long long) entries[i].count,
+		         100.0 * entries[i].count / prof->num_samples,
+		         entries[i].pc);
+		if (sym)
+			fprintf (fp, "%s+%X", sym->name, entries[i].pc - sym->addr);
+		fprintf (fp, "%s\n", entries[i].idle ? " [idle]" : "");
+	}
+
+	ret = ferror (fp) ? -1 : 0;
+	if (!ret)
+		VK_PRINT ("profile: wrote '%s'", path);
+fail:
+	if (fp)
+		fclose (fp);
+	for (i = 0; i < num_symbols; i++)
+		free (symbols[i].name);
+	free (symbols);
+	free (entries);
+	return ret;
+}
@@ -0,0 +1,51 @@
+/* 
+ * Valkyrie
+ * Copyright (C) 2011, 2012, Stefano Teso
+ * 
+ * Valkyrie is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Valkyrie is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Valkyrie.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef __VK_PROFILE_H__
+#define __VK_PROFILE_H__
+
+#include "vk/core.h"
+
+/* Guest-code sampling profiler. The CPU core calls vk_profile_sample ()
+ * every PERIOD instructions with the current PC; the report aggregates
+ * samples per symbol (if a map file is given) and per PC. Entries flagged
+ * as idle, e.g. polling loops, are accounted separately from real work,
+ * together with the cycles the CPU spent asleep. */
+
+typedef struct {
+	uint32_t pc;
+	bool idle;
+	uint64_t count;
+} vk_profile_entry_t;
+
+typedef struct {
+	char name[32];
+	unsigned period;
+	unsigned countdown;
+	uint64_t num_samples;
+	uint64_t num_sleep_cycles;
+	vk_profile_entry_t *entries;
+	unsigned size, used;
+} vk_profile_t;
+
+vk_profile_t		*vk_profile_new (const char *name, unsigned period);
+void			 vk_profile_destroy (vk_profile_t **prof_);
+vk_profile_entry_t	*vk_profile_sample (vk_profile_t *prof, uint32_t pc, bool *is_new);
+int			 vk_profile_report (vk_profile_t *prof, const char *path, const char *map_path);
+
+#endif /* __VK_PROFILE_H__ */
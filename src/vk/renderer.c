@@ -19,15 +19,32 @@
  */
 
 #include "vk/renderer.h"
+#include "vk/timer.h"
+
+#ifdef VK_HAVE_EGL
+#include <EGL/egl.h>
+#include <EGL/eglext.h>
+#endif
 
 /* TODO change API to avoid leaking the SDL window and GL context. */
 
+static vk_renderer_backend_t default_backend = VK_RENDERER_BACKEND_WINDOW;
+
+void
+vk_renderer_set_default_backend (vk_renderer_backend_t backend)
+{
+	default_backend = backend;
+}
+
 void
 vk_renderer_clear_gl_errors (void)
 {
 	while (glGetError () != GL_NO_ERROR);
 }
 
+static vk_timer_t *frame_timer = NULL;
+static vk_timer_t *swap_timer = NULL;
+
 void
 vk_renderer_begin_frame (vk_renderer_t *renderer)
 {
@@ -36,7 +53,7 @@ vk_renderer_begin_frame (vk_renderer_t *renderer)
 		renderer->begin_frame (renderer);
 }
 
-static uint32_t clock = 0;
+static uint32_t last_ticks = 0;
 
 void
 vk_renderer_end_frame (vk_renderer_t *renderer)
@@ -47,13 +64,26 @@ vk_renderer_end_frame (vk_renderer_t *renderer)
 
 	VK_ASSERT (renderer);
 
+	vk_timer_begin (frame_timer);
+
 	if (renderer->end_frame)
 		renderer->end_frame (renderer);
-	SDL_GL_SwapWindow (renderer->window);
+
+	vk_timer_begin (swap_timer);
+	if (renderer->backend == VK_RENDERER_BACKEND_OFFSCREEN)
+		glFinish ();
+	else if (renderer->backend == VK_RENDERER_BACKEND_WINDOW)
+		SDL_GL_SwapWindow (renderer->window);
+	vk_timer_end (swap_timer);
+
+	vk_timer_end (frame_timer);
+
+	if (renderer->backend != VK_RENDERER_BACKEND_WINDOW)
+		return;
 
 	temp = SDL_GetTicks ();
-	delta = temp - clock;
-	clock = temp;
+	delta = temp - last_ticks;
+	last_ticks = temp;
 
 	fps = 0.0f;
 	if (delta)
@@ -63,17 +93,13 @@ vk_renderer_end_frame (vk_renderer_t *renderer)
 	SDL_SetWindowTitle (renderer->window, title);
 }
 
-int
-vk_renderer_init (vk_renderer_t *renderer)
+static int
+create_window (vk_renderer_t *renderer)
 {
 	int num_ms_buffers, num_samples;
 
-	VK_ASSERT (renderer);
-	VK_ASSERT (renderer->width);
-	VK_ASSERT (renderer->height);
-
-	if (SDL_Init (SDL_INIT_VIDEO | SDL_INIT_TIMER)) {
-		VK_ERROR ("could not initialize SDL: '%s'", SDL_GetError ());
+	if (SDL_InitSubSystem (SDL_INIT_VIDEO)) {
+		VK_ERROR ("could not initialize SDL video: '%s'", SDL_GetError ());
 		return -1;
 	}
 
@@ -118,23 +144,191 @@ vk_renderer_init (vk_renderer_t *renderer)
 
 	SDL_GL_SetSwapInterval (0);
 
+	SDL_GL_GetAttribute (SDL_GL_MULTISAMPLEBUFFERS, &num_ms_buffers);
+	SDL_GL_GetAttribute (SDL_GL_MULTISAMPLESAMPLES, &num_samples);
+
+	VK_PRINT ("renderer: %d samples on %d ms buffers", num_samples, num_ms_buffers);
+	return 0;
+}
+
+#ifdef VK_HAVE_EGL
+
+/* Prefer Mesa's surfaceless platform, which needs neither an X server nor
+ * a window; fall back to the default display otherwise. */
+
+static EGLDisplay
+get_egl_display (void)
+{
+	PFNEGLGETPLATFORMDISPLAYEXTPROC get_platform_display;
+	const char *exts;
+
+	exts = eglQueryString (EGL_NO_DISPLAY, EGL_EXTENSIONS);
+	if (exts && strstr (exts, "EGL_MESA_platform_surfaceless")) {
+		get_platform_display = (PFNEGLGETPLATFORMDISPLAYEXTPROC)
+			eglGetProcAddress ("eglGetPlatformDisplayEXT");
+		if (get_platform_display)
+			return get_platform_display (EGL_PLATFORM_SURFACELESS_MESA,
+			                             EGL_DEFAULT_DISPLAY, NULL);
+	}
+	return eglGetDisplay (EGL_DEFAULT_DISPLAY);
+}
+
+static int
+create_offscreen_context (vk_renderer_t *renderer)
+{
+	static const EGLint config_attribs[] = {
+		EGL_SURFACE_TYPE,	EGL_PBUFFER_BIT,
+		EGL_RENDERABLE_TYPE,	EGL_OPENGL_BIT,
+		EGL_NONE
+	};
+	static const EGLint context_attribs[] = {
+		EGL_CONTEXT_MAJOR_VERSION_KHR,	3,
+		EGL_CONTEXT_MINOR_VERSION_KHR,	1,
+		EGL_CONTEXT_FLAGS_KHR,		EGL_CONTEXT_OPENGL_FORWARD_COMPATIBLE_BIT_KHR,
+		EGL_NONE
+	};
+	EGLDisplay display;
+	EGLContext context;
+	EGLConfig config;
+	EGLint num_configs;
+
+	display = get_egl_display ();
+	if (display == EGL_NO_DISPLAY || !eglInitialize (display, NULL, NULL)) {
+		VK_ERROR ("could not initialize EGL display");
+		return -1;
+	}
+
+	if (!eglBindAPI (EGL_OPENGL_API) ||
+	    !eglChooseConfig (display, config_attribs, &config, 1, &num_configs) ||
+	    num_configs < 1) {
+		VK_ERROR ("could not find a suitable EGL config");
+		return -1;
+	}
+
+	context = eglCreateContext (display, config, EGL_NO_CONTEXT, context_attribs);
+	if (context == EGL_NO_CONTEXT) {
+		VK_ERROR ("could not create EGL context: %X", eglGetError ());
+		return -1;
+	}
+
+	/* No surface at all: everything goes to the FBO. */
+	if (!eglMakeCurrent (display, EGL_NO_SURFACE, EGL_NO_SURFACE, context)) {
+		VK_ERROR ("could not make EGL context current: %X", eglGetError ());
+		return -1;
+	}
+
+	renderer->offscreen.display = (void *) display;
+	renderer->offscreen.context = (void *) context;
+	return 0;
+}
+
+#else
+
+static int
+create_offscreen_context (vk_renderer_t *renderer)
+{
+	VK_ERROR ("offscreen rendering requires EGL support");
+	return -1;
+}
+
+#endif
+
+/* The FBO stays bound for the whole run, standing in for the window's
+ * default framebuffer. */
+
+static int
+create_offscreen_fbo (vk_renderer_t *renderer)
+{
+	GLenum status;
+
+	glGenRenderbuffers (1, &renderer->offscreen.color);
+	glBindRenderbuffer (GL_RENDERBUFFER, renderer->offscreen.color);
+	glRenderbufferStorage (GL_RENDERBUFFER, GL_RGBA8,
+	                       renderer->width, renderer->height);
+
+	glGenRenderbuffers (1, &renderer->offscreen.depth);
+	glBindRenderbuffer (GL_RENDERBUFFER, renderer->offscreen.depth);
+	glRenderbufferStorage (GL_RENDERBUFFER, GL_DEPTH_COMPONENT24,
+	                       renderer->width, renderer->height);
+
+	glBindRenderbuffer (GL_RENDERBUFFER, 0);
+
+	glGenFramebuffers (1, &renderer->offscreen.fbo);
+	glBindFramebuffer (GL_FRAMEBUFFER, renderer->offscreen.fbo);
+	glFramebufferRenderbuffer (GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0,
+	                           GL_RENDERBUFFER, renderer->offscreen.color);
+	glFramebufferRenderbuffer (GL_FRAMEBUFFER, GL_DEPTH_ATTACHMENT,
+	                           GL_RENDERBUFFER, renderer->offscreen.depth);
+
+	status = glCheckFramebufferStatus (GL_FRAMEBUFFER);
+	if (status != GL_FRAMEBUFFER_COMPLETE) {
+		VK_ERROR ("offscreen framebuffer incomplete: %X", status);
+		return -1;
+	}
+	return 0;
+}
+
+int
+vk_renderer_init (vk_renderer_t *renderer)
+{
+	GLenum err;
+
+	VK_ASSERT (renderer);
+	VK_ASSERT (renderer->width);
+	VK_ASSERT (renderer->height);
+
+	renderer->backend = default_backend;
+	frame_timer = vk_timer_get ("renderer");
+	swap_timer = vk_timer_get ("swap");
+
+	if (SDL_Init (SDL_INIT_TIMER)) {
+		VK_ERROR ("could not initialize SDL: '%s'", SDL_GetError ());
+		return -1;
+	}
+
+	switch (renderer->backend) {
+	case VK_RENDERER_BACKEND_WINDOW:
+		if (create_window (renderer))
+			return -1;
+		break;
+	case VK_RENDERER_BACKEND_OFFSCREEN:
+		if (create_offscreen_context (renderer))
+			return -1;
+		break;
+	case VK_RENDERER_BACKEND_NULL:
+		VK_PRINT ("renderer: using the null backend");
+		return 0;
+	default:
+		VK_ASSERT (0);
+	}
+
 	glewExperimental = GL_TRUE;
-	if (glewInit () != GLEW_OK) {
-		VK_ERROR ("could not initialize glew");
+	err = glewInit ();
+#ifdef GLEW_ERROR_NO_GLX_DISPLAY
+	/* A GLX-only GLEW loads the GL entry points first and only then
+	 * fails for lack of an X display, which the EGL context doesn't
+	 * have. EGL-enabled GLEW builds return GLEW_OK here. */
+	if (err == GLEW_ERROR_NO_GLX_DISPLAY &&
+	    renderer->backend == VK_RENDERER_BACKEND_OFFSCREEN)
+		err = GLEW_OK;
+#endif
+	if (err != GLEW_OK) {
+		VK_ERROR ("could not initialize glew: %s",
+		          glewGetErrorString (err));
 		return -1;
 	}
 
+	if (renderer->backend == VK_RENDERER_BACKEND_OFFSCREEN &&
+	    create_offscreen_fbo (renderer))
+		return -1;
+
 	/* Attempt to force multisampling off. */
 	glDisable (GL_MULTISAMPLE);
 
-	SDL_GL_GetAttribute (SDL_GL_MULTISAMPLEBUFFERS, &num_ms_buffers);
-	SDL_GL_GetAttribute (SDL_GL_MULTISAMPLESAMPLES, &num_samples);
-
 	VK_PRINT ("renderer: GL vendor    = %s", glGetString (GL_VENDOR));
 	VK_PRINT ("renderer: GL renderer  = %s", glGetString (GL_RENDERER));
 	VK_PRINT ("renderer: GL version   = %s", glGetString (GL_VERSION));
 	VK_PRINT ("renderer: GLSL version = %s", glGetString (GL_SHADING_LANGUAGE_VERSION));
-	VK_PRINT ("renderer: %d samples on %d ms buffers", num_samples, num_ms_buffers);
 
 	glViewport (0, 0, renderer->width, renderer->height);
 
@@ -202,6 +396,8 @@ vk_renderer_compile_program (const char *vs_src, const char *fs_src)
 	id = glCreateProgram ();
 	glAttachShader (id, vs);
 	glAttachShader (id, fs);
+	if (GLEW_ARB_get_program_binary)
+		glProgramParameteri (id, GL_PROGRAM_BINARY_RETRIEVABLE_HINT, GL_TRUE);
 	glLinkProgram (id);
 	glGetProgramiv (id, GL_LINK_STATUS, &status);
 	if (status == GL_FALSE) {
@@ -233,6 +429,62 @@ vk_renderer_destroy_program (GLuint program)
 	}
 }
 
+bool
+vk_renderer_has_program_binary (void)
+{
+	GLint num = 0;
+
+	if (!GLEW_ARB_get_program_binary)
+		return false;
+
+	glGetIntegerv (GL_NUM_PROGRAM_BINARY_FORMATS, &num);
+	return num > 0;
+}
+
+/* Returns a malloc'd copy of the binary representation of PROGRAM, or
+ * NULL if it can't be retrieved. */
+void *
+vk_renderer_get_program_binary (GLuint program, GLenum *format, GLsizei *length)
+{
+	GLint size = 0;
+	void *data;
+
+	glGetProgramiv (program, GL_PROGRAM_BINARY_LENGTH, &size);
+	if (size <= 0)
+		return NULL;
+
+	data = malloc (size);
+	if (!data)
+		return NULL;
+
+	glGetProgramBinary (program, size, length, format, data);
+	if (glGetError () != GL_NO_ERROR) {
+		free (data);
+		return NULL;
+	}
+	return data;
+}
+
+/* Creates a program from a binary previously obtained with
+ * vk_renderer_get_program_binary. Returns 0 if the driver rejects it,
+ * e.g., after a driver update. */
+GLuint
+vk_renderer_load_program_binary (GLenum format, const void *data, GLsizei length)
+{
+	GLuint id;
+	GLint status;
+
+	id = glCreateProgram ();
+	glProgramBinary (id, format, data, length);
+	glGetProgramiv (id, GL_LINK_STATUS, &status);
+	if (status == GL_FALSE) {
+		glDeleteProgram (id);
+		vk_renderer_clear_gl_errors ();
+		return 0;
+	}
+	return id;
+}
+
 void
 vk_renderer_print_uniforms (GLuint program)
 {
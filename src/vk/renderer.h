@@ -57,10 +57,29 @@
 
 typedef struct vk_renderer_t vk_renderer_t;
 
+/* The window backend is the default. The offscreen backend renders to an
+ * FBO in a windowless EGL context; the null backend creates no GL context
+ * at all, and machine renderers are expected to turn their hooks into
+ * no-ops. */
+
+typedef enum {
+	VK_RENDERER_BACKEND_WINDOW,
+	VK_RENDERER_BACKEND_OFFSCREEN,
+	VK_RENDERER_BACKEND_NULL,
+} vk_renderer_backend_t;
+
 struct vk_renderer_t {
+	vk_renderer_backend_t backend;
+
 	SDL_Window *window;
 	SDL_GLContext *gl_context;
 
+	struct {
+		void *display;
+		void *context;
+		GLuint fbo, color, depth;
+	} offscreen;
+
 	unsigned width;
 	unsigned height;
 	char message[256];
@@ -71,12 +90,19 @@ struct vk_renderer_t {
 	void	(* end_frame)(vk_renderer_t *renderer);
 };
 
+void			 vk_renderer_set_default_backend (vk_renderer_backend_t backend);
 vk_renderer_t		*vk_renderer_new (unsigned width, unsigned height);
 int			 vk_renderer_init (vk_renderer_t *renderer);
 void			 vk_renderer_begin_frame (vk_renderer_t *renderer);
 void			 vk_renderer_end_frame (vk_renderer_t *renderer);
 void			 vk_renderer_clear_gl_errors (void);
 
+static inline bool
+vk_renderer_is_null (vk_renderer_t *renderer)
+{
+	return renderer->backend == VK_RENDERER_BACKEND_NULL;
+}
+
 static inline void
 vk_renderer_reset (vk_renderer_t *renderer)
 {
@@ -96,6 +122,9 @@ vk_renderer_destroy (vk_renderer_t **renderer_)
 
 GLuint	vk_renderer_compile_program (const char *vs_src, const char *fs_src);
 void	vk_renderer_destroy_program (GLuint program);
+bool	vk_renderer_has_program_binary (void);
+void	*vk_renderer_get_program_binary (GLuint program, GLenum *format, GLsizei *length);
+GLuint	vk_renderer_load_program_binary (GLenum format, const void *data, GLsizei length);
 void	vk_renderer_print_uniforms (GLuint program);
 
 void	vk_renderer_ortho (mtx4x4f_t proj, float l, float r, float b, float t, float n, float f);
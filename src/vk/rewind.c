@@ -0,0 +1,247 @@
+/* 
+ * Valkyrie
+ * Copyright (C) 2011-2013, Stefano Teso
+ * 
+ * Valkyrie is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Valkyrie is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Valkyrie.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "vk/rewind.h"
+
+/* Runs of fewer equal bytes than this are folded into the surrounding
+ * literal, to avoid emitting a header for each tiny gap. */
+#define MIN_SKIP	16
+
+vk_rewind_t *
+vk_rewind_new (unsigned num_slots)
+{
+	vk_rewind_t *rewind;
+
+	VK_ASSERT (num_slots > 0);
+
+	rewind = ALLOC (vk_rewind_t);
+	if (!rewind)
+		return NULL;
+
+	rewind->num_slots = num_slots;
+	rewind->deltas = (vk_rewind_delta_t *)
+		calloc (num_slots, sizeof (vk_rewind_delta_t));
+	rewind->latest = vk_state_new_memory ();
+	rewind->scratch = vk_state_new_memory ();
+	if (!rewind->deltas || !rewind->latest || !rewind->scratch)
+		goto fail;
+
+	return rewind;
+
+fail:
+	vk_rewind_destroy (&rewind);
+	return NULL;
+}
+
+void
+vk_rewind_destroy (vk_rewind_t **rewind_)
+{
+	vk_rewind_t *rewind;
+	unsigned i;
+
+	VK_ASSERT (rewind_);
+	rewind = *rewind_;
+	if (!rewind)
+		return;
+
+	if (rewind->deltas)
+		for (i = 0; i < rewind->num_slots; i++)
+			free (rewind->deltas[i].data);
+	free (rewind->deltas);
+	if (rewind->latest)
+		vk_state_destroy (&rewind->latest, 0);
+	if (rewind->scratch)
+		vk_state_destroy (&rewind->scratch, 0);
+	free (rewind);
+	*rewind_ = NULL;
+}
+
+/* Forgets the whole history, e.g. after the machine state was replaced by
+ * loading a savestate. The next push starts a new history. */
+
+void
+vk_rewind_reset (vk_rewind_t *rewind)
+{
+	VK_ASSERT (rewind);
+
+	rewind->head = 0;
+	rewind->used = 0;
+	vk_state_reset_memory (rewind->latest, VK_STATE_SAVE);
+}
+
+unsigned
+vk_rewind_get_depth (vk_rewind_t *rewind)
+{
+	return rewind->used;
+}
+
+static int
+append (vk_rewind_delta_t *delta, const void *src, uint32_t size)
+{
+	if (delta->size + size > delta->alloc) {
+		uint32_t alloc = delta->alloc ? delta->alloc : 4096;
+		uint8_t *data;
+
+		while (alloc < delta->size + size)
+			alloc *= 2;
+		data = (uint8_t *) realloc (delta->data, alloc);
+		if (!data)
+			return -1;
+		delta->data = data;
+		delta->alloc = alloc;
+	}
+
+	memcpy (&delta->data[delta->size], src, size);
+	delta->size += size;
+	return 0;
+}
+
+static uint32_t
+skip_equal (const uint8_t *a, const uint8_t *b, uint32_t i, uint32_t size)
+{
+	uint64_t x, y;
+
+	for (; i + 8 <= size; i += 8) {
+		memcpy (&x, &a[i], 8);
+		memcpy (&y, &b[i], 8);
+		if (x != y)
+			break;
+	}
+	for (; i < size && a[i] == b[i]; i++)
+		;
+	return i;
+}
+
+/* Encodes A ^ B as a sequence of (skip, length, XORed bytes) records. */
+
+static int
+encode_delta (vk_rewind_delta_t *delta, const uint8_t *a, const uint8_t *b,
+              uint32_t size)
+{
+	uint8_t buf[256];
+	uint32_t i = 0, start, lit, end, j, n;
+
+	delta->size = 0;
+	while (1) {
+		start = i;
+		i = skip_equal (a, b, i, size);
+		if (i == size)
+			return 0;
+
+		lit = i;
+		while (1) {
+			for (; i < size && a[i] != b[i]; i++)
+				;
+			end = skip_equal (a, b, i, size);
+			if (end == size || end - i >= MIN_SKIP)
+				break;
+			i = end;
+		}
+
+		n = lit - start;
+		if (append (delta, &n, sizeof (n)))
+			return -1;
+		n = i - lit;
+		if (append (delta, &n, sizeof (n)))
+			return -1;
+		for (j = lit; j < i; j += n) {
+			uint32_t k;
+
+			n = MIN2 (i - j, sizeof (buf));
+			for (k = 0; k < n; k++)
+				buf[k] = a[j + k] ^ b[j + k];
+			if (append (delta, buf, n))
+				return -1;
+		}
+	}
+}
+
+static void
+apply_delta (const vk_rewind_delta_t *delta, uint8_t *dst, uint32_t size)
+{
+	const uint8_t *p = delta->data, *end = delta->data + delta->size;
+	uint32_t offs = 0, skip, len, k;
+
+	while (p < end) {
+		memcpy (&skip, p, sizeof (skip));
+		memcpy (&len, p + 4, sizeof (len));
+		p += 8;
+		offs += skip;
+		VK_ASSERT (offs + len <= size);
+		for (k = 0; k < len; k++)
+			dst[offs + k] ^= p[k];
+		offs += len;
+		p += len;
+	}
+}
+
+/* Captures the current machine state. The previous snapshot is folded into
+ * a delta; once the ring is full, the oldest delta is dropped. */
+
+int
+vk_rewind_push (vk_rewind_t *rewind, vk_machine_t *mach)
+{
+	vk_state_t *tmp;
+	vk_rewind_delta_t *delta;
+
+	vk_state_reset_memory (rewind->scratch, VK_STATE_SAVE);
+	if (vk_machine_save_to_state (mach, rewind->scratch))
+		return -1;
+
+	if (rewind->latest->mem_size == rewind->scratch->mem_size) {
+		delta = &rewind->deltas[rewind->head];
+		if (encode_delta (delta, rewind->latest->mem,
+		                  rewind->scratch->mem,
+		                  rewind->scratch->mem_size))
+			return -1;
+		rewind->head = (rewind->head + 1) % rewind->num_slots;
+		if (rewind->used < rewind->num_slots)
+			rewind->used++;
+	} else {
+		/* First snapshot, or the layout changed: restart history. */
+		rewind->used = 0;
+	}
+
+	tmp = rewind->latest;
+	rewind->latest = rewind->scratch;
+	rewind->scratch = tmp;
+	return 0;
+}
+
+/* Restores the state captured NUM_BACK pushes ago (0 is the latest) and
+ * discards the newer history. */
+
+int
+vk_rewind_restore (vk_rewind_t *rewind, vk_machine_t *mach, unsigned num_back)
+{
+	vk_state_t *latest = rewind->latest;
+	unsigned i;
+
+	if (!latest->mem_size || num_back > rewind->used)
+		return -1;
+
+	for (i = 0; i < num_back; i++) {
+		rewind->head = (rewind->head + rewind->num_slots - 1) % rewind->num_slots;
+		apply_delta (&rewind->deltas[rewind->head],
+		             latest->mem, latest->mem_size);
+	}
+	rewind->used -= num_back;
+
+	vk_state_reset_memory (latest, VK_STATE_LOAD);
+	return vk_machine_load_from_state (mach, latest);
+}
@@ -0,0 +1,52 @@
+/* 
+ * Valkyrie
+ * Copyright (C) 2011-2013, Stefano Teso
+ * 
+ * Valkyrie is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Valkyrie is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Valkyrie.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef __VK_REWIND_H__
+#define __VK_REWIND_H__
+
+#include "vk/core.h"
+#include "vk/state.h"
+#include "vk/machine.h"
+
+/* In-memory rewind history. The most recent snapshot is kept in full; older
+ * ones are stored as the XOR of consecutive snapshots, run-length encoded so
+ * that unchanged bytes cost nothing. Stepping back applies the deltas from
+ * the newest to the oldest. */
+
+typedef struct {
+	uint8_t *data;
+	uint32_t size, alloc;
+} vk_rewind_delta_t;
+
+typedef struct {
+	unsigned num_slots;
+	unsigned head, used;
+	vk_rewind_delta_t *deltas;
+
+	vk_state_t *latest;
+	vk_state_t *scratch;
+} vk_rewind_t;
+
+vk_rewind_t	*vk_rewind_new (unsigned num_slots);
+void		 vk_rewind_destroy (vk_rewind_t **rewind_);
+void		 vk_rewind_reset (vk_rewind_t *rewind);
+int		 vk_rewind_push (vk_rewind_t *rewind, vk_machine_t *mach);
+int		 vk_rewind_restore (vk_rewind_t *rewind, vk_machine_t *mach, unsigned num_back);
+unsigned	 vk_rewind_get_depth (vk_rewind_t *rewind);
+
+#endif /* __VK_REWIND_H__ */
@@ -18,15 +18,129 @@
 
 #include "vk/state.h"
 
-#define VK_STATE_VERSION	1
+#include <pthread.h>
 
-vk_state_t *
-vk_state_new (const char *path, uint32_t mode)
+#ifdef VK_HAVE_LZ4
+#include <lz4.h>
+#endif
+
+/* Version 1 states are a plain dump of the put stream; version 2 states are
+ * made of chunks. Both can be loaded, only version 2 is saved. */
+
+#define VK_STATE_VERSION	2
+
+typedef struct {
+	uint32_t type;
+	uint32_t size;
+	uint32_t packed_size;
+} vk_state_chunk_t;
+
+static const char *chunk_type_name[VK_NUM_STATE_CHUNK_TYPES] = {
+	"raw", "lz4", "zero", "base"
+};
+
+static uint32_t
+get_packed_bound (void)
+{
+#ifdef VK_HAVE_LZ4
+	return LZ4_compressBound (VK_STATE_PAGE_SIZE);
+#else
+	return VK_STATE_PAGE_SIZE;
+#endif
+}
+
+static int
+alloc_pages (vk_state_t *state)
+{
+	state->page = (uint8_t *) malloc (VK_STATE_PAGE_SIZE);
+	state->base_page = (uint8_t *) malloc (VK_STATE_PAGE_SIZE);
+	state->packed = (uint8_t *) malloc (get_packed_bound ());
+	return (state->page && state->base_page && state->packed) ? 0 : -1;
+}
+
+static int
+read_header (vk_state_t *state)
 {
 	char template[32] = "", header[32];
-	vk_state_t *state;
+	uint32_t base_len;
+	char *base_path;
+	size_t size;
+
+	size = fread ((void *) header, 1, sizeof (header), state->fp);
+	if (size != sizeof (header))
+		return -1;
+
+	for (state->version = 1; state->version <= VK_STATE_VERSION; state->version++) {
+		memset (template, 0, sizeof (template));
+		sprintf (template, "valkyrie state %08X\n", state->version);
+		if (!strcmp (template, header))
+			break;
+	}
+	if (state->version > VK_STATE_VERSION)
+		return -1;
+	if (state->version == 1)
+		return 0;
+
+	if (fread (&base_len, sizeof (base_len), 1, state->fp) != 1 ||
+	    base_len > 4096)
+		return -1;
+	if (!base_len)
+		return alloc_pages (state);
+
+	base_path = (char *) calloc (1, base_len + 1);
+	if (!base_path)
+		return -1;
+	if (fread (base_path, 1, base_len, state->fp) != base_len) {
+		free (base_path);
+		return -1;
+	}
+
+	state->base = vk_state_new (base_path, VK_STATE_LOAD);
+	if (!state->base)
+		VK_ERROR ("state: cannot open base state '%s'", base_path);
+	state->base_valid = (state->base != NULL);
+	free (base_path);
+
+	return alloc_pages (state);
+}
+
+static int
+write_header (vk_state_t *state, const char *base_path)
+{
+	char template[32] = "";
+	uint32_t base_len = base_path ? strlen (base_path) : 0;
 	size_t size;
 
+	sprintf (template, "valkyrie state %08X\n", VK_STATE_VERSION);
+	size = fwrite ((void *) template, 1, sizeof (template), state->fp);
+	if (size != sizeof (template))
+		return -1;
+
+	if (fwrite (&base_len, sizeof (base_len), 1, state->fp) != 1 ||
+	    fwrite (base_path, 1, base_len, state->fp) != base_len)
+		return -1;
+
+	state->version = VK_STATE_VERSION;
+	return alloc_pages (state);
+}
+
+static bool
+is_same_file (const char *a, const char *b)
+{
+	char *real_a = realpath (a, NULL);
+	char *real_b = realpath (b, NULL);
+	bool same = real_a && real_b && !strcmp (real_a, real_b);
+
+	free (real_a);
+	free (real_b);
+	return same;
+}
+
+static vk_state_t *
+state_new (const char *path, uint32_t mode, const char *base_path)
+{
+	vk_state_t *state;
+
 	VK_ASSERT (path);
 	VK_ASSERT (mode == VK_STATE_LOAD || mode == VK_STATE_SAVE);
 
@@ -34,20 +148,45 @@ vk_state_new (const char *path, uint32_t mode)
 	if (!state)
 		return NULL;
 
-	state->fp = fopen (path, (mode == VK_STATE_LOAD) ? "rb" : "wb");
-	if (!state->fp)
+	state->mode = mode;
+	state->path = strdup (path);
+	if (!state->path)
 		goto fail;
 
-	state->mode = mode;
+	if (base_path) {
+		/* The new state refers to the base by name, and replacing
+		 * it would leave both unreadable. */
+		if (is_same_file (path, base_path)) {
+			VK_ERROR ("state: cannot save '%s' on top of its own base", path);
+			goto fail;
+		}
+		state->base = vk_state_new (base_path, VK_STATE_LOAD);
+		if (!state->base) {
+			VK_ERROR ("state: cannot open base state '%s'", base_path);
+			goto fail;
+		}
+		state->base_valid = true;
+	}
+
+	if (mode == VK_STATE_LOAD)
+		state->fp = fopen (path, "rb");
+	else {
+		/* Never truncate an existing state before the new one is
+		 * complete. */
+		if (asprintf (&state->tmp_path, "%s.tmp", path) < 0) {
+			state->tmp_path = NULL;
+			goto fail;
+		}
+		state->fp = fopen (state->tmp_path, "wb");
+	}
+	if (!state->fp)
+		goto fail;
 
-	sprintf (template, "valkyrie state %08X\n", VK_STATE_VERSION);
 	if (mode == VK_STATE_LOAD) {
-		size = fread ((void *) header, 1, sizeof (template), state->fp);
-		if (size != sizeof (template) || strcmp (template, header))
+		if (read_header (state))
 			goto fail;
 	} else {
-		size = fwrite ((void *) template, 1, sizeof (template), state->fp);
-		if (size != sizeof (template))
+		if (write_header (state, base_path))
 			goto fail;
 	}
 
@@ -58,6 +197,22 @@ fail:
 	return NULL;
 }
 
+vk_state_t *
+vk_state_new (const char *path, uint32_t mode)
+{
+	return state_new (path, mode, NULL);
+}
+
+/* The base state is read in lockstep with the new one: each page is compared
+ * against the base page at the same stream offset, and stored as a reference
+ * if they match. The base file must not change afterwards. */
+
+vk_state_t *
+vk_state_new_with_base (const char *path, const char *base_path)
+{
+	return state_new (path, VK_STATE_SAVE, base_path);
+}
+
 void
 vk_state_destroy (vk_state_t **state_, int ret)
 {
@@ -65,32 +220,247 @@ vk_state_destroy (vk_state_t **state_, int ret)
 
 	VK_ASSERT (state_);
 	state = *state_;
+	if (!state)
+		return;
 
-	if (state->mode == VK_STATE_LOAD ||
-	    (state->mode == VK_STATE_SAVE && ret == 0))
-		fclose (state->fp);
+	if (state->fp) {
+		if (fclose (state->fp))
+			ret = -1;
+		if (state->mode == VK_STATE_SAVE) {
+			/* Don't leave truncated states around. */
+			if (ret != 0 || rename (state->tmp_path, state->path))
+				unlink (state->tmp_path);
+		}
+	}
 
+	if (state->base)
+		vk_state_destroy (&state->base, ret);
+
+	free (state->page);
+	free (state->base_page);
+	free (state->packed);
+	free (state->path);
+	free (state->tmp_path);
+	free (state->mem);
 	free (state);
 	*state_ = NULL;
 }
 
+/* A memory-backed state is a plain, growable copy of the put stream. Saving
+ * into one costs little more than a memcpy, which makes it suitable for
+ * taking snapshots while the emulation is running. */
+
+vk_state_t *
+vk_state_new_memory (void)
+{
+	vk_state_t *state;
+
+	state = ALLOC (vk_state_t);
+	if (!state)
+		return NULL;
+
+	state->mode = VK_STATE_SAVE;
+	return state;
+}
+
+/* Rewinds a memory-backed state; saving discards its contents, loading
+ * reads them again from the start. */
+
+void
+vk_state_reset_memory (vk_state_t *state, uint32_t mode)
+{
+	VK_ASSERT (state);
+	VK_ASSERT (!state->fp);
+	VK_ASSERT (mode == VK_STATE_LOAD || mode == VK_STATE_SAVE);
+
+	state->mode = mode;
+	state->mem_offs = 0;
+	if (mode == VK_STATE_SAVE)
+		state->mem_size = 0;
+}
+
+static int
+put_memory (vk_state_t *state, void *src, uint32_t size)
+{
+	if (state->mem_size + size > state->mem_alloc) {
+		size_t alloc = state->mem_alloc ? state->mem_alloc : (1 << 20);
+		uint8_t *mem;
+
+		while (alloc < state->mem_size + size)
+			alloc *= 2;
+		mem = (uint8_t *) realloc (state->mem, alloc);
+		if (!mem)
+			return -1;
+		state->mem = mem;
+		state->mem_alloc = alloc;
+	}
+
+	memcpy (&state->mem[state->mem_size], src, size);
+	state->mem_size += size;
+	return 0;
+}
+
+static int
+get_memory (vk_state_t *state, void *dst, uint32_t size)
+{
+	if (state->mem_offs + size > state->mem_size)
+		return -1;
+
+	memcpy (dst, &state->mem[state->mem_offs], size);
+	state->mem_offs += size;
+	return 0;
+}
+
+static bool
+is_zero_page (const uint8_t *page, uint32_t size)
+{
+	uint32_t i;
+
+	for (i = 0; i < size; i++)
+		if (page[i])
+			return false;
+	return true;
+}
+
+static int
+write_chunk (vk_state_t *state, uint32_t type, uint32_t size,
+             const void *data, uint32_t packed_size)
+{
+	vk_state_chunk_t chunk = { type, size, packed_size };
+
+	if (fwrite (&chunk, sizeof (chunk), 1, state->fp) != 1 ||
+	    fwrite (data, 1, packed_size, state->fp) != packed_size)
+		return -1;
+
+	state->num_chunks[type]++;
+	state->num_bytes += size;
+	state->num_packed_bytes += sizeof (chunk) + packed_size;
+	return 0;
+}
+
+static int
+flush_page (vk_state_t *state)
+{
+	uint32_t size = state->page_used;
+#ifdef VK_HAVE_LZ4
+	int ret;
+#endif
+
+	if (!size)
+		return 0;
+	state->page_used = 0;
+
+	if (state->base_valid) {
+		if (vk_state_get (state->base, state->base_page, size))
+			state->base_valid = false;
+		else if (!memcmp (state->page, state->base_page, size))
+			return write_chunk (state, VK_STATE_CHUNK_BASE, size, NULL, 0);
+	}
+
+	if (is_zero_page (state->page, size))
+		return write_chunk (state, VK_STATE_CHUNK_ZERO, size, NULL, 0);
+
+#ifdef VK_HAVE_LZ4
+	ret = LZ4_compress_default ((const char *) state->page,
+	                            (char *) state->packed,
+	                            size, get_packed_bound ());
+	if (ret > 0 && (uint32_t) ret < size)
+		return write_chunk (state, VK_STATE_CHUNK_LZ4, size,
+		                    state->packed, ret);
+#endif
+
+	return write_chunk (state, VK_STATE_CHUNK_RAW, size, state->page, size);
+}
+
+static int
+fill_page (vk_state_t *state)
+{
+	vk_state_chunk_t chunk;
+	uint8_t *base_dst;
+
+	if (fread (&chunk, sizeof (chunk), 1, state->fp) != 1)
+		return -1;
+	if (chunk.type >= VK_NUM_STATE_CHUNK_TYPES ||
+	    chunk.size == 0 || chunk.size > VK_STATE_PAGE_SIZE ||
+	    chunk.packed_size > get_packed_bound ())
+		return -1;
+
+	/* Keep the base in step even when the page is not a reference. */
+	if (state->base_valid) {
+		base_dst = (chunk.type == VK_STATE_CHUNK_BASE) ?
+		           state->page : state->base_page;
+		if (vk_state_get (state->base, base_dst, chunk.size))
+			state->base_valid = false;
+	}
+
+	switch (chunk.type) {
+	case VK_STATE_CHUNK_RAW:
+		if (chunk.packed_size != chunk.size ||
+		    fread (state->page, 1, chunk.size, state->fp) != chunk.size)
+			return -1;
+		break;
+	case VK_STATE_CHUNK_LZ4:
+#ifdef VK_HAVE_LZ4
+		if (fread (state->packed, 1, chunk.packed_size, state->fp) !=
+		    chunk.packed_size)
+			return -1;
+		if (LZ4_decompress_safe ((const char *) state->packed,
+		                         (char *) state->page,
+		                         chunk.packed_size,
+		                         VK_STATE_PAGE_SIZE) != chunk.size)
+			return -1;
+		break;
+#else
+		VK_ERROR ("state: LZ4 support not compiled in");
+		return -1;
+#endif
+	case VK_STATE_CHUNK_ZERO:
+		memset (state->page, 0, chunk.size);
+		break;
+	case VK_STATE_CHUNK_BASE:
+		if (!state->base_valid)
+			return -1;
+		break;
+	}
+
+	state->num_chunks[chunk.type]++;
+	state->page_used = chunk.size;
+	state->page_offs = 0;
+	return 0;
+}
+
 int
 vk_state_put (vk_state_t *state, void *src, uint32_t size)
 {
-	size_t num;
+	uint8_t *bytes = (uint8_t *) src;
+	uint32_t len;
 
 	if (state->mode != VK_STATE_SAVE)
 		return -1;
 
 	VK_LOG ("state: W%08X %p", size, src);
 
-	num = fwrite (src, 1, size, state->fp);
-	return (num != size || ferror (state->fp)) ? -1 : 0;
+	if (!state->fp)
+		return put_memory (state, src, size);
+
+	while (size) {
+		len = MIN2 (size, VK_STATE_PAGE_SIZE - state->page_used);
+		memcpy (&state->page[state->page_used], bytes, len);
+		state->page_used += len;
+		bytes += len;
+		size -= len;
+
+		if (state->page_used == VK_STATE_PAGE_SIZE && flush_page (state))
+			return -1;
+	}
+	return 0;
 }
 
 int
 vk_state_get (vk_state_t *state, void *dst, uint32_t size)
 {
+	uint8_t *bytes = (uint8_t *) dst;
+	uint32_t len;
 	size_t num;
 
 	if (state->mode != VK_STATE_LOAD)
@@ -98,6 +468,193 @@ vk_state_get (vk_state_t *state, void *dst, uint32_t size)
 
 	VK_LOG ("state: R%08X %p", size, dst);
 
-	num = fread (dst, 1, size, state->fp);
-	return (num != size || ferror (state->fp)) ? -1 : 0;
+	if (!state->fp)
+		return get_memory (state, dst, size);
+
+	if (state->version == 1) {
+		num = fread (dst, 1, size, state->fp);
+		return (num != size || ferror (state->fp)) ? -1 : 0;
+	}
+
+	while (size) {
+		if (state->page_offs == state->page_used && fill_page (state))
+			return -1;
+
+		len = MIN2 (size, state->page_used - state->page_offs);
+		memcpy (bytes, &state->page[state->page_offs], len);
+		state->page_offs += len;
+		bytes += len;
+		size -= len;
+	}
+	return 0;
+}
+
+/* Writes out the last partial page. Must be called once all data has been
+ * put, before destroying a state being saved. */
+
+int
+vk_state_finish (vk_state_t *state)
+{
+	unsigned i;
+
+	if (state->mode != VK_STATE_SAVE || !state->fp)
+		return 0;
+
+	if (flush_page (state) || fflush (state->fp) || ferror (state->fp))
+		return -1;
+
+	VK_LOG ("state: %llu bytes packed into %llu",
+	        (unsigned long long) state->num_bytes,
+	        (unsigned long long) state->num_packed_bytes);
+	for (i = 0; i < VK_NUM_STATE_CHUNK_TYPES; i++)
+		VK_LOG ("state:   %5u %s pages",
+		        state->num_chunks[i], chunk_type_name[i]);
+	return 0;
+}
+
+/* The writer compresses and writes out a memory snapshot on a background
+ * thread, so that saving a state doesn't stall the emulation. Only one save
+ * can be in flight at a time. */
+
+struct vk_state_writer_t {
+	pthread_t thread;
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	bool busy, done;
+	int ret;
+
+	vk_state_t *snapshot;
+	char *path, *base_path;
+};
+
+vk_state_writer_t *
+vk_state_writer_new (void)
+{
+	vk_state_writer_t *writer;
+
+	writer = ALLOC (vk_state_writer_t);
+	if (!writer)
+		return NULL;
+
+	writer->snapshot = vk_state_new_memory ();
+	if (!writer->snapshot) {
+		free (writer);
+		return NULL;
+	}
+
+	pthread_mutex_init (&writer->lock, NULL);
+	pthread_cond_init (&writer->cond, NULL);
+	return writer;
+}
+
+void
+vk_state_writer_destroy (vk_state_writer_t **writer_)
+{
+	vk_state_writer_t *writer;
+	int ret;
+
+	VK_ASSERT (writer_);
+	writer = *writer_;
+	if (!writer)
+		return;
+
+	vk_state_writer_poll (writer, true, &ret);
+
+	pthread_cond_destroy (&writer->cond);
+	pthread_mutex_destroy (&writer->lock);
+	vk_state_destroy (&writer->snapshot, 0);
+	free (writer->path);
+	free (writer->base_path);
+	free (writer);
+	*writer_ = NULL;
+}
+
+/* Returns the memory state to serialize the machine into, or NULL if the
+ * previous save is still being written. */
+
+vk_state_t *
+vk_state_writer_get_snapshot (vk_state_writer_t *writer)
+{
+	if (writer->busy)
+		return NULL;
+
+	vk_state_reset_memory (writer->snapshot, VK_STATE_SAVE);
+	return writer->snapshot;
+}
+
+static void *
+writer_thread (void *arg)
+{
+	vk_state_writer_t *writer = (vk_state_writer_t *) arg;
+	vk_state_t *snapshot = writer->snapshot, *state;
+	int ret = -1;
+
+	state = writer->base_path ?
+	        vk_state_new_with_base (writer->path, writer->base_path) :
+	        vk_state_new (writer->path, VK_STATE_SAVE);
+	if (state) {
+		ret = vk_state_put (state, snapshot->mem, snapshot->mem_size);
+		if (!ret)
+			ret = vk_state_finish (state);
+		vk_state_destroy (&state, ret);
+	}
+
+	pthread_mutex_lock (&writer->lock);
+	writer->ret = ret;
+	writer->done = true;
+	pthread_cond_signal (&writer->cond);
+	pthread_mutex_unlock (&writer->lock);
+	return NULL;
+}
+
+/* Starts writing the snapshot to PATH. */
+
+int
+vk_state_writer_start (vk_state_writer_t *writer, const char *path,
+                       const char *base_path)
+{
+	VK_ASSERT (path);
+
+	if (writer->busy)
+		return -1;
+
+	free (writer->path);
+	free (writer->base_path);
+	writer->path = strdup (path);
+	writer->base_path = base_path ? strdup (base_path) : NULL;
+	if (!writer->path || (base_path && !writer->base_path))
+		return -1;
+
+	writer->done = false;
+	if (pthread_create (&writer->thread, NULL, writer_thread, writer))
+		return -1;
+
+	writer->busy = true;
+	return 0;
+}
+
+/* Returns true if a save has completed since the last call, and stores its
+ * result in RET. If WAIT is true, blocks until the pending save is done. */
+
+bool
+vk_state_writer_poll (vk_state_writer_t *writer, bool wait, int *ret)
+{
+	bool done;
+
+	if (!writer->busy)
+		return false;
+
+	pthread_mutex_lock (&writer->lock);
+	while (wait && !writer->done)
+		pthread_cond_wait (&writer->cond, &writer->lock);
+	done = writer->done;
+	pthread_mutex_unlock (&writer->lock);
+
+	if (!done)
+		return false;
+
+	pthread_join (writer->thread, NULL);
+	writer->busy = false;
+	*ret = writer->ret;
+	return true;
 }
@@ -24,14 +24,67 @@
 #define VK_STATE_SAVE	(0 << 0)
 #define VK_STATE_LOAD	(1 << 0)
 
-typedef struct {
+/* State data is written as a sequence of chunks, each holding one page of
+ * the put/get stream. A page may be stored raw, LZ4-compressed, as a run of
+ * zeroes, or as a reference to the page at the same stream offset in a base
+ * state; the latter makes periodic checkpoints of a long run cheap. */
+
+#define VK_STATE_PAGE_SIZE	(64 * 1024)
+
+typedef enum {
+	VK_STATE_CHUNK_RAW,
+	VK_STATE_CHUNK_LZ4,
+	VK_STATE_CHUNK_ZERO,
+	VK_STATE_CHUNK_BASE,
+
+	VK_NUM_STATE_CHUNK_TYPES
+} vk_state_chunk_type_t;
+
+typedef struct vk_state_t vk_state_t;
+
+struct vk_state_t {
 	uint32_t mode;
+	uint32_t version;
+	char *path;
+	/* Saved states are written here and renamed to PATH on success. */
+	char *tmp_path;
 	FILE *fp;
-} vk_state_t;
+
+	vk_state_t *base;
+	bool base_valid;
+
+	uint8_t *page;
+	uint8_t *base_page;
+	uint8_t *packed;
+	uint32_t page_used;
+	uint32_t page_offs;
+
+	uint32_t num_chunks[VK_NUM_STATE_CHUNK_TYPES];
+	uint64_t num_bytes, num_packed_bytes;
+
+	/* Memory-backed states keep the raw put stream here; FP is NULL. */
+	uint8_t *mem;
+	size_t mem_size, mem_alloc, mem_offs;
+};
+
+typedef struct vk_state_writer_t vk_state_writer_t;
 
 vk_state_t	*vk_state_new (const char *path, uint32_t mode);
+vk_state_t	*vk_state_new_with_base (const char *path, const char *base_path);
+vk_state_t	*vk_state_new_memory (void);
+void		 vk_state_reset_memory (vk_state_t *state, uint32_t mode);
 int		 vk_state_put (vk_state_t *state, void *src, uint32_t size);
 int		 vk_state_get (vk_state_t *state, void *dst, uint32_t size);
+int		 vk_state_finish (vk_state_t *state);
 void		 vk_state_destroy (vk_state_t **state_, int ret);
 
+vk_state_writer_t	*vk_state_writer_new (void);
+void			 vk_state_writer_destroy (vk_state_writer_t **writer_);
+vk_state_t		*vk_state_writer_get_snapshot (vk_state_writer_t *writer);
+int			 vk_state_writer_start (vk_state_writer_t *writer,
+			                        const char *path,
+			                        const char *base_path);
+bool			 vk_state_writer_poll (vk_state_writer_t *writer,
+			                       bool wait, int *ret);
+
 #endif /* __VK_STATE_H__ */
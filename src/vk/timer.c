@@ -0,0 +1,72 @@
+/* 
+ * Valkyrie
+ * Copyright (C) 2011, 2012, Stefano Teso
+ * 
+ * Valkyrie is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Valkyrie is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Valkyrie.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "vk/timer.h"
+
+#define MAX_TIMERS 32
+
+bool vk_timer_enabled = false;
+
+static vk_timer_t timers[MAX_TIMERS];
+static unsigned num_timers = 0;
+
+/* Return the timer called name, registering it on first use. Names are
+ * not copied, and must outlive the timer. */
+
+vk_timer_t *
+vk_timer_get (const char *name)
+{
+	unsigned i;
+
+	VK_ASSERT (name);
+
+	for (i = 0; i < num_timers; i++)
+		if (!strcmp (timers[i].name, name))
+			return &timers[i];
+
+	VK_ASSERT (num_timers < MAX_TIMERS);
+
+	timers[num_timers].name = name;
+	timers[num_timers].id = num_timers;
+	vk_trace_set_key_name (VK_TRACE_BEGIN, num_timers, name);
+	vk_trace_set_key_name (VK_TRACE_END, num_timers, name);
+	return &timers[num_timers++];
+}
+
+vk_timer_t *
+vk_timer_get_nth (unsigned i)
+{
+	return (i < num_timers) ? &timers[i] : NULL;
+}
+
+void
+vk_timer_set_enabled (bool enabled)
+{
+	vk_timer_enabled = enabled;
+}
+
+void
+vk_timer_reset_all (void)
+{
+	unsigned i;
+
+	for (i = 0; i < num_timers; i++) {
+		timers[i].total = 0;
+		timers[i].count = 0;
+	}
+}
@@ -0,0 +1,63 @@
+/* 
+ * Valkyrie
+ * Copyright (C) 2011, 2012, Stefano Teso
+ * 
+ * Valkyrie is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Valkyrie is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Valkyrie.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef __VK_TIMER_H__
+#define __VK_TIMER_H__
+
+#include "vk/core.h"
+#include "vk/trace.h"
+
+/* Wall-clock accumulators for profiling the emulated components. Timers
+ * are registered by name, and cost a single branch unless timing has been
+ * enabled with vk_timer_set_enabled (). When tracing is enabled, each
+ * timed section is also recorded as a VK_TRACE_BEGIN/END pair. */
+
+typedef struct {
+	const char *name;
+	unsigned id;
+	uint64_t start;
+	uint64_t total;
+	uint64_t count;
+} vk_timer_t;
+
+extern bool vk_timer_enabled;
+
+static inline void
+vk_timer_begin (vk_timer_t *timer)
+{
+	vk_trace_event (VK_TRACE_BEGIN, timer->id, 0);
+	if (vk_timer_enabled)
+		timer->start = vk_util_get_ns ();
+}
+
+static inline void
+vk_timer_end (vk_timer_t *timer)
+{
+	if (vk_timer_enabled) {
+		timer->total += vk_util_get_ns () - timer->start;
+		timer->count++;
+	}
+	vk_trace_event (VK_TRACE_END, timer->id, 0);
+}
+
+vk_timer_t	*vk_timer_get (const char *name);
+vk_timer_t	*vk_timer_get_nth (unsigned i);
+void		 vk_timer_set_enabled (bool enabled);
+void		 vk_timer_reset_all (void);
+
+#endif /* __VK_TIMER_H__ */
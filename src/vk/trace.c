@@ -0,0 +1,293 @@
+/* 
+ * Valkyrie
+ * Copyright (C) 2011, 2012, Stefano Teso
+ * 
+ * Valkyrie is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Valkyrie is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Valkyrie.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "vk/trace.h"
+
+#include <pthread.h>
+
+bool vk_trace_enabled = false;
+__thread vk_trace_thread_t *vk_trace_thread = NULL;
+
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static vk_trace_thread_t *threads = NULL;
+static unsigned num_threads = 0;
+
+static const char *type_names[VK_TRACE_NUM_TYPES] = {
+	"mmap-get",
+	"mmap-put",
+	"irq-raise",
+	"irq-take",
+	"cp-insn",
+	"mesh",
+	"draw",
+	"tex-upload",
+	"begin",
+	"end",
+	"hblank",
+	"vblank-in",
+	"vblank-out",
+	"cp-begin",
+	"cp-end",
+	"idma",
+};
+
+static const char *key_names[VK_TRACE_NUM_TYPES][VK_TRACE_NUM_KEYS];
+
+void
+vk_trace_init (void)
+{
+	vk_trace_enabled = vk_util_get_bool_option ("VK_TRACE", false);
+#ifndef VK_HAVE_TRACE
+	if (vk_trace_enabled)
+		VK_ERROR ("trace: not compiled in, ignoring VK_TRACE");
+	vk_trace_enabled = false;
+#endif
+}
+
+/* Allocate the calling thread's counters and ring buffer, and add them to
+ * the list walked by vk_trace_dump (). */
+
+vk_trace_thread_t *
+vk_trace_attach_thread (void)
+{
+	vk_trace_thread_t *thread;
+
+	VK_ASSERT (!vk_trace_thread);
+
+	thread = ALLOC (vk_trace_thread_t);
+	if (!thread) {
+		VK_ERROR ("trace: out of memory, disabling");
+		vk_trace_enabled = false;
+		return NULL;
+	}
+
+	pthread_mutex_lock (&lock);
+	thread->id = num_threads++;
+	thread->next = threads;
+	threads = thread;
+	pthread_mutex_unlock (&lock);
+
+	vk_trace_thread = thread;
+	return thread;
+}
+
+void
+vk_trace_set_key_name (vk_trace_type_t type, unsigned key, const char *name)
+{
+	VK_ASSERT (type < VK_TRACE_NUM_TYPES);
+	VK_ASSERT (key < VK_TRACE_NUM_KEYS);
+
+	key_names[type][key] = name;
+}
+
+static uint64_t
+get_oldest_event (vk_trace_thread_t *thread)
+{
+	uint64_t num = MIN2 (thread->num_events, (uint64_t) VK_TRACE_RING_SIZE);
+	return thread->num_events - num;
+}
+
+static int
+dump_counters (vk_trace_thread_t *thread, FILE *fp)
+{
+	unsigned type, key;
+
+	for (type = 0; type < VK_TRACE_NUM_TYPES; type++)
+		for (key = 0; key < VK_TRACE_NUM_KEYS; key++) {
+			uint64_t count = thread->counters[type][key];
+			const char *name = key_names[type][key];
+			if (!count)
+				continue;
+			fprintf (fp, "%u\t%s\t%u\t%s\t%llu\n",
+			         thread->id, type_names[type], key,
+			         name ? name : "-", (unsigned long long) count);
+		}
+	return ferror (fp) ? -1 : 0;
+}
+
+/* The event file starts with a 32-byte header, then holds for each thread
+ * its id, the number of events that follow, and the events themselves,
+ * oldest first. */
+
+static int
+dump_events (vk_trace_thread_t *thread, FILE *fp)
+{
+	uint64_t first, num, i;
+	uint32_t header[2];
+
+	first = get_oldest_event (thread);
+	num = thread->num_events - first;
+
+	header[0] = thread->id;
+	header[1] = (uint32_t) num;
+	fwrite (header, sizeof (header), 1, fp);
+
+	for (i = first; i < thread->num_events; i++)
+		fwrite (&thread->ring[i % VK_TRACE_RING_SIZE],
+		        sizeof (vk_trace_event_t), 1, fp);
+
+	return ferror (fp) ? -1 : 0;
+}
+
+/* Chrome's trace viewer and Perfetto show each (pid, tid) pair as a
+ * track. Every traced thread gets a pid; within it, timed sections get a
+ * track per timer, CP activity gets its own, and all other events are
+ * instants on the first track. */
+
+enum {
+	TRACK_EVENTS,
+	TRACK_CP,
+	TRACK_TIMERS
+};
+
+static void
+export_track_name (FILE *fp, unsigned pid, unsigned tid, const char *name)
+{
+	fprintf (fp, ",\n{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":%u,\"tid\":%u,"
+	         "\"args\":{\"name\":\"%s\"}}", pid, tid, name);
+}
+
+static void
+export_event (FILE *fp, unsigned pid, vk_trace_event_t *event, uint64_t base)
+{
+	const char *name = key_names[event->type][event->key % VK_TRACE_NUM_KEYS];
+	double ts = (event->time - base) * 1e-3;
+
+	switch (event->type) {
+	case VK_TRACE_BEGIN:
+	case VK_TRACE_END:
+		fprintf (fp, ",\n{\"name\":\"%s\",\"ph\":\"%c\",\"ts\":%.3f,\"pid\":%u,\"tid\":%u}",
+		         name ? name : "?",
+		         (event->type == VK_TRACE_BEGIN) ? 'B' : 'E',
+		         ts, pid, TRACK_TIMERS + event->key);
+		break;
+	case VK_TRACE_CP_BEGIN:
+	case VK_TRACE_CP_END:
+		fprintf (fp, ",\n{\"name\":\"cp\",\"ph\":\"%c\",\"ts\":%.3f,\"pid\":%u,\"tid\":%u,"
+		         "\"args\":{\"pc\":\"%08X\"}}",
+		         (event->type == VK_TRACE_CP_BEGIN) ? 'B' : 'E',
+		         ts, pid, TRACK_CP, event->arg);
+		break;
+	default:
+		fprintf (fp, ",\n{\"name\":\"%s%s%s\",\"ph\":\"i\",\"s\":\"t\",\"ts\":%.3f,"
+		         "\"pid\":%u,\"tid\":%u,\"args\":{\"key\":%u,\"arg\":\"%08X\"}}",
+		         type_names[event->type], name ? " " : "", name ? name : "",
+		         ts, pid, TRACK_EVENTS, event->key, event->arg);
+		break;
+	}
+}
+
+/* Write the buffered events in the Chrome trace event JSON format, which
+ * both chrome://tracing and the Perfetto UI load. */
+
+int
+vk_trace_export_chrome (const char *path)
+{
+	vk_trace_thread_t *thread;
+	uint64_t base = ~0ull, i;
+	unsigned key;
+	FILE *fp;
+	int ret;
+
+	fp = fopen (path, "w");
+	if (!fp) {
+		VK_ERROR ("trace: could not open '%s'", path);
+		return -1;
+	}
+
+	pthread_mutex_lock (&lock);
+
+	for (thread = threads; thread; thread = thread->next)
+		if (thread->num_events) {
+			i = get_oldest_event (thread) % VK_TRACE_RING_SIZE;
+			base = MIN2 (base, thread->ring[i].time);
+		}
+
+	fprintf (fp, "{\"displayTimeUnit\":\"ns\",\"traceEvents\":[\n");
+	fprintf (fp, "{\"name\":\"process_name\",\"ph\":\"M\",\"pid\":0,"
+	         "\"args\":{\"name\":\"valkyrie\"}}");
+
+	for (thread = threads; thread; thread = thread->next) {
+		export_track_name (fp, thread->id, TRACK_EVENTS, "events");
+		export_track_name (fp, thread->id, TRACK_CP, "cp");
+		for (key = 0; key < VK_TRACE_NUM_KEYS - TRACK_TIMERS; key++)
+			if (key_names[VK_TRACE_BEGIN][key])
+				export_track_name (fp, thread->id, TRACK_TIMERS + key,
+				                   key_names[VK_TRACE_BEGIN][key]);
+
+		for (i = get_oldest_event (thread); i < thread->num_events; i++)
+			export_event (fp, thread->id,
+			              &thread->ring[i % VK_TRACE_RING_SIZE], base);
+	}
+
+	pthread_mutex_unlock (&lock);
+
+	fprintf (fp, "\n]}\n");
+	ret = ferror (fp) ? -1 : 0;
+	fclose (fp);
+	return ret;
+}
+
+/* Write PREFIX-counters.tsv, one line per non-zero counter,
+ * PREFIX-events.bin, and PREFIX.json for timeline viewers. */
+
+int
+vk_trace_dump (const char *prefix)
+{
+	vk_trace_thread_t *thread;
+	char path[256], header[32];
+	FILE *counters = NULL, *events = NULL;
+	int ret = -1;
+
+	if (!threads)
+		return 0;
+
+	snprintf (path, sizeof (path), "%s-counters.tsv", prefix);
+	counters = fopen (path, "w");
+	snprintf (path, sizeof (path), "%s-events.bin", prefix);
+	events = fopen (path, "wb");
+	if (!counters || !events) {
+		VK_ERROR ("trace: could not open the dump files for '%s'", prefix);
+		goto fail;
+	}
+
+	memset (header, 0, sizeof (header));
+	snprintf (header, sizeof (header), "valkyrie trace %u\n",
+	          (unsigned) sizeof (vk_trace_event_t));
+	fwrite (header, sizeof (header), 1, events);
+
+	pthread_mutex_lock (&lock);
+	ret = 0;
+	for (thread = threads; thread; thread = thread->next) {
+		ret |= dump_counters (thread, counters);
+		ret |= dump_events (thread, events);
+	}
+	pthread_mutex_unlock (&lock);
+
+	snprintf (path, sizeof (path), "%s.json", prefix);
+	ret |= vk_trace_export_chrome (path);
+
+	if (!ret)
+		VK_PRINT ("trace: dumped to '%s-*'", prefix);
+fail:
+	if (counters)
+		fclose (counters);
+	if (events)
+		fclose (events);
+	return ret;
+}
@@ -0,0 +1,116 @@
+/* 
+ * Valkyrie
+ * Copyright (C) 2011, 2012, Stefano Teso
+ * 
+ * Valkyrie is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Valkyrie is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Valkyrie.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef __VK_TRACE_H__
+#define __VK_TRACE_H__
+
+#include "vk/core.h"
+
+/* Hot-path instrumentation. Each thread owns a table of counters, indexed
+ * by event type and key, and a ring buffer of the most recent timestamped
+ * events. Both are compiled in only with VK_HAVE_TRACE, and cost a single
+ * branch unless tracing is enabled at run time (VK_TRACE=1).
+ *
+ * Counters are for events too frequent to timestamp (memory accesses, CP
+ * instructions); vk_trace_event () both counts and records the event. */
+
+typedef enum {
+	VK_TRACE_MMAP_GET,	/* key = region */
+	VK_TRACE_MMAP_PUT,	/* key = region */
+	VK_TRACE_IRQ_RAISE,	/* key = IRQ source, arg = IRQ code */
+	VK_TRACE_IRQ_TAKE,	/* key = IRQ source, arg = handler PC */
+	VK_TRACE_CP_INSN,	/* key = opcode */
+	VK_TRACE_MESH,		/* key = viewport, arg = triangles */
+	VK_TRACE_DRAW,		/* key = batched meshes, arg = vertices */
+	VK_TRACE_TEX_UPLOAD,	/* key = format, arg = width << 16 | height */
+	VK_TRACE_BEGIN,		/* key = timer */
+	VK_TRACE_END,		/* key = timer */
+	VK_TRACE_HBLANK,	/* key = line */
+	VK_TRACE_VBLANK_IN,
+	VK_TRACE_VBLANK_OUT,
+	VK_TRACE_CP_BEGIN,	/* arg = CP PC */
+	VK_TRACE_CP_END,	/* arg = CP PC */
+	VK_TRACE_IDMA,		/* key = format, arg = width << 16 | height */
+
+	VK_TRACE_NUM_TYPES
+} vk_trace_type_t;
+
+#define VK_TRACE_NUM_KEYS	4096
+#define VK_TRACE_RING_SIZE	(1 << 18)
+
+typedef struct {
+	uint64_t time;
+	uint16_t type;
+	uint16_t key;
+	uint32_t arg;
+} vk_trace_event_t;
+
+typedef struct vk_trace_thread_t vk_trace_thread_t;
+
+struct vk_trace_thread_t {
+	vk_trace_thread_t *next;
+	unsigned id;
+	uint64_t num_events;
+	uint64_t counters[VK_TRACE_NUM_TYPES][VK_TRACE_NUM_KEYS];
+	vk_trace_event_t ring[VK_TRACE_RING_SIZE];
+};
+
+extern bool vk_trace_enabled;
+extern __thread vk_trace_thread_t *vk_trace_thread;
+
+void			 vk_trace_init (void);
+vk_trace_thread_t	*vk_trace_attach_thread (void);
+void			 vk_trace_set_key_name (vk_trace_type_t type, unsigned key, const char *name);
+int			 vk_trace_dump (const char *prefix);
+int			 vk_trace_export_chrome (const char *path);
+
+static inline void
+vk_trace_count (vk_trace_type_t type, unsigned key)
+{
+#ifdef VK_HAVE_TRACE
+	if (vk_trace_enabled) {
+		vk_trace_thread_t *thread = vk_trace_thread;
+		if (!thread && !(thread = vk_trace_attach_thread ()))
+			return;
+		thread->counters[type][key % VK_TRACE_NUM_KEYS]++;
+	}
+#endif
+}
+
+static inline void
+vk_trace_event (vk_trace_type_t type, unsigned key, uint32_t arg)
+{
+#ifdef VK_HAVE_TRACE
+	if (vk_trace_enabled) {
+		vk_trace_thread_t *thread = vk_trace_thread;
+		vk_trace_event_t *event;
+
+		if (!thread && !(thread = vk_trace_attach_thread ()))
+			return;
+		thread->counters[type][key % VK_TRACE_NUM_KEYS]++;
+
+		event = &thread->ring[thread->num_events++ % VK_TRACE_RING_SIZE];
+		event->time = vk_util_get_ns ();
+		event->type = type;
+		event->key = key;
+		event->arg = arg;
+	}
+#endif
+}
+
+#endif /* __VK_TRACE_H__ */